@@ -5,6 +5,8 @@
 #include <limits>
 
 namespace addn {
+// NOTE: DN carries a single tangent. FK derivatives along every state dimension at once come from
+// structures::scenegraph::Graph::jacobians, which is cheaper than carrying many tangents through FK
 struct DN {
   double v;
   double a;
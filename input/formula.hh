@@ -29,15 +29,14 @@ end)FUNCFORM";
     : normal_def(make_normal_definition(name, bindings, body))
     , name(name)
     , body(body)
+    , bindings(bindings)
     , normal_fn_name(fmt::format("{}_formula", name))
     , grad_fn_name(fmt::format("{}_gradient", name)) {}
     const std::string normal_def;
     const std::string name;
     const std::string body;
+    const std::vector<std::string> bindings;
 
-    // This is because a single formula may be loaded into multiple environments
-    std::unordered_map<std::string, LuaRef> gradient_fn;
-    std::unordered_map<std::string, LuaRef> normal_fn;
     const std::string normal_fn_name;
     const std::string grad_fn_name;
 
@@ -0,0 +1,169 @@
+#include "octree.hh"
+
+#ifdef USE_OCTOMAP
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+
+#include <octomap/AbstractOcTree.h>
+
+// clang-format off
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
+// clang-format on
+
+namespace input::octree {
+namespace {
+  auto log = spdlog::stdout_color_mt("octree");
+
+  /// Read the points of an ASCII PCD file, using the positions of its x, y, and z fields
+  Vec<octomap::point3d> read_pcd(std::ifstream& points_file, const Str& path) {
+    Str line;
+    std::array<int, 3> xyz_fields{-1, -1, -1};
+    bool found_data = false;
+    while (std::getline(points_file, line)) {
+      std::istringstream line_stream(line);
+      Str key;
+      line_stream >> key;
+      if (key == "FIELDS") {
+        Str field;
+        for (int i = 0; line_stream >> field; ++i) {
+          if (field.size() == 1 && field[0] >= 'x' && field[0] <= 'z') {
+            xyz_fields[field[0] - 'x'] = i;
+          }
+        }
+      } else if (key == "DATA") {
+        Str format;
+        line_stream >> format;
+        if (format != "ascii") {
+          log->error("Unsupported PCD data format '{}' in {}", format, path);
+          throw std::runtime_error("Unsupported PCD data format");
+        }
+
+        found_data = true;
+        break;
+      }
+    }
+
+    if (!found_data || *std::min_element(xyz_fields.begin(), xyz_fields.end()) < 0) {
+      log->error("Malformed PCD header in {}", path);
+      throw std::runtime_error("Malformed PCD file");
+    }
+
+    const auto num_fields = *std::max_element(xyz_fields.begin(), xyz_fields.end()) + 1;
+    Vec<octomap::point3d> result;
+    Vec<double> values(num_fields);
+    while (std::getline(points_file, line)) {
+      std::istringstream line_stream(line);
+      int i = 0;
+      for (; i < num_fields && line_stream >> values[i]; ++i) {}
+      if (i == num_fields) {
+        result.emplace_back(values[xyz_fields[0]], values[xyz_fields[1]], values[xyz_fields[2]]);
+      }
+    }
+
+    return result;
+  }
+
+  Vec<octomap::point3d> read_xyz(std::ifstream& points_file) {
+    Vec<octomap::point3d> result;
+    Str line;
+    while (std::getline(points_file, line)) {
+      std::istringstream line_stream(line);
+      double x, y, z;
+      if (line_stream >> x >> y >> z) {
+        result.emplace_back(x, y, z);
+      }
+    }
+
+    return result;
+  }
+}  // namespace
+
+OctreeShape::OctreeShape(const octomap::OcTree& tree, const double margin)
+: btCompoundShape(true, static_cast<int>(tree.getNumLeafNodes())) {
+  Map<unsigned int, btBoxShape*> depth_boxes;
+  btTransform leaf_pose;
+  leaf_pose.setIdentity();
+  for (auto leaf = tree.begin_leafs(), end = tree.end_leafs(); leaf != end; ++leaf) {
+    if (!tree.isNodeOccupied(*leaf)) {
+      continue;
+    }
+
+    auto& box = depth_boxes[leaf.getDepth()];
+    if (box == nullptr) {
+      const auto half_size = 0.5 * leaf.getSize();
+      boxes.emplace_back(std::make_unique<btBoxShape>(btVector3(half_size, half_size, half_size)));
+      box = boxes.back().get();
+      box->setMargin(margin);
+    }
+
+    const auto center = leaf.getCoordinate();
+    leaf_pose.setOrigin(btVector3(center.x(), center.y(), center.z()));
+    addChildShape(leaf_pose, box);
+  }
+
+  setMargin(margin);
+  recalculateLocalAabb();
+}
+
+std::shared_ptr<octomap::OcTree> load_octree(const Str& path, const double resolution) {
+  const auto extension = boost::filesystem::path(path).extension().string();
+  if (extension == ".bt") {
+    auto tree = std::make_shared<octomap::OcTree>(resolution);
+    if (!tree->readBinary(path)) {
+      log->error("Failed to read binary octree from {}", path);
+      throw std::runtime_error("Failed to read octree");
+    }
+
+    return tree;
+  }
+
+  if (extension == ".ot") {
+    std::unique_ptr<octomap::AbstractOcTree> abstract_tree(octomap::AbstractOcTree::read(path));
+    auto* tree = dynamic_cast<octomap::OcTree*>(abstract_tree.get());
+    if (tree == nullptr) {
+      log->error("{} does not contain an occupancy octree", path);
+      throw std::runtime_error("Failed to read octree");
+    }
+
+    abstract_tree.release();
+    return std::shared_ptr<octomap::OcTree>(tree);
+  }
+
+  std::ifstream points_file(path);
+  if (!points_file) {
+    log->error("Could not open point file {}", path);
+    throw std::runtime_error("Failed to read point file");
+  }
+
+  Vec<octomap::point3d> points;
+  if (extension == ".pcd") {
+    points = read_pcd(points_file, path);
+  } else if (extension == ".xyz") {
+    points = read_xyz(points_file);
+  } else {
+    log->error("Unknown octree file type '{}' for {}", extension, path);
+    throw std::runtime_error("Unknown octree file type");
+  }
+
+  // NOTE: Points are only marked occupied; we have no sensor origin to ray cast free space from
+  auto tree = std::make_shared<octomap::OcTree>(resolution);
+  for (const auto& point : points) {
+    tree->updateNode(point, true, true);
+  }
+
+  tree->updateInnerOccupancy();
+  tree->prune();
+  log->debug("Built octree with {} leafs from {} points in {}",
+             tree->getNumLeafNodes(),
+             points.size(),
+             path);
+  return tree;
+}
+}  // namespace input::octree
+#endif
@@ -0,0 +1,29 @@
+#pragma once
+#ifndef OCTREE_HH
+#define OCTREE_HH
+#include "common.hh"
+
+#include <memory>
+
+#include <bullet/btBulletCollisionCommon.h>
+
+#include <octomap/OcTree.h>
+
+namespace input::octree {
+/// Compound of one box per occupied octree leaf. Leafs of the same size share a box, and the
+/// compound's internal AABB tree lets Bullet query the leafs hierarchically while the broadphase
+/// only ever sees one object
+class OctreeShape : public btCompoundShape {
+ public:
+  OctreeShape(const octomap::OcTree& tree, double margin);
+  std::size_t num_leafs() const { return getNumChildShapes(); }
+
+ private:
+  Vec<std::unique_ptr<btBoxShape>> boxes;
+};
+
+/// Load an occupancy octree from an OctoMap (.bt or .ot) file, or build one at the given
+/// resolution from a point file (ASCII .pcd, or .xyz with one point per line)
+std::shared_ptr<octomap::OcTree> load_octree(const Str& path, double resolution);
+}  // namespace input::octree
+#endif
@@ -33,6 +33,10 @@
 #include <urdf_model/joint.h>
 #include <urdf_parser/urdf_parser.h>
 
+#ifdef USE_OCTOMAP
+#include "octree.hh"
+#endif
+
 namespace input::scene {
 // TODO(Wil): Should pose/surface/grasp info be bundled into Objects or contained separately for
 // faster searches?
@@ -40,6 +44,10 @@ namespace {
   auto log = spdlog::stdout_color_mt("scene");
   // NOTE: Taken from ImportURDFDemo in Bullet repo
   constexpr float DEFAULT_COLLISION_MARGIN = 0.001;
+#ifdef USE_OCTOMAP
+  // Leaf size for octrees built from point files
+  constexpr double DEFAULT_OCTREE_RESOLUTION = 0.05;
+#endif
 
   template <int dim> inline auto parse_template(const Vec<Str>& elems);
   template <> inline auto parse_template<3>(const Vec<Str>& elems) {
@@ -73,6 +81,19 @@ namespace {
     return result;
   }
 
+  inline btTransform bt_of_transform(const Transform3r& transform) {
+    btTransform result;
+    auto& origin            = result.getOrigin();
+    const auto& translation = transform.translation();
+    origin.setX(translation.x());
+    origin.setY(translation.y());
+    origin.setZ(translation.z());
+    const Eigen::Quaterniond eigen_rotation(transform.linear());
+    result.setRotation(
+    btQuaternion(eigen_rotation.x(), eigen_rotation.y(), eigen_rotation.z(), eigen_rotation.w()));
+    return result;
+  }
+
   inline auto parse_point(const tinyxml2::XMLNode* point_node) {
     auto x = point_node->FirstChildElement("x")->Value();
     auto y = point_node->FirstChildElement("y")->Value();
@@ -429,20 +450,42 @@ namespace {
 
     result.geom = parse_obj_mesh(geom_path, obj_dir, urdf::Vector3(1.0, 1.0, 1.0), true);
     const Transform3r eigen_transform(transform_mat);
-    btTransform pose_transform;
-    auto& pose_origin            = pose_transform.getOrigin();
-    const auto& pose_translation = eigen_transform.translation();
-    pose_origin.setX(pose_translation.x());
-    pose_origin.setY(pose_translation.y());
-    pose_origin.setZ(pose_translation.z());
-    const Eigen::Quaterniond eigen_rotation(eigen_transform.linear());
-    btQuaternion pose_rotation(
-    eigen_rotation.x(), eigen_rotation.y(), eigen_rotation.z(), eigen_rotation.w());
-    pose_transform.setRotation(pose_rotation);
-    result.initial_pose = pose_transform;
+    result.initial_pose = bt_of_transform(eigen_transform);
     return std::make_pair(std::move(result), eigen_transform);
   }
 
+#ifdef USE_OCTOMAP
+  std::pair<Object, Transform3r> parse_octomap(const Str& obj_dir, tinyxml2::XMLNode* octomap) {
+    auto name = octomap->FirstChildElement("name")->FirstChild()->Value();
+    Object result(name, false);
+    auto octree_path =
+    fmt::format("{}/{}", obj_dir, octomap->FirstChildElement("file")->FirstChild()->Value());
+    // Only used for point files; OctoMap files store their own resolution
+    double resolution        = DEFAULT_OCTREE_RESOLUTION;
+    auto* resolution_element = octomap->FirstChildElement("resolution");
+    if (resolution_element != nullptr) {
+      resolution_element->QueryDoubleText(&resolution);
+    }
+
+    auto octree = input::octree::load_octree(octree_path, resolution);
+    auto shape  = std::make_unique<input::octree::OctreeShape>(*octree, DEFAULT_COLLISION_MARGIN);
+    log->debug("Loaded {} occupied leafs for {}", shape->num_leafs(), name);
+    result.geom   = std::move(shape);
+    result.octree = std::move(octree);
+
+    Transform3r eigen_transform(Transform3r::Identity());
+    auto* pose_element = octomap->FirstChildElement("pose");
+    if (pose_element != nullptr) {
+      auto pose_elems =
+      fplus::split_by_token<Str>(" ", false, pose_element->FirstChild()->Value());
+      eigen_transform = Transform3r(parse_template<4>(pose_elems));
+    }
+
+    result.initial_pose = bt_of_transform(eigen_transform);
+    return std::make_pair(std::move(result), eigen_transform);
+  }
+#endif
+
   std::optional<Robot> parse_robot(tinyxml2::XMLNode* robot_node, std::shared_ptr<Graph>& sg) {
     auto name = robot_node->FirstChildElement("name")->FirstChild()->Value();
 
@@ -549,6 +592,27 @@ load(const Str& scene_path, const Str& obj_dir) {
     log->warn("No objects!");
   }
 
+  // Static obstacles from depth sensors come in as octrees, each of which becomes one obstacle
+  auto* octomaps_node = problem->FirstChildElement("octomaps");
+  if (octomaps_node != nullptr) {
+#ifndef USE_OCTOMAP
+    log->error("This scene has octomaps, but planet was built without OctoMap support");
+    throw std::runtime_error("OctoMap support is not available!");
+#else
+    auto octomap_node = octomaps_node->FirstChildElement("octomap");
+    while (octomap_node != nullptr) {
+      auto [obj, eigen_pose] = parse_octomap(obj_dir, octomap_node);
+      auto name              = obj.name;
+      Node node(
+      name, Node::Type::FIXED, eigen_pose, Transform3r::Identity(), Vector3r::Zero(), obj.geom);
+      node.is_obstacle = true;
+      obstacles.emplace(name, std::make_shared<Object>(std::move(obj)));
+      scenegraph->add_node(-1, node);
+      octomap_node = octomap_node->NextSiblingElement("octomap");
+    }
+#endif
+  }
+
   log->debug("Loaded {} objects", objects.size());
 
   // Note: We assume there is only ever a single robot, for now
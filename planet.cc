@@ -32,8 +32,10 @@
 #include <ompl/geometric/PathSimplifier.h>
 
 #include "collision.hh"
+#include "collision_bench.hh"
 #include "compositenn.hh"
 #include "cspace.hh"
+#include "env_pool.hh"
 #include "goal.hh"
 #include "initial.hh"
 #include "motion.hh"
@@ -78,6 +80,8 @@ int main(int argc, char* argv[]) {
   opts.add_options()
     ("p,problem", "The problem configuration file", cxxopts::value<Str>())
     ("r,reps", "Run repeatedly for testing", cxxopts::value<unsigned int>()->default_value("1"))
+    ("bench-collisions", "Benchmark the collision backends on the robot states in this file (recording them first if it doesn't exist)", cxxopts::value<Str>())
+    ("bench-states", "How many states to record for benchmarking", cxxopts::value<unsigned int>()->default_value("10000"))
     ("v,verbose", "Be verbose (display debug output)")
     ("h,help", "Display this help message");
   // clang-format on
@@ -267,6 +271,10 @@ int main(int argc, char* argv[]) {
   worldfns::obstacles   = obstacles_ptr.get();
   worldfns::state_size  = cspace::num_dims;
   log->debug("Initialized global state for Lua interface function");
+  symbolic::predicate::USE_NATIVE_FORMULAS =
+  problem_config->get_as<bool>("native_formulas").value_or(false);
+  symbolic::predicate::CHECK_NATIVE_FORMULAS =
+  problem_config->get_as<bool>("check_native_formulas").value_or(false);
 
   auto si = std::make_shared<ob::SpaceInformation>(conf_space);
   conf_space->setStateSamplerAllocator(
@@ -293,6 +301,23 @@ int main(int argc, char* argv[]) {
   hyperparams->get_as<double>("success_scale").value_or(100.0);
   sampler::TampSampler::COIN_BIAS = hyperparams->get_as<double>("coin_bias").value_or(0.3);
   planner::util::GOAL_WEIGHT      = hyperparams->get_as<double>("goal_weight").value_or(2.0);
+  planner::util::MEMO_CAPACITY =
+  hyperparams->get_as<unsigned int>("memo_capacity").value_or(16384);
+
+  // Lua environments are pooled and reused by every sampler, across all reps
+  symbolic::predicate::correctness_pool =
+  std::make_shared<symbolic::predicate::EnvPool<symbolic::predicate::LuaEnv<bool>>>(
+  "test", symbolic::predicate::BOOL_PRELUDE_PATH, domain_ptr.get(), false);
+  symbolic::predicate::gradient_pool =
+  std::make_shared<symbolic::predicate::EnvPool<symbolic::predicate::LuaEnv<double>>>(
+  "grad", symbolic::predicate::GRADIENT_PRELUDE_PATH, domain_ptr.get(), true);
+  symbolic::predicate::precondition_pool =
+  std::make_shared<symbolic::predicate::EnvPool<symbolic::predicate::LuaEnv<double>>>(
+  "universe_map-predicate", symbolic::predicate::BOOL_PRELUDE_PATH, domain_ptr.get(), false);
+  const auto warm_envs = hyperparams->get_as<unsigned int>("warm_envs").value_or(1);
+  // The goal holds onto one correctness environment for the whole run
+  symbolic::predicate::correctness_pool->warm(warm_envs + 1);
+  symbolic::predicate::gradient_pool->warm(warm_envs);
 
   const auto universe_map_ptr =
   std::make_unique<planner::util::UniverseMap>(*init_atoms,
@@ -311,20 +336,90 @@ int main(int argc, char* argv[]) {
   planner::motion::UniverseMotionValidator::universe_map = universe_map_ptr.get();
   goal::CompositeGoal::universe_map                      = universe_map_ptr.get();
   const auto blacklist_path = problem_config->get_as<Str>("blacklist");
-  log->info("Using Bullet for collisions");
-  si->setStateValidityChecker(std::make_shared<planner::collisions::BulletCollisionChecker>(
-  si,
-  *objects_ptr,
-  *obstacles_ptr,
-  robot_ptr.get(),
-  // NOTE: This is dumb, but cpptoml uses its own option type and I
-  // don't want to include the entirety of cpptoml in collision just
-  // for that one type in this one place
-  blacklist_path ? std::make_optional(*blacklist_path) : std::nullopt,
-  init_sg.get()));
+  // NOTE: This is dumb, but cpptoml uses its own option type and I don't want to include the
+  // entirety of cpptoml in collision just for that one type in this one place
+  const auto blacklist =
+  blacklist_path ? std::make_optional(*blacklist_path) : std::optional<Str>(std::nullopt);
+  const auto make_bullet_checker = [&]() {
+    return std::make_shared<planner::collisions::BulletCollisionChecker>(
+    si, *objects_ptr, *obstacles_ptr, robot_ptr.get(), blacklist, init_sg.get());
+  };
+
+#ifdef USE_FCL
+  const auto make_fcl_checker = [&]() {
+    return std::make_shared<planner::collisions::FCLCollisionChecker>(
+    si, *objects_ptr, *obstacles_ptr, robot_ptr.get(), blacklist, init_sg.get());
+  };
+#endif
+
+  const auto collision_backend =
+  problem_config->get_as<Str>("collision_backend").value_or("bullet");
+  std::shared_ptr<planner::collisions::CollisionChecker> collision_checker;
+  // Some collision options are only available with Bullet
+  std::shared_ptr<planner::collisions::BulletCollisionChecker> bullet_checker;
+  if (collision_backend == "bullet") {
+    log->info("Using Bullet for collisions");
+    bullet_checker    = make_bullet_checker();
+    collision_checker = bullet_checker;
+  } else if (collision_backend == "fcl") {
+#ifdef USE_FCL
+    log->info("Using FCL for collisions");
+    collision_checker = make_fcl_checker();
+#else
+    log->error("FCL collisions were requested, but planet was built without FCL");
+    return EXIT_FAILURE;
+#endif
+  } else {
+    log->error("Unknown collision backend: {}", collision_backend);
+    return EXIT_FAILURE;
+  }
+
+  si->setStateValidityChecker(collision_checker);
   log->debug("Running space information setup...");
   si->setup();
 
+  // Skip link pairs which can't (or always) collide, generating the list of them if needed
+  const auto collision_matrix = problem_config->get_as<Str>("collision_matrix");
+  const auto matrix_path =
+  collision_matrix ? std::make_optional(tilde_helper(*collision_matrix)) : std::nullopt;
+  if (matrix_path) {
+    if (!boost::filesystem::exists(*matrix_path)) {
+      const auto num_samples =
+      problem_config->get_as<unsigned int>("collision_matrix_samples").value_or(10000);
+      log->info("Generating collision matrix from {} samples...", num_samples);
+      // NOTE: Generating the matrix needs Bullet, whichever backend we're using
+      (bullet_checker ? bullet_checker : make_bullet_checker())
+      ->generate_collision_matrix(initial_state.get(), num_samples, *matrix_path);
+    }
+
+    collision_checker->load_collision_matrix(*matrix_path);
+  }
+
+  // Optionally check against a voxelized SDF of the obstacles, cached between runs
+  const auto sdf_resolution = problem_config->get_as<double>("sdf_resolution");
+  const auto build_sdf      = [&](planner::collisions::BulletCollisionChecker& checker) {
+    const auto sdf_cache_dir = problem_config->get_as<Str>("sdf_cache_dir");
+    checker.build_sdf(*sdf_resolution,
+                      sdf_cache_dir ? std::make_optional(tilde_helper(*sdf_cache_dir))
+                                    : std::nullopt);
+  };
+
+  if (sdf_resolution) {
+    if (bullet_checker) {
+      build_sdf(*bullet_checker);
+    } else {
+      log->warn("Ignoring sdf_resolution: the obstacle SDF is only used with Bullet");
+    }
+  }
+
+  // Optionally gather per-link-pair narrowphase statistics, written out at the end of the run
+  const auto collision_stats_path = problem_config->get_as<Str>("collision_stats");
+  if (collision_stats_path && !bullet_checker) {
+    log->warn("Ignoring collision_stats: per-pair statistics are only gathered with Bullet");
+  } else if (bullet_checker) {
+    bullet_checker->set_pair_stats(static_cast<bool>(collision_stats_path));
+  }
+
   bool initial_bounds = si->satisfiesBounds(initial_state.get());
   if (!initial_bounds) {
     log->critical("Initial state doesn't satisfy bounds!");
@@ -340,6 +435,42 @@ int main(int argc, char* argv[]) {
   }
 
   log->info("Initial state is valid");
+  if (args.count("bench-collisions") > 0) {
+    // Compare the collision backends on the same states instead of planning
+    const auto states_path = tilde_helper(args["bench-collisions"].as<Str>());
+    if (!boost::filesystem::exists(states_path)) {
+      planner::collisions::record_states(
+      si, initial_state.get(), args["bench-states"].as<unsigned int>(), states_path);
+    }
+
+    const auto states = planner::collisions::load_states(si, initial_state.get(), states_path);
+    Vec<std::pair<Str, std::shared_ptr<planner::collisions::CollisionChecker>>> checkers;
+    checkers.emplace_back("bullet", make_bullet_checker());
+    if (sdf_resolution) {
+      // The SDF only skips obstacle pairs which can't collide, so this must never miss a collision
+      // plain Bullet finds
+      auto sdf_checker = make_bullet_checker();
+      build_sdf(*sdf_checker);
+      checkers.emplace_back("bullet+sdf", sdf_checker);
+    }
+
+#ifdef USE_FCL
+    checkers.emplace_back("fcl", make_fcl_checker());
+#endif
+    for (auto& [_, checker] : checkers) {
+      if (matrix_path) {
+        checker->load_collision_matrix(*matrix_path);
+      }
+    }
+
+    planner::collisions::bench_collisions(checkers, states);
+    for (auto* state : states) {
+      si->freeState(state);
+    }
+
+    return EXIT_SUCCESS;
+  }
+
   log->info("Running sanity checks on configuration space...");
   conf_space->sanityChecks();
 
@@ -354,6 +485,9 @@ int main(int argc, char* argv[]) {
                             goal_ptr.get(),
                             objects_space.get(),
                             conf_space->objects_space_idx);
+    // The old pose sets are gone, and new ones may reuse their addresses
+    collision_checker->forget_object_poses();
+    goal_def->clear_memo();
     action_log_ptr->clear();
     log->info("Running rep {} of {}", i + 1, reps);
     auto problem_def = std::make_shared<ob::ProblemDefinition>(si);
@@ -403,18 +537,31 @@ int main(int argc, char* argv[]) {
                 sampler::sample_counter.uniformTotal,
                 sampler::sample_counter.uniformNormal,
                 sampler::sample_counter.heuristic);
+      const auto collision_counters = collision_checker->counters();
       log->info("Valid states: {}",
                 sampler::sample_counter.uniformTotal -
-                (planner::collisions::oob_count + planner::collisions::self_coll_count +
-                 planner::collisions::world_coll_count));
+                (collision_counters.oob_count + collision_counters.self_coll_count +
+                 collision_counters.world_coll_count));
       log->info("Invalid sample count:\n\t{} out of bounds\n\t{} self collision\n\t{} world "
                 "collision",
-                planner::collisions::oob_count,
-                planner::collisions::self_coll_count,
-                planner::collisions::world_coll_count);
+                collision_counters.oob_count,
+                collision_counters.self_coll_count,
+                collision_counters.world_coll_count);
+      log->info("Narrowphase pairs: {} checked, {} skipped by early exit, {} cleared by the SDF",
+                collision_counters.narrowphase_pairs,
+                collision_counters.skipped_pairs,
+                collision_counters.sdf_pairs);
       log->info("Invalid end states: {}\nInvalid interpolation states: {}",
                 planner::motion::invalid_end,
                 planner::motion::invalid_interp);
+      const auto precondition_memo = universe_map_ptr->precondition_memo->counters();
+      const auto goal_memo         = goal_def->memo_counters();
+      log->info("Memoized predicates:\n\t{} hits, {} misses on preconditions\n\t{} hits, {} "
+                "misses on the goal",
+                precondition_memo.hits,
+                precondition_memo.misses,
+                goal_memo.hits,
+                goal_memo.misses);
 
       if (v_count > 0) {
         // Get state config/uni histogram
@@ -490,6 +637,10 @@ int main(int argc, char* argv[]) {
     dynamic_cast<sampler::TampSampler*>(planner->sampler_.get())->cleanup();
   }
 
+  if (collision_stats_path && bullet_checker) {
+    bullet_checker->write_pair_stats(tilde_helper(*collision_stats_path));
+  }
+
   return EXIT_SUCCESS;
 }
 
@@ -1,7 +1,9 @@
 #include "collision.hh"
-#ifndef USE_FCL
+
 #include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <limits>
 
 #include <fmt/ostream.h>
 
@@ -15,16 +17,15 @@
 
 #include "fplus/fplus.hpp"
 
-#include <ompl/base/spaces/RealVectorStateSpace.h>
-#include <ompl/base/spaces/SE2StateSpace.h>
-#include <ompl/base/spaces/SE3StateSpace.h>
-#include <ompl/base/spaces/SO2StateSpace.h>
-
 #include <nlohmann/json.hpp>
 
 namespace planner::collisions {
 using json = nlohmann::json;
 namespace {
+  auto log = spdlog::stdout_color_mt("collision");
+  // Filter item (and user pointer) for every world's object snapshots. It isn't in the scene graph
+  const Str OBJECT_SNAPSHOT_NAME = "(object snapshot)";
+
   struct HackyDrawer : public btIDebugDraw {
     void drawLine(const btVector3& from, const btVector3& to, const btVector3& color) override {
       json jFrom = {{"x", from.x()}, {"y", from.y()}, {"z", from.z()}};
@@ -72,15 +73,56 @@ namespace {
     int debugMode;
   };
 
-  Map<Str, const structures::scenegraph::Node*> node_map;
+  Vec<SpherePrefilter::PlacedShape> placed_shapes(const scene::ObjectSet& objects) {
+    Vec<SpherePrefilter::PlacedShape> result;
+    result.reserve(objects.size());
+    for (const auto& [_, object] : objects) {
+      result.emplace_back(object->geom.get(), object->initial_pose);
+    }
+
+    return result;
+  }
+
+  SpherePrefilter make_prefilter(const Vec<const Node*>& links,
+                                 const scene::ObjectSet& objects,
+                                 const scene::ObjectSet& obstacles,
+                                 const NeighborLinksFilter& filter) {
+    Vec<const btCollisionShape*> link_shapes;
+    link_shapes.reserve(links.size());
+    for (const auto* link : links) {
+      link_shapes.push_back(link->geom.get());
+    }
+
+    // NOTE: Objects start at their initial poses, and are moved by sync_objects
+    const auto obstacle_shapes = placed_shapes(obstacles);
+    const auto object_shapes   = placed_shapes(objects);
+
+    // Mirror NeighborLinksFilter: blacklisted and parent/child link pairs are never checked
+    const auto checks_pair = [&](std::size_t i, std::size_t j) {
+      const auto* link_a = links[i];
+      const auto* link_b = links[j];
+      return !filter.blacklisted(link_a->name, link_b->name) &&
+             !(link_a->parent == link_b->self_idx || link_b->parent == link_a->self_idx);
+    };
+
+    return SpherePrefilter(link_shapes, obstacle_shapes, object_shapes, checks_pair);
+  }
+
+  inline btTransform to_bt(const Transform3r& tf) {
+    const auto& translation = tf.translation();
+    const Eigen::Quaterniond rotation(tf.linear());
+    btTransform result;
+    result.setOrigin(btVector3(translation.x(), translation.y(), translation.z()));
+    result.setRotation(btQuaternion(rotation.x(), rotation.y(), rotation.z(), rotation.w()));
+    return result;
+  }
+
+  // NOTE: Held objects are in the robot's group too, so their collisions count as self collisions
+  inline bool is_robot_link(const btCollisionObject* obj) {
+    return obj->getBroadphaseHandle()->m_collisionFilterGroup == ROBOT_COLLISION_GROUP;
+  }
 }  // namespace
 
-unsigned int oob_count        = 0;
-unsigned int self_coll_count  = 0;
-unsigned int world_coll_count = 0;
-// std::unordered_map<std::pair<Str, Str>, unsigned int, boost::hash<std::pair<Str, Str>>>
-// collision_counters;
-// std::ofstream* collisions_file  = nullptr;
 // std::ofstream* sample_data_file = nullptr;
 
 void to_json(json& j, const Str& name, const btTransform& tf) {
@@ -94,13 +136,14 @@ void to_json(json& j, const Str& name, const btTransform& tf) {
 void BulletCollisionChecker::output_json() const {
   std::ofstream json_file("collision_state.json");
   json output;
-  for (const auto& [name, obj] : object_collisions) {
+  const auto& world = worlds.local();
+  for (const auto& [name, obj] : world.object_collisions) {
     json pose;
     to_json(pose, name, obj->getWorldTransform());
     output.push_back(pose);
   }
 
-  for (const auto& [name, obj] : robot_collisions) {
+  for (const auto& [name, obj] : world.robot_collisions) {
     json pose;
     to_json(pose, name, obj->getWorldTransform());
     output.push_back(pose);
@@ -135,42 +178,210 @@ inline void write_sample_data(const Transform3r& base_tf,
   // *sample_data_file << output << ",";
 }
 
+NeighborLinksFilter::NeighborLinksFilter(const NeighborLinksFilter& other)
+: sg(other.sg)
+, index_map(other.index_map)
+, num_items(other.num_items)
+, item_names(other.item_names)
+, blacklist(other.blacklist) {}
+
 NeighborLinksFilter::NeighborLinksFilter(const std::optional<Str>& blacklist_path,
                                          std::size_t num_items,
                                          Graph* sg)
-: sg(sg) {
+: sg(sg), num_items(num_items) {
   // Build the blacklist
   if (blacklist_path) {
-    std::size_t idx = 0;
     std::ifstream blacklist_file(blacklist_path.value());
-    Str link_a;
-    Str link_b;
     Str line;
     while (blacklist_file >> line) {
-      const auto links                        = fplus::split(',', true, line);
-      link_a                                  = links[0];
-      link_b                                  = links[1];
-      const auto& [link_a_idx_it, link_a_new] = index_map.try_emplace(link_a, idx);
-      if (link_a_new) {
-        ++idx;
-        blacklist.emplace_back(num_items, 0);
+      const auto links = fplus::split(',', true, line);
+      exclude(links[0], links[1]);
+    }
+  }
+}
+
+std::size_t NeighborLinksFilter::add_item(const Str& name) {
+  const auto& [idx_it, is_new] = index_map.try_emplace(name, item_names.size());
+  if (is_new) {
+    item_names.push_back(name);
+    if (item_names.size() > num_items) {
+      num_items = item_names.size();
+      for (auto& mask : blacklist) {
+        mask.resize(num_items);
+      }
+    }
+
+    blacklist.emplace_back(num_items, 0);
+    // Any ancestry matrices we have are now too small
+    ancestry_cache.clear();
+    ancestry = nullptr;
+  }
+
+  return idx_it->second;
+}
+
+void NeighborLinksFilter::exclude(const Str& link_a, const Str& link_b) {
+  const auto link_a_idx = add_item(link_a);
+  const auto link_b_idx = add_item(link_b);
+  blacklist[link_a_idx].set(link_b_idx, true);
+  blacklist[link_b_idx].set(link_a_idx, true);
+}
+
+void NeighborLinksFilter::update_ancestry() {
+  const auto topology = sg->topology();
+  if (ancestry != nullptr && ancestry_topology == topology) {
+    return;
+  }
+
+  ancestry_topology = topology;
+  const auto& cached_it = ancestry_cache.find(topology);
+  if (cached_it != ancestry_cache.end()) {
+    ancestry = &cached_it->second;
+    return;
+  }
+
+  // Each universe has its own graph, so keep one matrix per topology we see, up to a point
+  if (ancestry_cache.size() >= MAX_ANCESTRY_CACHE_SIZE) {
+    ancestry_cache.clear();
+  }
+
+  // Items which aren't in the graph (e.g. object snapshots) have no parents or children
+  Map<int, std::size_t> item_idxs;
+  for (std::size_t i = 0; i < item_names.size(); ++i) {
+    if (sg->contains(item_names[i])) {
+      item_idxs.emplace(sg->find(item_names[i]).self_idx, i);
+    }
+  }
+
+  auto& matrix = ancestry_cache[topology];
+  matrix.assign(item_names.size(), boost::dynamic_bitset<>(num_items, 0));
+  for (std::size_t i = 0; i < item_names.size(); ++i) {
+    if (!sg->contains(item_names[i])) {
+      continue;
+    }
+
+    const auto& parent_it = item_idxs.find(sg->find(item_names[i]).parent);
+    if (parent_it != item_idxs.end()) {
+      matrix[i].set(parent_it->second, true);
+      matrix[parent_it->second].set(i, true);
+    }
+  }
+
+  ancestry = &matrix;
+}
+
+void NeighborLinksFilter::load_matrix(const Str& matrix_path) {
+  // The format is a header line of comma-separated link names, then one row of 0s and 1s per
+  // link, where a 1 means that the pair never needs to be checked
+  std::ifstream matrix_file(matrix_path);
+  Str line;
+  if (!std::getline(matrix_file, line)) {
+    log->error("Could not read collision matrix from {}", matrix_path);
+    throw std::runtime_error("Bad collision matrix");
+  }
+
+  const auto names = fplus::split(',', false, line);
+  for (std::size_t i = 0; i < names.size() && std::getline(matrix_file, line); ++i) {
+    for (std::size_t j = i + 1; j < names.size() && j < line.size(); ++j) {
+      if (line[j] == '1') {
+        exclude(names[i], names[j]);
       }
+    }
+  }
+}
 
-      const auto& [link_b_idx_it, link_b_new] = index_map.try_emplace(link_b, idx);
-      if (link_b_new) {
-        ++idx;
-        blacklist.emplace_back(num_items, 0);
+void EarlyExitDispatcher::dispatchAllCollisionPairs(btOverlappingPairCache* pair_cache,
+                                                    const btDispatcherInfo& dispatch_info,
+                                                    btDispatcher* /* dispatcher */) {
+  hit_a           = nullptr;
+  hit_b           = nullptr;
+  pairs_processed = 0;
+  pairs_cleared   = 0;
+  hits.clear();
+  pairs_total     = pair_cache->getNumOverlappingPairs();
+  auto* pairs     = pair_cache->getOverlappingPairArrayPtr();
+  for (int i = 0; i < pairs_total; ++i) {
+    auto& pair = pairs[i];
+    if (!static_cleared.empty()) {
+      const auto* obj_a = static_cast<const btCollisionObject*>(pair.m_pProxy0->m_clientObject);
+      const auto* obj_b = static_cast<const btCollisionObject*>(pair.m_pProxy1->m_clientObject);
+      const auto idx_a = obj_a->getUserIndex();
+      const auto idx_b = obj_b->getUserIndex();
+      if ((obstacles[idx_a] && static_cleared[idx_b]) ||
+          (obstacles[idx_b] && static_cleared[idx_a])) {
+        ++pairs_cleared;
+        continue;
       }
+    }
+
+    // This does the filtering and the narrowphase for the pair, as it would in the default pass
+    std::chrono::steady_clock::time_point start;
+    if (stats != nullptr) {
+      start = std::chrono::steady_clock::now();
+    }
+
+    getNearCallback()(pair, *this, dispatch_info);
+    ++pairs_processed;
+    std::size_t stats_idx = 0;
+    if (stats != nullptr) {
+      const auto* obj_a = static_cast<const btCollisionObject*>(pair.m_pProxy0->m_clientObject);
+      const auto* obj_b = static_cast<const btCollisionObject*>(pair.m_pProxy1->m_clientObject);
+      stats_idx         = stats->index(obj_a->getUserIndex(), obj_b->getUserIndex());
+      ++stats->tests[stats_idx];
+      stats->nanos[stats_idx] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::steady_clock::now() - start)
+                                 .count();
+    }
+
+    if (pair.m_algorithm == nullptr) {
+      continue;
+    }
 
-      auto& link_a_mask = blacklist.at(link_a_idx_it->second);
-      auto& link_b_mask = blacklist.at(link_b_idx_it->second);
+    manifolds.resizeNoInitialize(0);
+    pair.m_algorithm->getAllContactManifolds(manifolds);
+    const btCollisionObject* pair_hit_a = nullptr;
+    const btCollisionObject* pair_hit_b = nullptr;
+    for (int j = 0; j < manifolds.size(); ++j) {
+      auto* manifold          = manifolds[j];
+      const auto num_contacts = manifold->getNumContacts();
+      for (int k = 0; k < num_contacts && pair_hit_a == nullptr; ++k) {
+        if (manifold->getContactPoint(k).getDistance() <= -PENETRATION_EPSILON) {
+          pair_hit_a = manifold->getBody0();
+          pair_hit_b = manifold->getBody1();
+        }
+      }
 
-      link_a_mask.set(link_b_idx_it->second, true);
-      link_b_mask.set(link_a_idx_it->second, true);
+      // Contacts are only ever looked at here, so we can throw them away now rather than having
+      // them go stale
+      clearManifold(manifold);
+    }
+
+    if (pair_hit_a != nullptr) {
+      if (stats != nullptr) {
+        ++stats->hits[stats_idx];
+      }
+
+      if (hit_a == nullptr) {
+        hit_a = pair_hit_a;
+        hit_b = pair_hit_b;
+      }
+
+      if (early_exit) {
+        return;
+      }
+
+      hits.emplace_back(pair_hit_a, pair_hit_b);
     }
   }
 }
 
+bool NeighborLinksFilter::blacklisted(const Str& link_a, const Str& link_b) const {
+  const auto& link_a_idx_it = index_map.find(link_a);
+  const auto& link_b_idx_it = index_map.find(link_b);
+  return link_a_idx_it != index_map.end() && link_b_idx_it != index_map.end() &&
+         blacklist[link_a_idx_it->second][link_b_idx_it->second];
+}
+
 bool NeighborLinksFilter::needBroadphaseCollision(btBroadphaseProxy* proxy0,
                                                   btBroadphaseProxy* proxy1) const {
   bool collides    = (proxy0->m_collisionFilterGroup & proxy1->m_collisionFilterMask) != 0;
@@ -178,18 +389,10 @@ bool NeighborLinksFilter::needBroadphaseCollision(btBroadphaseProxy* proxy0,
   const auto* obj1 = static_cast<btCollisionObject*>(proxy0->m_clientObject);
   const auto* obj2 = static_cast<btCollisionObject*>(proxy1->m_clientObject);
 
+  // NOTE: Parents and children are always in contact, so we skip them as well as the blacklist
   const auto idx1 = obj1->getUserIndex();
   const auto idx2 = obj2->getUserIndex();
-  collides =
-  collides && ((idx1 < 0) || (idx2 < 0) || !blacklist[idx1][idx2]);
-  // collides = collides && blacklist.find({std::min(*name1, *name2), std::max(*name1, *name2)}) ==
-  //                        blacklist.end();
-
-  const auto* name1 = static_cast<Str*>(obj1->getUserPointer());
-  const auto* name2 = static_cast<Str*>(obj2->getUserPointer());
-  const auto& node1 = sg->find(*name1);
-  const auto& node2 = sg->find(*name2);
-  collides          = collides && !(node1.has_child(node2) || node2.has_child(node1));
+  collides        = collides && allowed(idx1, idx2);
 
   return collides;
 }
@@ -213,194 +416,252 @@ bool NeighborLinksFilter::needBroadphaseCollision(btBroadphaseProxy* proxy0,
 //   }
 // }
 
-int counter = 0;
+CollisionCounters BulletCollisionChecker::counters() const {
+  CollisionCounters total;
+  worlds.for_each([&](const BulletWorld& world) { total += world.counters; });
+  return total;
+}
+
+void BulletCollisionChecker::pose_links(BulletWorld& world,
+                                        const ob::State* state,
+                                        btTransform* link_tfs) const {
+  auto* object_tfs = link_tfs + world.link_collisions.size();
+  pose_robot(
+  state,
+  world.fk_workspace,
+  world.link_slots,
+  [&](const std::size_t slot, const Transform3r& coll_tf) { link_tfs[slot] = to_bt(coll_tf); },
+  [&](const Node* node, const Transform3r& coll_tf) {
+    // Worlds built without objects (e.g. for generate_collision_matrix) just ignore them
+    const auto& slot_it = world.object_slots.find(node->name);
+    if (slot_it != world.object_slots.end()) {
+      object_tfs[slot_it->second] = to_bt(coll_tf);
+    }
+  });
+}
+
+void BulletCollisionChecker::pose_links_batch(BulletWorld& world,
+                                              const ob::State* const* states,
+                                              const std::size_t count) const {
+  const auto* sg        = pose_robot_batch(states, count, world.batch_scratch);
+  const auto& batch     = world.batch_scratch.fk;
+  const auto num_links  = world.link_collisions.size();
+  const auto num_slots  = world.slots_per_state();
+  auto* link_transforms = world.link_transforms.data();
+  const auto& plan      = *batch.plan;
+  // Slots are looked up once per node rather than once per node per state, as pose_links does
+  for (std::size_t entry = 0; entry < plan.node_idxs.size(); ++entry) {
+    const auto& node = sg->fk_node(plan, entry);
+    std::size_t slot = 0;
+    if (node.geom != nullptr && !node.is_obstacle && !node.is_object) {
+      slot = world.link_slots.at(node.name);
+    } else if (node.is_object) {
+      // Everything in the robot's tree is held, but worlds built without objects ignore them
+      const auto& slot_it = world.object_slots.find(node.name);
+      if (slot_it == world.object_slots.end()) {
+        continue;
+      }
+
+      slot = num_links + slot_it->second;
+    } else {
+      continue;
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+      link_transforms[i * num_slots + slot] = to_bt(batch.collision_pose(entry, i));
+    }
+  }
+}
+
+void BulletCollisionChecker::sync_objects(BulletWorld& world, const ob::State* state) const {
+  if (world.object_list.empty()) {
+    return;
+  }
+
+  const auto* cstate = state->as<cspace::CompositeSpace::StateType>();
+  const ObjectPoseVersion version{cstate->object_poses, cstate->sg->topology()};
+  // Without a pose set to go by, we can't tell if the objects moved
+  if (version == world.object_version && version.object_poses != nullptr) {
+    return;
+  }
+
+  world.object_version = version;
+  auto* snapshot       = world.find_snapshot(version);
+  if (snapshot == nullptr) {
+    const auto num_objects    = world.object_list.size();
+    const auto* objects_state = cstate->as<ob::CompoundStateSpace::StateType>(objects_index);
+    Map<Str, Transform3r> pose_map;
+    pose_map.reserve(objects_space->getSubspaceCount());
+    util::state_to_pose_map(objects_state, objects_space, pose_map);
+    Vec<char> held(num_objects, 0);
+    Vec<btTransform> poses(num_objects, btTransform::getIdentity());
+    for (std::size_t i = 0; i < num_objects; ++i) {
+      const auto& name = *static_cast<Str*>(world.object_list[i]->getUserPointer());
+      held[i]          = cstate->sg->attached_to_robot(name);
+      if (!held[i]) {
+        poses[i] = to_bt(pose_map.at(name));
+      }
+    }
+
+    snapshot = world.add_snapshot(version, std::move(held), std::move(poses));
+  }
+
+  world.use_snapshot(snapshot);
+  for (std::size_t i = 0; i < world.object_list.size(); ++i) {
+    // Held objects are moved with the robot links, by move_held
+    prefilter.place_object(
+    i, snapshot->held[i] ? nullptr : &snapshot->poses[i], world.prefilter_scratch);
+  }
+}
+
 bool BulletCollisionChecker::isValid(const ob::State* state) const {
+  auto& world = worlds.local();
   // Check bounds
   if (!si->satisfiesBounds(state)) {
-    ++oob_count;
+    ++world.counters.oob_count;
     // spdlog::error("Invalid bounds!");
     return false;
   }
 
-  // return true;
-  // Get the state into the type we want
-  const auto cstate      = state->as<cspace::CompositeSpace::StateType>();
-  const auto robot_state = cstate->as<ob::CompoundState>(robot_index);
-
   // Check that no robot links are colliding with: Each other, any non-held objects
-  // Do FK to find robot pose for proposed state
-  const auto& joint_state = robot_state->as<ob::RealVectorStateSpace::StateType>(joints_index);
-  double cont_vals[cspace::cont_joint_idxs.size()];
-  double* joint_vals  = nullptr;
-  Transform3r base_tf = *robot->base_pose;
-  util::state_to_pose_data(robot_state,
-                           joint_state,
-                           cspace::cont_joint_idxs,
-                           space->base_space_idx,
-                           cont_vals,
-                           &joint_vals,
-                           &base_tf);
-  // Map<Str, double> joint_data;
-  // for (size_t i = 0; i < cspace::cont_joint_idxs.size(); ++i) {
-  //   const auto idx          = cspace::cont_joint_idxs[i];
-  //   const auto& joint_space = robot_space->getSubspace(idx);
-  //   joint_data.emplace(joint_space->getName(), cont_vals[i]);
-  // }
-  //
-  // const auto& joint_space =
-  // robot_space->getSubspace(joints_index)->as<cspace::RobotJointSpace>(); for (size_t i = 0; i <
-  // joint_space->getDimension(); ++i) {
-  //   const auto& dim_name = joint_space->getDimensionName(i);
-  //   joint_data.emplace(dim_name, joint_vals[i]);
-  // }
-
-  // Compute pose for movable objects
-  const auto* objects_state = cstate->as<ob::CompoundStateSpace::StateType>(objects_index);
-  Map<Str, Transform3r> pose_map;
-  pose_map.reserve(objects_space->getSubspaceCount());
-  util::state_to_pose_map(objects_state, objects_space, pose_map);
-  cstate->sg->pose_objects(pose_map);
-  node_map.reserve(object_collisions.size() + robot_collisions.size());
-
-  // Map<Str, Transform3r> link_poses;
-  const auto pose_helper =
-  [&](const auto* const node, const auto robot_ancestor, const auto& tf, const auto& coll_tf) {
-    if (node->geom != nullptr && !node->is_obstacle) {
-      const auto& translation = coll_tf.translation();
-      const Eigen::Quaterniond rotation(coll_tf.linear());
-
-      btCollisionObject* collision_obj = nullptr;
-      if (node->is_object) {
-        // collision_obj = object_collisions.at(node->name).get();
-      } else {
-        collision_obj = robot_collisions.at(node->name).get();
-        // link_poses.insert_or_assign(node->name, coll_tf);
+  auto* link_tfs = world.link_transforms.data();
+  pose_links(world, state, link_tfs);
+  return check_links(world, state, link_tfs);
+}
+
+bool BulletCollisionChecker::checkStates(const ob::State* const* states,
+                                         std::size_t count,
+                                         std::size_t* first_invalid) const {
+  auto& world          = worlds.local();
+  const auto num_slots = world.slots_per_state();
+
+  // Bounds checks are cheap, so we use them to cut the batch off before doing any FK
+  std::size_t batch_size = count;
+  for (std::size_t i = 0; i < count; ++i) {
+    if (!si->satisfiesBounds(states[i])) {
+      batch_size = i;
+      break;
+    }
+  }
+
+  // FK for the whole batch first, then one collision pass per state. The transform buffer only
+  // ever grows, so steady-state batches don't allocate
+  if (world.link_transforms.size() < batch_size * num_slots) {
+    world.link_transforms.resize(batch_size * num_slots);
+  }
+
+  // States from one motion share a scene graph, so their FK can run across the whole batch at once
+  const auto shared_sg = [&]() {
+    const auto* sg = states[0]->as<cspace::CompositeSpace::StateType>()->sg;
+    return std::all_of(states + 1, states + batch_size, [&](const auto* state) {
+      return state->template as<cspace::CompositeSpace::StateType>()->sg == sg;
+    });
+  };
+
+  if (batch_size > 1 && shared_sg()) {
+    pose_links_batch(world, states, batch_size);
+  } else {
+    for (std::size_t i = 0; i < batch_size; ++i) {
+      pose_links(world, states[i], &world.link_transforms[i * num_slots]);
+    }
+  }
+
+  for (std::size_t i = 0; i < batch_size; ++i) {
+    if (!check_links(world, states[i], &world.link_transforms[i * num_slots])) {
+      if (first_invalid != nullptr) {
+        *first_invalid = i;
       }
 
-      // collision_world->removeCollisionObject(collision_obj);
-      if (collision_obj != nullptr) {
-        auto trans = collision_obj->getWorldTransform();
-        trans.setOrigin(btVector3(translation.x(), translation.y(), translation.z()));
-        trans.setRotation(btQuaternion(rotation.x(), rotation.y(), rotation.z(), rotation.w()));
-        collision_obj->setWorldTransform(trans);
-        // collision_world->addCollisionObject(collision_obj);
+      return false;
+    }
+  }
+
+  if (batch_size < count) {
+    ++world.counters.oob_count;
+  }
+
+  if (first_invalid != nullptr) {
+    *first_invalid = batch_size;
+  }
+
+  return batch_size == count;
+}
+
+bool BulletCollisionChecker::check_links(BulletWorld& world,
+                                         const ob::State* state,
+                                         const btTransform* link_tfs) const {
+  sync_objects(world, state);
+  // Settle the clear-cut cases with bounding spheres before paying for the narrowphase
+  switch (prefilter.check(link_tfs, world.prefilter_scratch)) {
+    case SpherePrefilter::Result::FREE:
+      return true;
+
+    case SpherePrefilter::Result::SELF_COLLISION:
+      ++world.counters.self_coll_count;
+      return false;
+
+    case SpherePrefilter::Result::WORLD_COLLISION:
+      ++world.counters.world_coll_count;
+      return false;
+
+    case SpherePrefilter::Result::UNKNOWN:
+      break;
+  }
+
+  auto& dispatch = world.collision_dispatch;
+  if (sdf) {
+    // Links whose bounding spheres are clear of the obstacles don't need the narrowphase against
+    // them, and links whose inner spheres are deep in an obstacle are certainly colliding
+    dispatch->static_cleared.resize(world.broadphase_filter->index_map.size());
+    for (std::size_t i = 0; i < world.link_collisions.size(); ++i) {
+      const auto& spheres = link_spheres[i];
+      const auto margin   = sdf->distance(link_tfs[i](spheres.center)) - spheres.radius;
+      if (sdf->distance(link_tfs[i](spheres.inner_center)) - spheres.inner_radius <
+          -(PENETRATION_EPSILON + sdf->error())) {
+        ++world.counters.world_coll_count;
+        return false;
       }
-      node_map.emplace(node->name, node);
+
+      dispatch->static_cleared[world.link_collisions[i]->getUserIndex()] =
+      margin > sdf->error() - PENETRATION_EPSILON;
     }
-  };
+  }
 
-  cstate->sg->update_transforms<double>(cont_vals, joint_vals, base_tf, pose_helper);
-  broadphase_filter->sg = cstate->sg;
+  world.move_links(link_tfs);
+  world.move_held(link_tfs + world.link_collisions.size());
+  world.broadphase_filter->sg = state->as<cspace::CompositeSpace::StateType>()->sg;
+  world.broadphase_filter->update_ancestry();
+  if (pair_stats_enabled) {
+    world.pair_stats.resize(world.broadphase_filter->items().size());
+    dispatch->stats = &world.pair_stats;
+  } else {
+    dispatch->stats = nullptr;
+  }
 
   // Check collisions
-  collision_world->updateAabbs();
-  // const auto filter_callback = std::make_unique<NeighborLinksFilter>(&node_map);
-  // collision_world->getPairCache()->setOverlapFilterCallback(filter_callback.get());
   // HackyDrawer dbDraw;
   // dbDraw.setDebugMode(1 | 8 | 2 | 64);
-  // collision_world->setDebugDrawer(&dbDraw);
-  collision_world->performDiscreteCollisionDetection();
-  // collision_world->debugDrawWorld();
+  // world.collision_world->setDebugDrawer(&dbDraw);
+  world.detect_collisions();
+  // world.collision_world->debugDrawWorld();
   // dbDraw.flushTo("coll_debug.json");
-  const auto num_manifolds = collision_world->getDispatcher()->getNumManifolds();
-  // int sum_contacts         = 0;
-  // int not_close_enough     = 0;
-
-  // Vec<std::pair<Str, Str>> collision_pairs;
-  for (int i = 0; i < num_manifolds; ++i) {
-    auto* manifold          = collision_world->getDispatcher()->getManifoldByIndexInternal(i);
-    const auto num_contacts = manifold->getNumContacts();
-    // sum_contacts += num_contacts;
-    const auto* obA = static_cast<const btCollisionObject*>(manifold->getBody0());
-    const auto* obB = static_cast<const btCollisionObject*>(manifold->getBody1());
-    for (int j = 0; j < num_contacts; ++j) {
-      const auto& point = manifold->getContactPoint(j);
-      if (point.getDistance() <= -PENETRATION_EPSILON) {
-        // We have a collision!
-        auto* name1 = static_cast<Str*>(obA->getUserPointer());
-        auto* name2 = static_cast<Str*>(obB->getUserPointer());
-        // collision_pairs.emplace_back(std::make_pair(*name1, *name2));
-        const auto* node1 = node_map[*name1];
-        const auto* node2 = node_map[*name2];
-        // const auto& [counter_elem, _] =
-        // collision_counters.emplace(std::make_pair(*name1, *name2), 0);
-        // ++counter_elem->second;
-
-        if ((node1 != nullptr && node2 != nullptr) && (!node1->is_object && !node1->is_obstacle) &&
-            (!node2->is_object && !node2->is_obstacle)) {
-          ++self_coll_count;
-        } else {
-          ++world_coll_count;
-        }
+  world.counters.narrowphase_pairs += dispatch->pairs_processed;
+  world.counters.sdf_pairs += dispatch->pairs_cleared;
+  world.counters.skipped_pairs +=
+  dispatch->pairs_total - dispatch->pairs_processed - dispatch->pairs_cleared;
+  if (dispatch->hit_a != nullptr) {
+    // We have a collision!
+    // spdlog::warn("{} collides with {}",
+    //              *static_cast<Str*>(dispatch->hit_a->getUserPointer()),
+    //              *static_cast<Str*>(dispatch->hit_b->getUserPointer()));
+    if (is_robot_link(dispatch->hit_a) && is_robot_link(dispatch->hit_b)) {
+      ++world.counters.self_coll_count;
+    } else {
+      ++world.counters.world_coll_count;
+    }
 
-        // else {
-        //   *collisions_file
-        //   << base_tf.translation().x() << "," << base_tf.translation().y() << ","
-        //   << ((node1 == nullptr || node1->is_object || node1->is_obstacle) ? *name1 : *name2)
-        //   << std::endl;
-        //   ++world_coll_count;
-        // }
-
-        // spdlog::warn("{} collides with {}: {}", *name1, *name2, point.getDistance());
-        // const auto& tfA = obA->getWorldTransform();
-        // const auto& tfB = obB->getWorldTransform();
-        // spdlog::warn("{}, {}, {} -- {}, {}, {}, {}",
-        //              tfA.getOrigin().x(),
-        //              tfA.getOrigin().y(),
-        //              tfA.getOrigin().z(),
-        //              tfA.getRotation().x(),
-        //              tfA.getRotation().y(),
-        //              tfA.getRotation().z(),
-        //              tfA.getRotation().w());
-        // spdlog::warn("{}, {}, {} -- {}, {}, {}, {}",
-        //              tfB.getOrigin().x(),
-        //              tfB.getOrigin().y(),
-        //              tfB.getOrigin().z(),
-        //              tfB.getRotation().x(),
-        //              tfB.getRotation().y(),
-        //              tfB.getRotation().z(),
-        //              tfB.getRotation().w());
-        // output_json();
-        // collision_world->debugDrawWorld();
-        // dbDraw.flushTo(fmt::format("coll_debug{}.json", counter));
-
-        ++counter;
-        // if (counter > 20) {
-        //   throw std::runtime_error("Enough!");
-        // }
-        collision_dispatch->clearManifold(manifold);
-        return false;
-      }
-      // ++not_close_enough;
-    }
-
-    collision_dispatch->clearManifold(manifold);
-  }
-
-  // if (any_colls) {
-  //   write_sample_data(base_tf, joint_data, link_poses, collision_pairs);
-  //   return false;
-  // }
-  // if (world_coll_count > 0) {
-  //   collision_world->debugDrawWorld();
-  //   dbDraw.flushTo(fmt::format("coll_debug{}.json", counter));
-  //   spdlog::error("Counter is {}", counter);
-  //   throw std::runtime_error("Fuckitall");
-  //   return false;
-  // }
-
-  // spdlog::warn("{} manifolds\t{} contacts\t{} not close enough\tno collisions",
-  //              num_manifolds,
-  //              sum_contacts,
-  //              not_close_enough);
-  // if (num_manifolds > 0 && sum_contacts == 0) {
-  //   collision_world->debugDrawWorld();
-  //   dbDraw.flushTo(fmt::format("coll_debug{}.json", counter));
-  //   ++counter;
-  //   if (counter > 5) {
-  //     throw std::runtime_error("Fucky no-contact scenario");
-  //   }
-  // }
+    return false;
+  }
 
   return true;
 }
@@ -412,41 +673,273 @@ BulletCollisionChecker::BulletCollisionChecker(const ob::SpaceInformationPtr& si
                                                const std::optional<Str>& blacklist_path,
                                                Graph* sg)
 : CollisionChecker(si, robot)
-, collision_config(std::make_unique<btDefaultCollisionConfiguration>())
-, collision_dispatch(std::make_unique<btCollisionDispatcher>(collision_config.get())) {
-  // Initialize Bullet machinery
-  broadphase_interface = std::make_unique<btDbvtBroadphase>();
-  collision_world      = std::make_unique<btCollisionWorld>(collision_dispatch.get(),
-                                                       broadphase_interface.get(),
-                                                       collision_config.get());
-
-  // This is a little gross (double-loop through the robot nodes) but (a) it's a ctor that runs
-  // once and (b) it lets us get an accurate link count for the masks
-  std::size_t num_robot_nodes = 0;
-  for (const auto& robot_elem : robot->tree_nodes) {
-    const auto& link = robot_elem.second;
-    if (link->geom == nullptr) {
-      continue;
+, objects(objects)
+, obstacles(obstacles)
+// NOTE: This uses the assumption that the filter will only ever exclude robot links
+, links(collision_links(robot))
+, filter_template(blacklist_path, links.size(), sg)
+, prefilter(make_prefilter(links, objects, obstacles, filter_template))
+, worlds([this]() {
+  return std::make_unique<BulletWorld>(
+  this->objects, this->obstacles, links, filter_template, prefilter);
+}) {}
+
+void BulletCollisionChecker::generate_collision_matrix(const ob::State* base_state,
+                                                       unsigned int num_samples,
+                                                       const Str& matrix_path) const {
+  const auto num_links = links.size();
+
+  // Check the robot on its own, with nothing filtered but parent/child pairs, and without
+  // stopping at the first collision
+  const scene::ObjectSet no_objects;
+  const NeighborLinksFilter unfiltered(std::nullopt, num_links, filter_template.sg);
+  BulletWorld world(no_objects, no_objects, links, unfiltered, prefilter);
+  world.collision_dispatch->early_exit = false;
+
+  auto* state      = si->allocState();
+  auto* cstate     = state->as<cspace::CompositeSpace::StateType>();
+  auto* robot_part = cstate->components[robot_index];
+  si->copyState(state, base_state);
+  const auto robot_sampler = robot_space->allocDefaultStateSampler();
+  Vec<unsigned int> collision_counts(num_links * num_links, 0);
+  for (unsigned int i = 0; i < num_samples; ++i) {
+    robot_sampler->sampleUniform(robot_part);
+    pose_links(world, state, world.link_transforms.data());
+    world.move_links(world.link_transforms.data());
+    world.detect_collisions();
+    for (const auto& [obj_a, obj_b] : world.collision_dispatch->hits) {
+      const auto a = world.link_slots.at(*static_cast<Str*>(obj_a->getUserPointer()));
+      const auto b = world.link_slots.at(*static_cast<Str*>(obj_b->getUserPointer()));
+      ++collision_counts[a * num_links + b];
+      ++collision_counts[b * num_links + a];
     }
+  }
 
-    const auto& [_, is_new] =
-    robot_collisions.emplace(link->name, std::make_unique<btCollisionObject>());
-    if (!is_new) {
-      continue;
+  si->freeState(state);
+
+  // Links are adjacent if one is the other's parent, skipping over links without geometry
+  Map<int, const Node*> robot_nodes;
+  for (const auto& [_, node] : robot->tree_nodes) {
+    robot_nodes.emplace(node->self_idx, node);
+  }
+
+  const auto collision_parent = [&](const Node* node) {
+    auto parent_idx = node->parent;
+    while (parent_idx >= 0) {
+      const auto& parent_it = robot_nodes.find(parent_idx);
+      if (parent_it == robot_nodes.end() || parent_it->second->geom != nullptr) {
+        break;
+      }
+
+      parent_idx = parent_it->second->parent;
+    }
+
+    return parent_idx;
+  };
+
+  // A pair never needs checking if it's adjacent, never collides, or always collides
+  Vec<Str> rows(num_links, Str(num_links, '0'));
+  unsigned int num_adjacent = 0;
+  unsigned int num_never    = 0;
+  unsigned int num_always   = 0;
+  for (std::size_t a = 0; a < num_links; ++a) {
+    for (std::size_t b = a + 1; b < num_links; ++b) {
+      const auto count = collision_counts[a * num_links + b];
+      bool excluded    = true;
+      if (collision_parent(links[a]) == links[b]->self_idx ||
+          collision_parent(links[b]) == links[a]->self_idx) {
+        ++num_adjacent;
+      } else if (count == 0) {
+        ++num_never;
+      } else if (count == num_samples) {
+        ++num_always;
+      } else {
+        excluded = false;
+      }
+
+      if (excluded) {
+        rows[a][b] = '1';
+        rows[b][a] = '1';
+      }
     }
+  }
 
-    ++num_robot_nodes;
+  log->info("Collision matrix excludes {} adjacent, {} never colliding, and {} always colliding "
+            "link pairs",
+            num_adjacent,
+            num_never,
+            num_always);
+  std::ofstream matrix_file(matrix_path);
+  matrix_file << fplus::join(Str(","), fplus::transform([](const auto* link) { return link->name; },
+                                                       links))
+              << '\n';
+  for (const auto& row : rows) {
+    matrix_file << row << '\n';
   }
+}
+
+void BulletCollisionChecker::load_collision_matrix(const Str& matrix_path) {
+  filter_template.load_matrix(matrix_path);
+  prefilter = make_prefilter(links, objects, obstacles, filter_template);
+  // Existing worlds have a stale copy of the filter (and stale user indices and broadphase pairs),
+  // so they get rebuilt on next use
+  worlds.clear();
+}
+
+void BulletCollisionChecker::forget_object_poses() {
+  worlds.for_each([](BulletWorld& world) { world.forget_object_poses(); });
+}
+
+void BulletCollisionChecker::build_sdf(double resolution, const std::optional<Str>& cache_dir) {
+  sdf = std::make_unique<const ObstacleSDF>(placed_shapes(obstacles), resolution, cache_dir);
+  link_spheres.clear();
+  for (const auto* link : links) {
+    link_spheres.push_back(make_shape_spheres(link->geom.get()));
+  }
+}
+
+double BulletCollisionChecker::clearance(const ob::State* state) const {
+  if (!sdf) {
+    return std::numeric_limits<double>::infinity();
+  }
+
+  auto& world = worlds.local();
+  pose_links(world, state, world.link_transforms.data());
+  auto result = std::numeric_limits<double>::infinity();
+  for (std::size_t i = 0; i < link_spheres.size(); ++i) {
+    const auto& spheres = link_spheres[i];
+    result = std::min(
+    result, sdf->distance(world.link_transforms[i](spheres.center)) - spheres.radius);
+  }
+
+  return result;
+}
+
+void BulletCollisionChecker::write_pair_stats(const Str& stats_path) const {
+  struct PairReport {
+    Str name_a;
+    Str name_b;
+    bool self;
+    unsigned int tests;
+    unsigned int hits;
+    std::uint64_t nanos;
+  };
 
-  // NOTE: This uses the assumption that the filter will only ever exclude robot links
-  broadphase_filter = std::make_unique<NeighborLinksFilter>(blacklist_path, num_robot_nodes, sg);
+  // Every world indexes its items the same way, so they can be summed entry by entry
+  PairStats total;
+  Vec<Str> names;
+  Vec<bool> robot;
+  worlds.for_each([&](const BulletWorld& world) {
+    const auto& stats = world.pair_stats;
+    if (stats.num_items == 0) {
+      return;
+    }
+
+    if (names.empty()) {
+      names = world.broadphase_filter->items();
+      total.resize(stats.num_items);
+      robot.assign(stats.num_items, false);
+      for (const auto* link : world.link_collisions) {
+        robot[link->getUserIndex()] = true;
+      }
+    }
+
+    for (std::size_t i = 0; i < stats.tests.size(); ++i) {
+      total.tests[i] += stats.tests[i];
+      total.hits[i] += stats.hits[i];
+      total.nanos[i] += stats.nanos[i];
+    }
+  });
+
+  Vec<PairReport> reports;
+  for (std::size_t a = 0; a < total.num_items; ++a) {
+    for (std::size_t b = a + 1; b < total.num_items; ++b) {
+      const auto idx = total.index(a, b);
+      if (total.tests[idx] > 0) {
+        reports.push_back({names[a],
+                           names[b],
+                           robot[a] && robot[b],
+                           total.tests[idx],
+                           total.hits[idx],
+                           total.nanos[idx]});
+      }
+    }
+  }
+
+  std::sort(reports.begin(), reports.end(), [](const auto& report_a, const auto& report_b) {
+    return report_a.nanos > report_b.nanos;
+  });
+
+  std::ofstream stats_file(stats_path);
+  if (fplus::is_suffix_of(Str(".csv"), stats_path)) {
+    stats_file << "link_a,link_b,kind,tests,hits,nanoseconds\n";
+    for (const auto& report : reports) {
+      stats_file << fmt::format("{},{},{},{},{},{}\n",
+                                report.name_a,
+                                report.name_b,
+                                report.self ? "self" : "world",
+                                report.tests,
+                                report.hits,
+                                report.nanos);
+    }
+  } else {
+    json output = json::array();
+    for (const auto& report : reports) {
+      output.push_back({{"link_a", report.name_a},
+                        {"link_b", report.name_b},
+                        {"kind", report.self ? "self" : "world"},
+                        {"tests", report.tests},
+                        {"hits", report.hits},
+                        {"nanoseconds", report.nanos}});
+    }
+
+    stats_file << output.dump(2);
+  }
+
+  log->info("Wrote collision statistics for {} pairs to {}", reports.size(), stats_path);
+}
+
+BulletWorld::BulletWorld(const scene::ObjectSet& objects,
+                         const scene::ObjectSet& obstacles,
+                         const Vec<const Node*>& links,
+                         const NeighborLinksFilter& filter,
+                         const SpherePrefilter& prefilter)
+: prefilter_scratch(prefilter.make_scratch())
+, collision_config(std::make_unique<btDefaultCollisionConfiguration>())
+, collision_dispatch(std::make_unique<EarlyExitDispatcher>(collision_config.get()))
+, broadphase_interface(std::make_unique<btDbvtBroadphase>())
+, broadphase_filter(std::make_unique<NeighborLinksFilter>(filter))
+, collision_world(std::make_unique<btCollisionWorld>(
+  collision_dispatch.get(), broadphase_interface.get(), collision_config.get())) {
   collision_world->getPairCache()->setOverlapFilterCallback(broadphase_filter.get());
+  // Everything needs an index before the filter's ancestry matrix can be built, and that has to
+  // happen before the broadphase starts asking the filter about pairs
+  for (const auto& [name, _] : obstacles) {
+    broadphase_filter->add_item(name);
+  }
+
+  for (const auto& [name, _] : objects) {
+    broadphase_filter->add_item(name);
+  }
+
+  for (const auto* link : links) {
+    broadphase_filter->add_item(link->name);
+  }
+
+  if (!objects.empty()) {
+    snapshot_index = broadphase_filter->add_item(OBJECT_SNAPSHOT_NAME);
+  }
+
+  broadphase_filter->update_ancestry();
+  collision_dispatch->obstacles.assign(broadphase_filter->index_map.size(), 0);
   for (const auto& obstacle_elem : obstacles) {
     const auto& obstacle = obstacle_elem.second;
     auto& obstacle_collision =
     obstacle_collisions.emplace_back(std::make_unique<btCollisionObject>());
     obstacle_collision->setUserPointer((void*)&(obstacle->name));
-    obstacle_collision->setUserIndex(-1);
+    obstacle_collision->setUserIndex(broadphase_filter->index_map.at(obstacle->name));
+    collision_dispatch->obstacles[obstacle_collision->getUserIndex()] = 1;
+    obstacle_collision->setCollisionFlags(btCollisionObject::CF_STATIC_OBJECT);
     obstacle_collision->setCollisionShape(obstacle->geom.get());
     obstacle_collision->setWorldTransform(obstacle->initial_pose);
     collision_world->addCollisionObject(obstacle_collision.get(),
@@ -460,23 +953,24 @@ BulletCollisionChecker::BulletCollisionChecker(const ob::SpaceInformationPtr& si
     object_collisions.emplace(object->name, std::make_unique<btCollisionObject>());
     const auto& [_name, object_collision] = *object_collision_elem;
     object_collision->setUserPointer((void*)&(object->name));
-    object_collision->setUserIndex(-1);
+    object_collision->setUserIndex(broadphase_filter->index_map.at(object->name));
     object_collision->setCollisionShape(object->geom.get());
     object_collision->setWorldTransform(object->initial_pose);
-    collision_world->addCollisionObject(object_collision.get(),
-                                        OBJECTS_COLLISION_GROUP,
-                                        OBJECTS_COLLISION_MASK);
+    // Objects only join the world while they're held; the rest are in the snapshots
+    object_slots.emplace(object->name, object_list.size());
+    object_list.push_back(object_collision.get());
   }
 
-  for (const auto& [name, link_collision] : robot_collisions) {
-    const auto& link = robot->tree_nodes.at(name);
+  object_held.resize(object_list.size(), 0);
+
+  for (const auto* link : links) {
+    const auto& [link_collision_elem, _inserted] =
+    robot_collisions.emplace(link->name, std::make_unique<btCollisionObject>());
+    const auto& link_collision = link_collision_elem->second;
+    link_slots.emplace(link->name, link_collisions.size());
+    link_collisions.push_back(link_collision.get());
     link_collision->setUserPointer((void*)&(link->name));
-    const auto& idx_it = broadphase_filter->index_map.find(link->name);
-    if (idx_it != broadphase_filter->index_map.end()) {
-      link_collision->setUserIndex(idx_it->second);
-    } else {
-      link_collision->setUserIndex(-1);
-    }
+    link_collision->setUserIndex(broadphase_filter->index_map.at(link->name));
 
     link_collision->setCollisionShape(link->geom.get());
     btTransform link_tf;
@@ -494,6 +988,129 @@ BulletCollisionChecker::BulletCollisionChecker(const ob::SpaceInformationPtr& si
                                         ROBOT_COLLISION_GROUP,
                                         ROBOT_COLLISION_MASK);
   }
+
+  link_transforms.resize(slots_per_state());
+}
+
+void BulletWorld::place(btCollisionObject* obj, const btTransform& tf) {
+  // Objects which haven't moved since the last check keep their broadphase proxies as they are
+  if (!(obj->getWorldTransform() == tf)) {
+    obj->setWorldTransform(tf);
+    collision_world->updateSingleAabb(obj);
+  }
+}
+
+void BulletWorld::move_links(const btTransform* link_tfs) {
+  for (std::size_t i = 0; i < link_collisions.size(); ++i) {
+    place(link_collisions[i], link_tfs[i]);
+  }
+}
+
+void BulletWorld::move_held(const btTransform* object_tfs) {
+  for (std::size_t i = 0; i < object_list.size(); ++i) {
+    if (object_held[i]) {
+      place(object_list[i], object_tfs[i]);
+    }
+  }
+}
+
+void BulletWorld::set_held(const std::size_t object, const bool held) {
+  if (static_cast<bool>(object_held[object]) == held) {
+    return;
+  }
+
+  object_held[object] = held;
+  if (held) {
+    collision_world->addCollisionObject(
+    object_list[object], ROBOT_COLLISION_GROUP, ROBOT_COLLISION_MASK);
+  } else {
+    collision_world->removeCollisionObject(object_list[object]);
+  }
+}
+
+BulletWorld::ObjectSnapshot* BulletWorld::find_snapshot(const ObjectPoseVersion& version) {
+  if (version.object_poses == nullptr) {
+    return nullptr;
+  }
+
+  const auto& snapshot_it = snapshots.find(version);
+  return snapshot_it != snapshots.end() ? snapshot_it->second.get() : nullptr;
+}
+
+BulletWorld::ObjectSnapshot* BulletWorld::add_snapshot(const ObjectPoseVersion& version,
+                                                       Vec<char> held,
+                                                       Vec<btTransform> poses) {
+  auto snapshot   = std::make_unique<ObjectSnapshot>();
+  snapshot->shape = std::make_unique<btCompoundShape>(true, static_cast<int>(object_list.size()));
+  for (std::size_t i = 0; i < object_list.size(); ++i) {
+    if (!held[i]) {
+      snapshot->shape->addChildShape(poses[i], object_list[i]->getCollisionShape());
+    }
+  }
+
+  snapshot->collision = std::make_unique<btCollisionObject>();
+  snapshot->collision->setUserPointer((void*)&OBJECT_SNAPSHOT_NAME);
+  snapshot->collision->setUserIndex(snapshot_index);
+  snapshot->collision->setCollisionShape(snapshot->shape.get());
+  snapshot->held  = std::move(held);
+  snapshot->poses = std::move(poses);
+
+  // NOTE: The world can't be left holding a snapshot we're about to free
+  if (version.object_poses == nullptr) {
+    if (active_snapshot != nullptr && active_snapshot == uncached_snapshot.get()) {
+      use_snapshot(nullptr);
+    }
+
+    uncached_snapshot = std::move(snapshot);
+    return uncached_snapshot.get();
+  }
+
+  // Every pose set the planner visits gets a snapshot, so keep one per version we see, up to a
+  // point
+  if (snapshots.size() >= MAX_SNAPSHOT_CACHE_SIZE) {
+    if (active_snapshot != uncached_snapshot.get()) {
+      use_snapshot(nullptr);
+    }
+
+    snapshots.clear();
+  }
+
+  return snapshots.emplace(version, std::move(snapshot)).first->second.get();
+}
+
+void BulletWorld::forget_object_poses() {
+  use_snapshot(nullptr);
+  snapshots.clear();
+  uncached_snapshot.reset();
+  object_version = {};
+}
+
+void BulletWorld::use_snapshot(ObjectSnapshot* snapshot) {
+  if (snapshot != active_snapshot) {
+    // An empty compound has no meaningful AABB, so those never go in the world
+    if (active_snapshot != nullptr && active_snapshot->shape->getNumChildShapes() > 0) {
+      collision_world->removeCollisionObject(active_snapshot->collision.get());
+    }
+
+    active_snapshot = snapshot;
+    if (snapshot != nullptr && snapshot->shape->getNumChildShapes() > 0) {
+      collision_world->addCollisionObject(
+      snapshot->collision.get(), OBJECTS_COLLISION_GROUP, OBJECTS_COLLISION_MASK);
+    }
+  }
+
+  if (snapshot != nullptr) {
+    for (std::size_t i = 0; i < object_list.size(); ++i) {
+      set_held(i, snapshot->held[i]);
+    }
+  }
+}
+
+void BulletWorld::detect_collisions() {
+  // NOTE: This is performDiscreteCollisionDetection without its updateAabbs pass, which would
+  // touch every object. move_links keeps the AABBs of moving objects up to date instead
+  collision_world->computeOverlappingPairs();
+  collision_dispatch->dispatchAllCollisionPairs(
+  collision_world->getPairCache(), collision_world->getDispatchInfo(), collision_dispatch.get());
 }
 }  // namespace planner::collisions
-#endif
@@ -0,0 +1,101 @@
+#include "collision.hh"
+
+#include <map>
+
+#include "fplus/fplus.hpp"
+
+#include <ompl/base/spaces/RealVectorStateSpace.h>
+#include <ompl/base/spaces/SE2StateSpace.h>
+#include <ompl/base/spaces/SE3StateSpace.h>
+#include <ompl/base/spaces/SO2StateSpace.h>
+
+namespace planner::collisions {
+Vec<const Node*> collision_links(const Robot* robot) {
+  std::map<Str, const Node*> links;
+  for (const auto& [_, link] : robot->tree_nodes) {
+    if (link->geom != nullptr) {
+      links.emplace(link->name, link);
+    }
+  }
+
+  return fplus::get_map_values(links);
+}
+
+void CollisionChecker::pose_robot(
+const ob::State* state,
+FKWorkspace& workspace,
+const Map<Str, std::size_t>& link_slots,
+const std::function<void(std::size_t, const Transform3r&)>& set_link,
+const std::function<void(const Node*, const Transform3r&)>& set_held) const {
+  // Get the state into the type we want
+  const auto cstate      = state->as<cspace::CompositeSpace::StateType>();
+  const auto robot_state = cstate->as<ob::CompoundState>(robot_index);
+
+  // Do FK to find robot pose for proposed state
+  const auto& joint_state = robot_state->as<ob::RealVectorStateSpace::StateType>(joints_index);
+  double cont_vals[cspace::cont_joint_idxs.size()];
+  double* joint_vals  = nullptr;
+  Transform3r base_tf = *robot->base_pose;
+  util::state_to_pose_data(robot_state,
+                           joint_state,
+                           cspace::cont_joint_idxs,
+                           space->base_space_idx,
+                           cont_vals,
+                           &joint_vals,
+                           &base_tf);
+
+  // Compute pose for movable objects. These go in the workspace rather than the graph, which other
+  // threads may be posing too
+  const auto* objects_state = cstate->as<ob::CompoundStateSpace::StateType>(objects_index);
+  util::state_to_pose_map(objects_state, objects_space, workspace.object_poses);
+  workspace.object_poses_changed();
+
+  const auto pose_helper =
+  [&](const auto* const node, const auto robot_ancestor, const auto& tf, const auto& coll_tf) {
+    // NOTE: Objects which aren't held only move when the pose set changes, so they're left to the
+    // caller
+    if (node->geom != nullptr && !node->is_obstacle && !node->is_object) {
+      set_link(link_slots.at(node->name), coll_tf);
+    } else if (node->is_object && robot_ancestor && set_held) {
+      set_held(node, coll_tf);
+    }
+  };
+
+  cstate->sg->update_transforms<double>(cont_vals, joint_vals, base_tf, workspace, pose_helper);
+}
+
+const Graph* CollisionChecker::pose_robot_batch(const ob::State* const* states,
+                                                const std::size_t count,
+                                                BatchFKScratch& scratch) const {
+  const Eigen::Index num_cont   = cspace::cont_joint_idxs.size();
+  const Eigen::Index num_joints = robot_space->getSubspace(joints_index)->getDimension();
+  scratch.cont_vals.resize(count, num_cont);
+  scratch.joint_vals.resize(count, num_joints);
+  scratch.base_tfs.assign(count, *robot->base_pose);
+  double cont_vals[cspace::cont_joint_idxs.size()];
+  for (std::size_t i = 0; i < count; ++i) {
+    const auto cstate       = states[i]->as<cspace::CompositeSpace::StateType>();
+    const auto robot_state  = cstate->as<ob::CompoundState>(robot_index);
+    const auto& joint_state = robot_state->as<ob::RealVectorStateSpace::StateType>(joints_index);
+    double* joint_vals      = nullptr;
+    util::state_to_pose_data(robot_state,
+                             joint_state,
+                             cspace::cont_joint_idxs,
+                             space->base_space_idx,
+                             cont_vals,
+                             &joint_vals,
+                             &scratch.base_tfs[i]);
+    for (Eigen::Index j = 0; j < num_cont; ++j) {
+      scratch.cont_vals(i, j) = cont_vals[j];
+    }
+
+    for (Eigen::Index j = 0; j < num_joints; ++j) {
+      scratch.joint_vals(i, j) = joint_vals[j];
+    }
+  }
+
+  auto* sg = states[0]->as<cspace::CompositeSpace::StateType>()->sg;
+  sg->update_transforms_batch(scratch.cont_vals, scratch.joint_vals, scratch.base_tfs, scratch.fk);
+  return sg;
+}
+}  // namespace planner::collisions
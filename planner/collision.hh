@@ -3,10 +3,14 @@
 #define COLLISION_HH
 #include "common.hh"
 
+#include <atomic>
+#include <cstdint>
 #include <fstream>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <thread>
 #include <unordered_set>
 #include <utility>
 
@@ -20,36 +24,201 @@
 
 #include <bullet/btBulletCollisionCommon.h>
 
+#ifdef USE_FCL
+#include <fcl/broadphase/broadphase_collision_manager.h>
+#include <fcl/narrowphase/collision_object.h>
+#endif
+
 #include "tsl/robin_set.h"
 
 #include "cspace.hh"
 #include "planner_utils.hh"
 #include "scene.hh"
 #include "scenegraph.hh"
+#include "sdf.hh"
+#include "sphere_prefilter.hh"
 
 namespace planner::collisions {
 namespace ob    = ompl::base;
 namespace scene = input::scene;
 using Graph     = structures::scenegraph::Graph;
+using Node      = structures::scenegraph::Node;
 using Robot     = structures::robot::Robot;
 
-extern unsigned int oob_count;
-extern unsigned int self_coll_count;
-extern unsigned int world_coll_count;
-// extern std::unordered_map<std::pair<Str, Str>, unsigned int, boost::hash<std::pair<Str, Str>>>
-// collision_counters;
-// extern std::ofstream* collisions_file;
 // extern std::ofstream* sample_data_file;
 class NeighborLinksFilter : public btOverlapFilterCallback {
  public:
   NeighborLinksFilter(const std::optional<Str>& blacklist_path, std::size_t num_items, Graph* sg);
+  // NOTE: Copies don't share the ancestry cache, which points into itself
+  NeighborLinksFilter(const NeighborLinksFilter& other);
   bool
   needBroadphaseCollision(btBroadphaseProxy* proxy0, btBroadphaseProxy* proxy1) const override;
+  /// True if the items with these indices should be checked against each other, i.e. they are
+  /// neither blacklisted nor parent and child. Negative indices are always checked
+  bool allowed(int idx1, int idx2) const {
+    return (idx1 < 0) || (idx2 < 0) || !(blacklist[idx1][idx2] || (*ancestry)[idx1][idx2]);
+  }
+
+  bool blacklisted(const Str& link_a, const Str& link_b) const;
+  /// Also exclude the link pairs marked in a matrix written by generate_collision_matrix
+  void load_matrix(const Str& matrix_path);
+  /// Get the index for a collision object, giving it one if it doesn't have one yet. Every object
+  /// the filter sees should have an index, used as its Bullet user index
+  std::size_t add_item(const Str& name);
+  /// Make the parent/child matrix match sg. This is cheap unless sg has been relinked since it was
+  /// last seen, and must be called before Bullet uses the filter
+  void update_ancestry();
+  /// The names of the indexed items, by index
+  const Vec<Str>& items() const { return item_names; }
   Graph* sg = nullptr;
   Map<Str, std::size_t> index_map;
 
  private:
+  void exclude(const Str& link_a, const Str& link_b);
+  std::size_t num_items;
+  Vec<Str> item_names;
   Vec<boost::dynamic_bitset<>> blacklist;
+
+  // Parent/child bitmatrices by scene graph topology, indexed like blacklist
+  Map<std::size_t, Vec<boost::dynamic_bitset<>>> ancestry_cache;
+  const Vec<boost::dynamic_bitset<>>* ancestry = nullptr;
+  std::size_t ancestry_topology = 0;
+};
+
+/// Invalid state counts. Each thread keeps its own copy; these are only summed on demand
+struct CollisionCounters {
+  unsigned int oob_count        = 0;
+  unsigned int self_coll_count  = 0;
+  unsigned int world_coll_count = 0;
+  // Overlapping pairs which went through the narrowphase, and those skipped by stopping early
+  std::size_t narrowphase_pairs = 0;
+  std::size_t skipped_pairs     = 0;
+  // Link/obstacle pairs which the obstacle SDF showed were clear, so skipped the narrowphase
+  std::size_t sdf_pairs = 0;
+
+  CollisionCounters& operator+=(const CollisionCounters& other) {
+    oob_count += other.oob_count;
+    self_coll_count += other.self_coll_count;
+    world_coll_count += other.world_coll_count;
+    narrowphase_pairs += other.narrowphase_pairs;
+    skipped_pairs += other.skipped_pairs;
+    sdf_pairs += other.sdf_pairs;
+    return *this;
+  }
+};
+
+/// Narrowphase statistics for every pair of collision objects, as flat num_items x num_items
+/// arrays indexed by user index. Only the entries with the smaller index first are used
+struct PairStats {
+  void resize(std::size_t items) {
+    num_items = items;
+    tests.resize(items * items, 0);
+    hits.resize(items * items, 0);
+    nanos.resize(items * items, 0);
+  }
+
+  std::size_t index(int a, int b) const {
+    return a < b ? a * num_items + b : b * num_items + a;
+  }
+
+  std::size_t num_items = 0;
+  Vec<unsigned int> tests;
+  Vec<unsigned int> hits;
+  Vec<std::uint64_t> nanos;
+};
+
+/// Lazily constructs one World (the mutable half of a collision backend) per calling thread
+template <typename World> class WorldPool {
+ public:
+  explicit WorldPool(std::function<std::unique_ptr<World>()> make_world)
+  : pool_id(++next_pool_id), make_world(std::move(make_world)) {}
+
+  /// Get the calling thread's World, making it if this is the thread's first call
+  World& local() const {
+    // NOTE: The thread-local cache skips the lock on the common path. Pool IDs are never reused,
+    // so a cache entry left behind by a destroyed pool can't match a new one
+    thread_local std::pair<std::size_t, World*> cache{0, nullptr};
+    if (cache.first == pool_id) {
+      return *cache.second;
+    }
+
+    std::lock_guard<std::mutex> lock(worlds_mutex);
+    auto& world = worlds[std::this_thread::get_id()];
+    if (world == nullptr) {
+      world = make_world();
+    }
+
+    cache = {pool_id, world.get()};
+    return *world;
+  }
+
+  /// Throw away every World, so they get made fresh on next use. Only safe while no thread is
+  /// checking states
+  void clear() {
+    std::lock_guard<std::mutex> lock(worlds_mutex);
+    worlds.clear();
+    // Invalidate every thread's cached pointer into this pool
+    pool_id = ++next_pool_id;
+  }
+
+  /// Visit every thread's World. Only meaningful while no thread is checking states
+  template <typename F> void for_each(F&& f) const {
+    std::lock_guard<std::mutex> lock(worlds_mutex);
+    for (const auto& [_, world] : worlds) {
+      f(*world);
+    }
+  }
+
+ private:
+  inline static std::atomic<std::size_t> next_pool_id{0};
+  std::atomic<std::size_t> pool_id;
+  std::function<std::unique_ptr<World>()> make_world;
+  mutable std::mutex worlds_mutex;
+  mutable Map<std::thread::id, std::unique_ptr<World>> worlds;
+};
+
+/// Runs the narrowphase one overlapping pair at a time, and stops the whole pass at the first pair
+/// which penetrates deeper than PENETRATION_EPSILON
+class EarlyExitDispatcher : public btCollisionDispatcher {
+ public:
+  explicit EarlyExitDispatcher(btCollisionConfiguration* collision_config)
+  : btCollisionDispatcher(collision_config) {}
+
+  void dispatchAllCollisionPairs(btOverlappingPairCache* pair_cache,
+                                 const btDispatcherInfo& dispatch_info,
+                                 btDispatcher* dispatcher) override;
+
+  // The colliding pair which ended the last pass, or nullptr if there wasn't one
+  const btCollisionObject* hit_a = nullptr;
+  const btCollisionObject* hit_b = nullptr;
+  // How many of the last pass's overlapping pairs went through the narrowphase
+  int pairs_processed = 0;
+  int pairs_total     = 0;
+  // If early_exit is off, the pass runs to completion and records every colliding pair in hits
+  bool early_exit = true;
+  Vec<std::pair<const btCollisionObject*, const btCollisionObject*>> hits;
+  // Indexed by user index: nonzero for the robot links which are known to be clear of every
+  // obstacle, so their pairs with obstacles are skipped. Empty if this isn't known
+  Vec<char> static_cleared;
+  // Indexed by user index: nonzero for the obstacles, which are all the SDF covers
+  // NOTE: Bullet marks every plain btCollisionObject static, links and objects included, so
+  // isStaticObject can't tell obstacles apart
+  Vec<char> obstacles;
+  // How many of the last pass's overlapping pairs were skipped because of static_cleared
+  int pairs_cleared = 0;
+  // If set, every pair which goes through the narrowphase is counted and timed here
+  PairStats* stats = nullptr;
+
+ private:
+  btManifoldArray manifolds;
+};
+
+/// Per-thread scratch space for CollisionChecker::pose_robot_batch
+struct BatchFKScratch {
+  Eigen::ArrayXXd cont_vals;
+  Eigen::ArrayXXd joint_vals;
+  Vec<Transform3r> base_tfs;
+  FKBatch fk;
 };
 
 class CollisionChecker : public ob::StateValidityChecker {
@@ -69,6 +238,39 @@ class CollisionChecker : public ob::StateValidityChecker {
 
   virtual bool isValid(const ob::State* state) const = 0;
 
+  /// Check a batch of states in order, stopping at the first invalid one. If first_invalid is
+  /// given, it is set to the index of that state (or to count, if every state is valid)
+  virtual bool checkStates(const ob::State* const* states,
+                           std::size_t count,
+                           std::size_t* first_invalid = nullptr) const {
+    for (std::size_t i = 0; i < count; ++i) {
+      if (!isValid(states[i])) {
+        if (first_invalid != nullptr) {
+          *first_invalid = i;
+        }
+
+        return false;
+      }
+    }
+
+    if (first_invalid != nullptr) {
+      *first_invalid = count;
+    }
+
+    return true;
+  }
+
+  /// Sum of the invalid state counts over all threads
+  virtual CollisionCounters counters() const = 0;
+
+  /// Stop checking the link pairs excluded by a matrix from generate_collision_matrix
+  virtual void load_collision_matrix(const Str& matrix_path) = 0;
+
+  /// Forget everything cached about object pose sets. Pose sets are identified by address, so
+  /// this must be called whenever they're thrown away (e.g. when the universe map is reset), and
+  /// only while no thread is checking states
+  virtual void forget_object_poses() {}
+
  protected:
   const ob::SpaceInformationPtr si;
   const cspace::CompositeSpace* const space;
@@ -80,9 +282,129 @@ class CollisionChecker : public ob::StateValidityChecker {
   const ob::CompoundStateSpace* const robot_space;
   const unsigned int joints_index;
 
+  /// Run FK for a state with the caches in workspace, calling set_link with the slot (from
+  /// link_slots) and collision transform of every robot link, and set_held (if given) with the node
+  /// and collision transform of every object attached to the robot
+  void pose_robot(const ob::State* state,
+                  FKWorkspace& workspace,
+                  const Map<Str, std::size_t>& link_slots,
+                  const std::function<void(std::size_t, const Transform3r&)>& set_link,
+                  const std::function<void(const Node*, const Transform3r&)>& set_held =
+                  nullptr) const;
+
+  /// Run FK for a batch of states which share a scene graph, all at once. The poses are left in
+  /// scratch.fk, in the order of its plan. Unlike pose_robot, this doesn't pose the objects in the
+  /// graph
+  const Graph* pose_robot_batch(const ob::State* const* states,
+                                std::size_t count,
+                                BatchFKScratch& scratch) const;
+
   virtual void output_json() const = 0;
 };
 
+/// Get the robot links which have collision geometry, sorted by name. Some links are in the
+/// robot's node map under more than one name, so we deduplicate by the link's own name
+Vec<const Node*> collision_links(const Robot* robot);
+
+/// Identifies where a world's objects are: the state's object pose set, and the scene graph
+/// structure which decides which of them the robot is holding
+struct ObjectPoseVersion {
+  const ob::CompoundState* object_poses = nullptr;
+  std::size_t topology                  = 0;
+  bool operator==(const ObjectPoseVersion& other) const {
+    return object_poses == other.object_poses && topology == other.topology;
+  }
+
+  struct Hash {
+    std::size_t operator()(const ObjectPoseVersion& version) const {
+      std::size_t result = 0;
+      boost::hash_combine(result, version.object_poses);
+      boost::hash_combine(result, version.topology);
+      return result;
+    }
+  };
+};
+
+/// One thread's Bullet machinery. Collision shapes are shared between worlds, but everything that
+/// Bullet mutates during a check (object transforms, the broadphase, manifolds, the filter's scene
+/// graph) is owned here
+struct BulletWorld {
+  /// Every object the robot isn't holding, frozen at one version's poses in a single compound
+  /// shape. Within a pose set these never move, so the broadphase only ever sees one object for
+  /// them, and the compound's own tree does the rest
+  struct ObjectSnapshot {
+    std::unique_ptr<btCompoundShape> shape;
+    std::unique_ptr<btCollisionObject> collision;
+    // Indexed like object_list. Poses are only meaningful for objects which aren't held
+    Vec<char> held;
+    Vec<btTransform> poses;
+  };
+
+  BulletWorld(const scene::ObjectSet& objects,
+              const scene::ObjectSet& obstacles,
+              const Vec<const Node*>& links,
+              const NeighborLinksFilter& filter,
+              const SpherePrefilter& prefilter);
+
+  /// Transforms per state in link_transforms: the links, then the held objects
+  std::size_t slots_per_state() const { return link_collisions.size() + object_list.size(); }
+  /// Move the robot links, updating broadphase AABBs only for the links which actually moved
+  void move_links(const btTransform* link_tfs);
+  /// Move the held objects along with the robot. object_tfs is indexed like object_list
+  void move_held(const btTransform* object_tfs);
+  /// Put an object in the world (in the robot's collision group) if it's held, or take it out if
+  /// it's in the snapshot instead
+  void set_held(std::size_t object, bool held);
+  /// The cached snapshot for a version, or nullptr if there isn't one
+  ObjectSnapshot* find_snapshot(const ObjectPoseVersion& version);
+  /// Build (and cache, unless the version has no pose set) the snapshot of the objects for a
+  /// version, given which objects are held and where the rest are
+  ObjectSnapshot*
+  add_snapshot(const ObjectPoseVersion& version, Vec<char> held, Vec<btTransform> poses);
+  /// Swap a snapshot into the world in place of the current one, and the held objects in with it
+  void use_snapshot(ObjectSnapshot* snapshot);
+  /// Drop the snapshots and the current object version, e.g. before pose sets are freed
+  void forget_object_poses();
+  /// Move one object, updating its broadphase AABB only if it actually moved
+  void place(btCollisionObject* obj, const btTransform& tf);
+  /// Find the overlapping pairs and run the narrowphase on them
+  void detect_collisions();
+
+  // NOTE: Declaration order matters here - the collision world must be destroyed before the
+  // objects, broadphase, and dispatcher it references
+  Vec<std::unique_ptr<btCollisionObject>> obstacle_collisions;
+  Map<Str, std::unique_ptr<btCollisionObject>> object_collisions;
+  Map<Str, std::unique_ptr<btCollisionObject>> robot_collisions;
+  // The robot links in a fixed order, so that link poses can be stored in flat buffers
+  Vec<btCollisionObject*> link_collisions;
+  Map<Str, std::size_t> link_slots;
+  // The movable objects in the order of the ObjectSet they came from, which is also the order the
+  // prefilter has them in
+  Vec<btCollisionObject*> object_list;
+  Map<Str, std::size_t> object_slots;
+  Vec<char> object_held;
+  ObjectPoseVersion object_version;
+  // Filter index of every snapshot
+  int snapshot_index = -1;
+  std::unordered_map<ObjectPoseVersion, std::unique_ptr<ObjectSnapshot>, ObjectPoseVersion::Hash>
+  snapshots;
+  // The snapshot for the last state without a pose set, which can't be reused
+  std::unique_ptr<ObjectSnapshot> uncached_snapshot;
+  ObjectSnapshot* active_snapshot = nullptr;
+  // Scratch space for poses: one block of slots_per_state() transforms per state
+  Vec<btTransform> link_transforms;
+  BatchFKScratch batch_scratch;
+  FKWorkspace fk_workspace;
+  SpherePrefilter::Scratch prefilter_scratch;
+  std::unique_ptr<btCollisionConfiguration> collision_config;
+  std::unique_ptr<EarlyExitDispatcher> collision_dispatch;
+  std::unique_ptr<btBroadphaseInterface> broadphase_interface;
+  std::unique_ptr<NeighborLinksFilter> broadphase_filter;
+  std::unique_ptr<btCollisionWorld> collision_world;
+  CollisionCounters counters;
+  PairStats pair_stats;
+};
+
 class BulletCollisionChecker : public CollisionChecker {
  public:
   BulletCollisionChecker(const ob::SpaceInformationPtr& si,
@@ -93,25 +415,135 @@ class BulletCollisionChecker : public CollisionChecker {
                          Graph* sg);
 
   bool isValid(const ob::State* state) const override;
+  bool checkStates(const ob::State* const* states,
+                   std::size_t count,
+                   std::size_t* first_invalid = nullptr) const override;
+  CollisionCounters counters() const override;
+
+  /// Sample robot configurations (keeping everything else from base_state) and write out a matrix
+  /// of the link pairs which never need checking: adjacent links, and pairs which collided in
+  /// none or all of the samples
+  void generate_collision_matrix(const ob::State* base_state,
+                                 unsigned int num_samples,
+                                 const Str& matrix_path) const;
+  void load_collision_matrix(const Str& matrix_path) override;
+  void forget_object_poses() override;
+  /// Check robot links against a signed distance field of the obstacles before (and mostly
+  /// instead of) the narrowphase. Must be called before any states are checked
+  void build_sdf(double resolution, const std::optional<Str>& cache_dir);
+  /// Lower bound on the distance between the robot and the obstacles in a state, from the link
+  /// bounding spheres. Infinite if there's no SDF
+  double clearance(const ob::State* state) const;
+  /// Start or stop gathering per-pair narrowphase statistics. Gathering costs two clock reads
+  /// per narrowphase pair, so it's off by default
+  void set_pair_stats(bool enabled) { pair_stats_enabled = enabled; }
+  /// Write the per-pair statistics summed over all threads, hottest pairs first, as CSV if the
+  /// path ends in .csv and as JSON otherwise
+  void write_pair_stats(const Str& stats_path) const;
 
  private:
-  // Bullet machinery
-  Vec<std::unique_ptr<btCollisionObject>> obstacle_collisions;
-  Map<Str, std::unique_ptr<btCollisionObject>> object_collisions;
-  Map<Str, std::unique_ptr<btCollisionObject>> robot_collisions;
-  std::unique_ptr<btCollisionWorld> collision_world;
-  std::unique_ptr<btCollisionConfiguration> collision_config;
-  std::unique_ptr<btCollisionDispatcher> collision_dispatch;
-  std::unique_ptr<btBroadphaseInterface> broadphase_interface;
-  std::unique_ptr<NeighborLinksFilter> broadphase_filter;
+  const scene::ObjectSet& objects;
+  const scene::ObjectSet& obstacles;
+  // The robot links with collision geometry, in the order every world stores them
+  const Vec<const Node*> links;
+  // The filter is only built (and the blacklist file read) once; each world gets a copy
+  NeighborLinksFilter filter_template;
+  SpherePrefilter prefilter;
+  WorldPool<BulletWorld> worlds;
+  std::unique_ptr<const ObstacleSDF> sdf;
+  // Indexed like links
+  Vec<ShapeSpheres> link_spheres;
+  std::atomic<bool> pair_stats_enabled{false};
 
+  /// Run FK for a state, writing the collision transform of every robot link into link_tfs,
+  /// followed by those of the held objects
+  void pose_links(BulletWorld& world, const ob::State* state, btTransform* link_tfs) const;
+  /// pose_links for a batch of states which share a scene graph, writing one block of
+  /// slots_per_state() transforms per state into world.link_transforms
+  void
+  pose_links_batch(BulletWorld& world, const ob::State* const* states, std::size_t count) const;
+  /// Swap in the snapshot of the objects which aren't held for a state, and put the held objects in
+  /// the robot's collision group. This only does anything when the state's object pose set or
+  /// scene graph structure differ from the last state's
+  void sync_objects(BulletWorld& world, const ob::State* state) const;
+  /// Move the robot links to link_tfs and check the world for collisions
+  bool check_links(BulletWorld& world, const ob::State* state, const btTransform* link_tfs) const;
   void output_json() const override;
 };
 
+#ifdef USE_FCL
+// FCL versions of the collision shapes, converted once and shared by every world
+using FCLGeometries = Map<const btCollisionShape*, std::shared_ptr<fcl::CollisionGeometryd>>;
+
+/// One thread's FCL machinery: the obstacles and the objects the robot isn't holding in one
+/// broadphase manager and the robot links (with any held objects) in another, so that self and
+/// world collisions can be checked separately
+struct FCLWorld {
+  FCLWorld(const scene::ObjectSet& objects,
+           const scene::ObjectSet& obstacles,
+           const Vec<const Node*>& links,
+           const NeighborLinksFilter& filter,
+           const FCLGeometries& geometries);
+
+  /// Move an object into the robot's manager if it's held, or back into the world's if not
+  void set_held(std::size_t object, bool held);
+
+  // NOTE: The managers only hold pointers to the objects, so they must be destroyed first
+  Vec<std::unique_ptr<fcl::CollisionObjectd>> world_objects;
+  Vec<std::unique_ptr<fcl::CollisionObjectd>> link_objects;
+  Map<Str, std::size_t> link_slots;
+  // The movable objects, which are also in world_objects
+  Vec<fcl::CollisionObjectd*> object_list;
+  Map<Str, std::size_t> object_slots;
+  Vec<char> object_held;
+  ObjectPoseVersion object_version;
+  NeighborLinksFilter filter;
+  FKWorkspace fk_workspace;
+  std::unique_ptr<fcl::BroadPhaseCollisionManagerd> world_manager;
+  std::unique_ptr<fcl::BroadPhaseCollisionManagerd> robot_manager;
+  CollisionCounters counters;
+};
+
+/// CollisionChecker backed by FCL, built from the same objects, obstacles, and robot links as
+/// BulletCollisionChecker and applying the same blacklist and penetration tolerance
+class FCLCollisionChecker : public CollisionChecker {
+ public:
+  FCLCollisionChecker(const ob::SpaceInformationPtr& si,
+                      const scene::ObjectSet& objects,
+                      const scene::ObjectSet& obstacles,
+                      const Robot* robot,
+                      const std::optional<Str>& blacklist_path,
+                      Graph* sg);
+
+  bool isValid(const ob::State* state) const override;
+  CollisionCounters counters() const override;
+  void load_collision_matrix(const Str& matrix_path) override;
+  void forget_object_poses() override;
+
+ private:
+  const scene::ObjectSet& objects;
+  const scene::ObjectSet& obstacles;
+  const Vec<const Node*> links;
+  NeighborLinksFilter filter_template;
+  const FCLGeometries geometries;
+  WorldPool<FCLWorld> worlds;
+
+  /// Put the objects which aren't held at the state's poses, and the held ones in with the robot.
+  /// This only does anything when the state's object pose set or scene graph structure differ
+  /// from the last state's
+  void sync_objects(FCLWorld& world, const ob::State* state) const;
+  void output_json() const override {}
+};
+#endif
+
 constexpr double PENETRATION_EPSILON  = 0.021;
 constexpr int OBJECTS_COLLISION_GROUP = 1;
 constexpr int OBJECTS_COLLISION_MASK  = 2;
 constexpr int ROBOT_COLLISION_GROUP   = 2;
 constexpr int ROBOT_COLLISION_MASK    = 3;
+// Number of scene graph topologies a filter keeps parent/child matrices for
+constexpr std::size_t MAX_ANCESTRY_CACHE_SIZE = 256;
+// Number of object pose versions a world keeps snapshots for
+constexpr std::size_t MAX_SNAPSHOT_CACHE_SIZE = 256;
 }  // namespace planner::collisions
 #endif
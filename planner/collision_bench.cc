@@ -0,0 +1,129 @@
+#include "collision_bench.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+// clang-format off
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
+// clang-format on
+
+#include "cspace.hh"
+
+namespace planner::collisions {
+namespace {
+  auto log = spdlog::stdout_color_mt("collision-bench");
+
+  ob::State* robot_part(const ob::SpaceInformationPtr& si, ob::State* state) {
+    const auto* space = si->getStateSpace()->as<cspace::CompositeSpace>();
+    return state->as<cspace::CompositeSpace::StateType>()
+    ->components[space->getSubspaceIndex(cspace::ROBOT_SPACE)];
+  }
+
+  const ob::StateSpacePtr& robot_space(const ob::SpaceInformationPtr& si) {
+    const auto* space = si->getStateSpace()->as<cspace::CompositeSpace>();
+    return space->getSubspace(cspace::ROBOT_SPACE);
+  }
+}  // namespace
+
+void record_states(const ob::SpaceInformationPtr& si,
+                   const ob::State* base_state,
+                   unsigned int count,
+                   const Str& states_path) {
+  const auto& space  = robot_space(si);
+  const auto sampler = space->allocDefaultStateSampler();
+  auto* state        = si->cloneState(base_state);
+  auto* robot_state  = robot_part(si, state);
+  std::ofstream states_file(states_path);
+  states_file.precision(17);
+  Vec<double> reals;
+  for (unsigned int i = 0; i < count; ++i) {
+    sampler->sampleUniform(robot_state);
+    space->copyToReals(reals, robot_state);
+    for (const auto value : reals) {
+      states_file << value << ' ';
+    }
+
+    states_file << '\n';
+  }
+
+  si->freeState(state);
+  log->info("Recorded {} states to {}", count, states_path);
+}
+
+Vec<ob::State*> load_states(const ob::SpaceInformationPtr& si,
+                            const ob::State* base_state,
+                            const Str& states_path) {
+  const auto& space = robot_space(si);
+  std::ifstream states_file(states_path);
+  Vec<ob::State*> result;
+  Vec<double> reals;
+  Str line;
+  while (std::getline(states_file, line)) {
+    std::istringstream line_stream(line);
+    reals.clear();
+    double value;
+    while (line_stream >> value) {
+      reals.push_back(value);
+    }
+
+    if (reals.empty()) {
+      continue;
+    }
+
+    if (reals.size() != space->getValueLocations().size()) {
+      log->error("Recorded state has {} values, but the robot space has {}",
+                 reals.size(),
+                 space->getValueLocations().size());
+      throw std::runtime_error("Bad recorded state");
+    }
+
+    auto* state = si->cloneState(base_state);
+    space->copyFromReals(robot_part(si, state), reals);
+    result.push_back(state);
+  }
+
+  return result;
+}
+
+void bench_collisions(const Vec<std::pair<Str, std::shared_ptr<CollisionChecker>>>& checkers,
+                      const Vec<ob::State*>& states) {
+  Vec<bool> reference;
+  for (const auto& [name, checker] : checkers) {
+    Vec<bool> results;
+    results.reserve(states.size());
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto* state : states) {
+      results.push_back(checker->isValid(state));
+    }
+
+    const auto end = std::chrono::steady_clock::now();
+    const auto micros =
+    std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    const auto num_valid = std::count(results.begin(), results.end(), true);
+    if (reference.empty()) {
+      reference = results;
+    }
+
+    std::size_t disagreements = 0;
+    std::size_t missed        = 0;
+    for (std::size_t i = 0; i < results.size(); ++i) {
+      disagreements += results[i] != reference[i];
+      missed += results[i] && !reference[i];
+    }
+
+    log->info("{}: {} states in {}ms ({:.2f}us/state), {} valid, {} disagreements with {} ({} "
+              "collisions missed)",
+              name,
+              states.size(),
+              micros / 1000.0,
+              states.empty() ? 0.0 : static_cast<double>(micros) / states.size(),
+              num_valid,
+              disagreements,
+              checkers.front().first,
+              missed);
+  }
+}
+}  // namespace planner::collisions
@@ -0,0 +1,34 @@
+#pragma once
+#ifndef COLLISION_BENCH_HH
+#define COLLISION_BENCH_HH
+/// Comparing collision backends on the same robot states
+
+#include "common.hh"
+
+#include <memory>
+
+#include <ompl/base/SpaceInformation.h>
+#include <ompl/base/State.h>
+
+#include "collision.hh"
+
+namespace planner::collisions {
+namespace ob = ompl::base;
+
+/// Sample robot configurations, keeping the rest of base_state, and write them one per line
+void record_states(const ob::SpaceInformationPtr& si,
+                   const ob::State* base_state,
+                   unsigned int count,
+                   const Str& states_path);
+
+/// Read states written by record_states. The caller owns (and must free) the states
+Vec<ob::State*> load_states(const ob::SpaceInformationPtr& si,
+                            const ob::State* base_state,
+                            const Str& states_path);
+
+/// Time every checker on every state, and report how often each disagrees with the first and how
+/// many of its collisions each misses
+void bench_collisions(const Vec<std::pair<Str, std::shared_ptr<CollisionChecker>>>& checkers,
+                      const Vec<ob::State*>& states);
+}  // namespace planner::collisions
+#endif
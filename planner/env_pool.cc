@@ -0,0 +1,21 @@
+#include "env_pool.hh"
+
+#include "cspace.hh"
+
+namespace symbolic::predicate {
+std::shared_ptr<EnvPool<LuaEnv<bool>>> correctness_pool;
+std::shared_ptr<EnvPool<LuaEnv<double>>> gradient_pool;
+std::shared_ptr<EnvPool<LuaEnv<double>>> precondition_pool;
+
+void load_domain(const LuaEnvData& env, const spec::Domain* const domain, const bool gradients) {
+  env.load_predicates(domain->predicates_file);
+  for (const auto& action : domain->actions) {
+    for (auto& [formula, _] : action->precondition) {
+      env.load_formula(&formula);
+      if (gradients) {
+        env.load_gradient(&formula, cspace::num_dims);
+      }
+    }
+  }
+}
+}  // namespace symbolic::predicate
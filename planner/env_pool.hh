@@ -0,0 +1,95 @@
+#pragma once
+#ifndef ENV_POOL_HH
+#define ENV_POOL_HH
+#include "common.hh"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "predicate.hh"
+#include "specification.hh"
+
+namespace symbolic::predicate {
+/// Load a domain's predicates and action preconditions into an environment, differentiating the
+/// preconditions too if asked
+void load_domain(const LuaEnvData& env, const spec::Domain* const domain, const bool gradients);
+
+/// An environment borrowed from a pool, which goes back to the pool when the handle is dropped
+template <typename EnvType>
+using EnvHandle = std::unique_ptr<EnvType, std::function<void(EnvType*)>>;
+
+/// Lends out environments with a domain already loaded into them. Lua states can't be copied, so
+/// a new environment is built from the pool's prelude and domain only when none are free;
+/// returned environments are kept for the next sampler, goal, or rep instead of being rebuilt
+template <typename EnvType> class EnvPool : public std::enable_shared_from_this<EnvPool<EnvType>> {
+ public:
+  EnvPool(const Str& name,
+          const Str& prelude_filename,
+          const spec::Domain* const domain,
+          const bool gradients)
+  : name(name), prelude_filename(prelude_filename), domain(domain), gradients(gradients) {}
+
+  /// Build environments ahead of time, so that the first users don't have to wait for them
+  void warm(const std::size_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (free_envs.size() < count) {
+      free_envs.emplace_back(build());
+    }
+  }
+
+  EnvHandle<EnvType> acquire() {
+    std::unique_ptr<EnvType> env;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!free_envs.empty()) {
+        env = std::move(free_envs.back());
+        free_envs.pop_back();
+      }
+    }
+
+    if (!env) {
+      env = build();
+    }
+
+    // NOTE: Handles keep the pool alive, so they can always be returned
+    return EnvHandle<EnvType>(env.release(),
+                              [pool = this->shared_from_this()](EnvType* env) {
+                                pool->release(env);
+                              });
+  }
+
+  const Str name;
+
+ private:
+  std::unique_ptr<EnvType> build() {
+    auto env = std::make_unique<EnvType>(fmt::format("{}-{}", name, num_built++), prelude_filename);
+    load_domain(*env, domain, gradients);
+    return env;
+  }
+
+  void release(EnvType* env) {
+    // The last user's bindings and universe stay set, but every user sets its own before calling
+    // into the environment
+    env->cleanup();
+    std::lock_guard<std::mutex> lock(mutex);
+    free_envs.emplace_back(env);
+  }
+
+  const Str prelude_filename;
+  const spec::Domain* const domain;
+  const bool gradients;
+  std::mutex mutex;
+  Vec<std::unique_ptr<EnvType>> free_envs;
+  // Builds don't hold the pool's lock, so samplers on several threads can build at once
+  std::atomic<unsigned int> num_built{0};
+};
+
+/// The pools shared by the samplers, goal, and universe map. Made in main, once the domain is
+/// loaded and the configuration space exists
+extern std::shared_ptr<EnvPool<LuaEnv<bool>>> correctness_pool;
+extern std::shared_ptr<EnvPool<LuaEnv<double>>> gradient_pool;
+extern std::shared_ptr<EnvPool<LuaEnv<double>>> precondition_pool;
+}  // namespace symbolic::predicate
+#endif
@@ -0,0 +1,344 @@
+#include "collision.hh"
+
+#ifdef USE_FCL
+#include <fcl/broadphase/broadphase_dynamic_AABB_tree.h>
+#include <fcl/config.h>
+#include <fcl/geometry/bvh/BVH_model.h>
+#include <fcl/geometry/shape/box.h>
+#include <fcl/geometry/shape/cylinder.h>
+#include <fcl/geometry/shape/sphere.h>
+#include <fcl/math/bv/OBBRSS.h>
+#include <fcl/narrowphase/collision.h>
+#if FCL_HAVE_OCTOMAP
+#include <fcl/geometry/octree/octree.h>
+#endif
+
+#include <bullet/BulletCollision/CollisionShapes/btShapeHull.h>
+
+// clang-format off
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
+// clang-format on
+
+namespace planner::collisions {
+namespace {
+  auto log = spdlog::stdout_color_mt("fcl");
+
+  using Mesh = fcl::BVHModel<fcl::OBBRSSd>;
+
+  fcl::Transform3d to_fcl(const btTransform& tf) {
+    const auto& origin = tf.getOrigin();
+    const auto rotation = tf.getRotation();
+    fcl::Transform3d result = fcl::Transform3d::Identity();
+    result.translation() = fcl::Vector3d(origin.x(), origin.y(), origin.z());
+    result.linear() =
+    fcl::Quaterniond(rotation.w(), rotation.x(), rotation.y(), rotation.z()).toRotationMatrix();
+    return result;
+  }
+
+  fcl::Vector3d to_fcl(const btVector3& v) { return fcl::Vector3d(v.x(), v.y(), v.z()); }
+
+  struct TriangleCollector : public btTriangleCallback {
+    TriangleCollector(const btTransform& tf, Mesh& mesh) : tf(tf), mesh(mesh) {}
+
+    void processTriangle(btVector3* triangle, int /* part */, int /* index */) override {
+      mesh.addTriangle(to_fcl(tf(triangle[0])), to_fcl(tf(triangle[1])), to_fcl(tf(triangle[2])));
+    }
+
+    const btTransform& tf;
+    Mesh& mesh;
+  };
+
+  /// Add the triangles of shape, placed at tf, to a mesh which is being built
+  void add_triangles(const btCollisionShape* shape, const btTransform& tf, Mesh& mesh) {
+    if (shape->isCompound()) {
+      const auto* compound = static_cast<const btCompoundShape*>(shape);
+      for (int i = 0; i < compound->getNumChildShapes(); ++i) {
+        add_triangles(compound->getChildShape(i), tf * compound->getChildTransform(i), mesh);
+      }
+    } else if (shape->isConcave()) {
+      TriangleCollector collector(tf, mesh);
+      const btVector3 big(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+      static_cast<const btConcaveShape*>(shape)->processAllTriangles(&collector, -big, big);
+    } else if (shape->isConvex()) {
+      // NOTE: This approximates curved shapes, but those are converted directly in make_geometry
+      // unless they're inside a compound
+      btShapeHull hull(static_cast<const btConvexShape*>(shape));
+      hull.buildHull(shape->getMargin());
+      const auto* vertices = hull.getVertexPointer();
+      const auto* indices  = hull.getIndexPointer();
+      for (int i = 0; i < hull.numTriangles(); ++i) {
+        mesh.addTriangle(to_fcl(tf(vertices[indices[3 * i]])),
+                         to_fcl(tf(vertices[indices[3 * i + 1]])),
+                         to_fcl(tf(vertices[indices[3 * i + 2]])));
+      }
+    } else {
+      log->error("Can't convert shape type {} for FCL", shape->getShapeType());
+      throw std::runtime_error("Unsupported collision shape");
+    }
+  }
+
+  std::shared_ptr<fcl::CollisionGeometryd> make_geometry(const btCollisionShape* shape) {
+    switch (shape->getShapeType()) {
+      case BOX_SHAPE_PROXYTYPE: {
+        const auto& extents = static_cast<const btBoxShape*>(shape)->getHalfExtentsWithMargin();
+        return std::make_shared<fcl::Boxd>(2.0 * to_fcl(extents));
+      }
+
+      case SPHERE_SHAPE_PROXYTYPE:
+        return std::make_shared<fcl::Sphered>(
+        static_cast<const btSphereShape*>(shape)->getRadius());
+
+      default:
+        break;
+    }
+
+    // FCL cylinders run along Z, like btCylinderShapeZ; other cylinders are meshed below
+    if (const auto* cylinder = dynamic_cast<const btCylinderShapeZ*>(shape)) {
+      const auto& extents = cylinder->getHalfExtentsWithMargin();
+      return std::make_shared<fcl::Cylinderd>(extents.x(), 2.0 * extents.z());
+    }
+
+    auto mesh = std::make_shared<Mesh>();
+    mesh->beginModel();
+    add_triangles(shape, btTransform::getIdentity(), *mesh);
+    mesh->endModel();
+    return mesh;
+  }
+
+  FCLGeometries make_geometries(const scene::ObjectSet& objects,
+                                const scene::ObjectSet& obstacles,
+                                const Vec<const Node*>& links) {
+    FCLGeometries result;
+    for (const auto* object_set : {&objects, &obstacles}) {
+      for (const auto& [_, object] : *object_set) {
+        if (result.count(object->geom.get()) != 0) {
+          continue;
+        }
+
+#if FCL_HAVE_OCTOMAP
+        // FCL traverses octrees natively, rather than through the leaf boxes we give Bullet
+        if (object->octree) {
+          result.emplace(object->geom.get(), std::make_shared<fcl::OcTreed>(object->octree));
+          continue;
+        }
+#endif
+
+        result.emplace(object->geom.get(), make_geometry(object->geom.get()));
+      }
+    }
+
+    for (const auto* link : links) {
+      if (result.count(link->geom.get()) == 0) {
+        result.emplace(link->geom.get(), make_geometry(link->geom.get()));
+      }
+    }
+
+    return result;
+  }
+
+  /// Item indices are stored directly in the objects' user data
+  inline int item_index(const fcl::CollisionObjectd* obj) {
+    return static_cast<int>(reinterpret_cast<std::intptr_t>(obj->getUserData()));
+  }
+
+  struct CallbackData {
+    const NeighborLinksFilter* filter;
+    fcl::CollisionRequestd request;
+    fcl::CollisionResultd result;
+    bool colliding = false;
+  };
+
+  /// Narrowphase for one broadphase pair. Returning true stops the manager's traversal, so we
+  /// stop at the first penetration deeper than PENETRATION_EPSILON, as the Bullet checker does
+  bool collide_pair(fcl::CollisionObjectd* obj_a, fcl::CollisionObjectd* obj_b, void* data_ptr) {
+    auto* data = static_cast<CallbackData*>(data_ptr);
+    if (data->colliding || !data->filter->allowed(item_index(obj_a), item_index(obj_b))) {
+      return data->colliding;
+    }
+
+    data->result.clear();
+    fcl::collide(obj_a, obj_b, data->request, data->result);
+    for (std::size_t i = 0; i < data->result.numContacts(); ++i) {
+      if (data->result.getContact(i).penetration_depth >= PENETRATION_EPSILON) {
+        data->colliding = true;
+        break;
+      }
+    }
+
+    return data->colliding;
+  }
+}  // namespace
+
+FCLCollisionChecker::FCLCollisionChecker(const ob::SpaceInformationPtr& si,
+                                         const scene::ObjectSet& objects,
+                                         const scene::ObjectSet& obstacles,
+                                         const Robot* robot,
+                                         const std::optional<Str>& blacklist_path,
+                                         Graph* sg)
+: CollisionChecker(si, robot)
+, objects(objects)
+, obstacles(obstacles)
+, links(collision_links(robot))
+, filter_template(blacklist_path, links.size(), sg)
+, geometries(make_geometries(objects, obstacles, links))
+, worlds([this]() {
+  return std::make_unique<FCLWorld>(
+  this->objects, this->obstacles, links, filter_template, geometries);
+}) {}
+
+bool FCLCollisionChecker::isValid(const ob::State* state) const {
+  auto& world = worlds.local();
+  if (!si->satisfiesBounds(state)) {
+    ++world.counters.oob_count;
+    return false;
+  }
+
+  sync_objects(world, state);
+  const auto place = [](fcl::CollisionObjectd* const obj, const Transform3r& coll_tf) {
+    obj->setTransform(coll_tf);
+    obj->computeAABB();
+  };
+
+  pose_robot(
+  state,
+  world.fk_workspace,
+  world.link_slots,
+  [&](const std::size_t slot, const Transform3r& coll_tf) {
+    place(world.link_objects[slot].get(), coll_tf);
+  },
+  [&](const Node* const node, const Transform3r& coll_tf) {
+    place(world.object_list[world.object_slots.at(node->name)], coll_tf);
+  });
+
+  world.filter.sg = state->as<cspace::CompositeSpace::StateType>()->sg;
+  world.filter.update_ancestry();
+  world.robot_manager->update();
+
+  CallbackData data;
+  data.filter                   = &world.filter;
+  data.request.enable_contact   = true;
+  data.request.num_max_contacts = 4;
+  world.robot_manager->collide(&data, collide_pair);
+  if (data.colliding) {
+    ++world.counters.self_coll_count;
+    return false;
+  }
+
+  world.world_manager->collide(world.robot_manager.get(), &data, collide_pair);
+  if (data.colliding) {
+    ++world.counters.world_coll_count;
+    return false;
+  }
+
+  return true;
+}
+
+void FCLCollisionChecker::sync_objects(FCLWorld& world, const ob::State* state) const {
+  if (world.object_list.empty()) {
+    return;
+  }
+
+  const auto* cstate = state->as<cspace::CompositeSpace::StateType>();
+  const ObjectPoseVersion version{cstate->object_poses, cstate->sg->topology()};
+  // Without a pose set to go by, we can't tell if the objects moved
+  if (version == world.object_version && version.object_poses != nullptr) {
+    return;
+  }
+
+  world.object_version      = version;
+  const auto* objects_state = cstate->as<ob::CompoundStateSpace::StateType>(objects_index);
+  Map<Str, Transform3r> pose_map;
+  pose_map.reserve(objects_space->getSubspaceCount());
+  util::state_to_pose_map(objects_state, objects_space, pose_map);
+  for (const auto& [name, slot] : world.object_slots) {
+    const auto held = cstate->sg->attached_to_robot(name);
+    world.set_held(slot, held);
+    // Held objects are moved with the robot links, by pose_robot
+    if (!held) {
+      auto* collision_object = world.object_list[slot];
+      collision_object->setTransform(pose_map.at(name));
+      collision_object->computeAABB();
+    }
+  }
+
+  world.world_manager->update();
+}
+
+CollisionCounters FCLCollisionChecker::counters() const {
+  CollisionCounters total;
+  worlds.for_each([&](const FCLWorld& world) { total += world.counters; });
+  return total;
+}
+
+void FCLCollisionChecker::load_collision_matrix(const Str& matrix_path) {
+  filter_template.load_matrix(matrix_path);
+  worlds.clear();
+}
+
+void FCLCollisionChecker::forget_object_poses() {
+  // The next state's objects get synced, whatever the address of its pose set
+  worlds.for_each([](FCLWorld& world) { world.object_version = {}; });
+}
+
+FCLWorld::FCLWorld(const scene::ObjectSet& objects,
+                   const scene::ObjectSet& obstacles,
+                   const Vec<const Node*>& links,
+                   const NeighborLinksFilter& filter,
+                   const FCLGeometries& geometries)
+: filter(filter)
+, world_manager(std::make_unique<fcl::DynamicAABBTreeCollisionManagerd>())
+, robot_manager(std::make_unique<fcl::DynamicAABBTreeCollisionManagerd>()) {
+  const auto add_object = [&](const auto& object, auto& collision_objects) {
+    auto& collision_object = collision_objects.emplace_back(
+    std::make_unique<fcl::CollisionObjectd>(geometries.at(object.geom.get())));
+    const auto idx = this->filter.add_item(object.name);
+    collision_object->setUserData(reinterpret_cast<void*>(static_cast<std::intptr_t>(idx)));
+    return collision_object.get();
+  };
+
+  // NOTE: Objects start at their initial poses, and are moved by sync_objects
+  for (const auto* object_set : {&obstacles, &objects}) {
+    for (const auto& [_, object] : *object_set) {
+      auto* collision_object = add_object(*object, world_objects);
+      collision_object->setTransform(to_fcl(object->initial_pose));
+      collision_object->computeAABB();
+      world_manager->registerObject(collision_object);
+      if (object_set == &objects) {
+        object_slots.emplace(object->name, object_list.size());
+        object_list.push_back(collision_object);
+      }
+    }
+  }
+
+  object_held.resize(object_list.size(), 0);
+
+  for (const auto* link : links) {
+    link_slots.emplace(link->name, link_objects.size());
+    auto* collision_object = add_object(*link, link_objects);
+    collision_object->setTransform(link->collision_transform);
+    collision_object->computeAABB();
+    robot_manager->registerObject(collision_object);
+  }
+
+  this->filter.update_ancestry();
+  world_manager->setup();
+  robot_manager->setup();
+}
+
+void FCLWorld::set_held(const std::size_t object, const bool held) {
+  if (static_cast<bool>(object_held[object]) == held) {
+    return;
+  }
+
+  object_held[object] = held;
+  if (held) {
+    world_manager->unregisterObject(object_list[object]);
+    robot_manager->registerObject(object_list[object]);
+  } else {
+    robot_manager->unregisterObject(object_list[object]);
+    world_manager->registerObject(object_list[object]);
+  }
+}
+}  // namespace planner::collisions
+#endif
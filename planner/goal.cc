@@ -256,14 +256,21 @@ namespace goal {
     const auto& uni_data = universe_map->graph.at(uni_sig);
     uni_data->sg->pose_objects(pose_map);
 
+    const auto state_hash = util::hash_value(*cstate);
     for (const auto& [formula, branch_config] : *goal) {
       if (discrete_satisfied(uni_sig, config_sig, branch_config)) {
         log->info("Goal branch {} is satisfied by ({}, {})", branch_config, uni_sig, config_sig);
-        log->info("Now checking formula {}", formula.normal_def);
-        correctness_env->set_universe(uni_data.get());
-        const auto correctness =
-        (*correctness_env)(formula.normal_fn_name, space, cstate, robot->base_movable);
-        if (correctness) {
+        const util::PredicateMemo::Key key{&formula, nullptr, state_hash, uni_data.get()};
+        auto correctness = goal_memo->find(key, cstate);
+        if (!correctness) {
+          log->info("Now checking formula {}", formula.normal_def);
+          correctness_env->set_universe(uni_data.get());
+          correctness =
+          (*correctness_env)(formula.normal_fn_name, space, cstate, robot->base_movable);
+          goal_memo->insert(key, cstate, *correctness);
+        }
+
+        if (*correctness) {
           log->info("Formula satisfied!");
           return true;
         }
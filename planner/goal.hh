@@ -11,9 +11,11 @@
 #include <ompl/base/goals/GoalLazySamples.h>
 
 #include "cspace.hh"
+#include "env_pool.hh"
 #include "heuristic.hh"
 #include "planner_utils.hh"
 #include "predicate.hh"
+#include "predicate_memo.hh"
 #include "robot.hh"
 #include "specification.hh"
 
@@ -48,21 +50,25 @@ struct CompositeGoal : public ob::Goal {
   , discrete_space_idx(space->getSubspaceIndex(cspace::DISCRETE_SPACE))
   , num_discrete_dims(
     space->getSubspace(discrete_space_idx)->as<ob::CompoundStateSpace>()->getSubspaceCount()) {
-    correctness_env =
-    std::make_unique<symbolic::predicate::LuaEnv<bool>>("goal-test",
-                                                        symbolic::predicate::BOOL_PRELUDE_PATH);
-    correctness_env->load_predicates(domain->predicates_file);
-    for (const auto& action : domain->actions) {
-      for (auto& [formula, _] : action->precondition) {
-        correctness_env->load_formula(&formula);
-      }
-    }
-
+    // NOTE: The goal formulae are unloaded again before the environment goes back to the pool
+    correctness_env = pred::correctness_pool->acquire();
     for (auto& [formula, _] : *goal) {
       correctness_env->load_formula(&formula);
     }
+
+    goal_memo = std::make_unique<util::PredicateMemo>(space, util::MEMO_CAPACITY);
   }
 
+  ~CompositeGoal() override {
+    for (const auto& [formula, _] : *goal) {
+      correctness_env->unload_formula(&formula);
+    }
+  }
+
+  /// Forget memoized goal checks, which point to universes that don't outlive a rep
+  void clear_memo() const { goal_memo->clear(); }
+  util::PredicateMemo::Counters memo_counters() const { return goal_memo->counters(); }
+
   virtual bool isSatisfied(const ob::State* state) const override;
   virtual bool isSatisfied(const ob::State* state, double* distance) const override;
   static util::UniverseMap* universe_map;
@@ -77,7 +83,8 @@ struct CompositeGoal : public ob::Goal {
   const spec::Domain* const domain;
   const spec::Goal* const goal;
   const structures::robot::Robot* const robot;
-  std::unique_ptr<symbolic::predicate::LuaEnv<bool>> correctness_env;
+  pred::EnvHandle<pred::LuaEnv<bool>> correctness_env;
+  std::unique_ptr<util::PredicateMemo> goal_memo;
 
   const int eqclass_space_idx;
   const int num_eqclass_dims;
@@ -27,6 +27,9 @@ RobotBaseSpace::RobotBaseSpace() {
 
 std::size_t hash_value(const RobotBaseSpace::StateType& x) {
   size_t hash_val = 0;
+  boost::hash_combine(hash_val, x.getX());
+  boost::hash_combine(hash_val, x.getY());
+  boost::hash_combine(hash_val, x.getZ());
   boost::hash_combine(hash_val, x.rotation());
   return hash_val;
 }
@@ -2,6 +2,9 @@
 
 #include <queue>
 #include <stdexcept>
+#include <utility>
+
+#include "collision.hh"
 
 #include "fplus/fplus.hpp"
 
@@ -14,6 +17,61 @@
 namespace planner::motion {
 namespace {
   auto log = spdlog::stdout_color_mt("motion");
+
+  /// Validity check a run of states in order, through the batch interface if the checker has one
+  bool check_states(const ob::SpaceInformation* si,
+                    ob::State* const* states,
+                    const std::size_t count,
+                    std::size_t* first_invalid) {
+    const auto* checker =
+    dynamic_cast<const collisions::CollisionChecker*>(si->getStateValidityChecker().get());
+    if (checker != nullptr) {
+      return checker->checkStates(states, count, first_invalid);
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+      if (!si->isValid(states[i])) {
+        *first_invalid = i;
+        return false;
+      }
+    }
+
+    *first_invalid = count;
+    return true;
+  }
+
+  /// States and orderings reused by one thread's motion checks, so checking a motion doesn't
+  /// allocate once the longest motion has been seen
+  struct MotionScratch {
+    explicit MotionScratch(ob::StateSpacePtr space) : space(std::move(space)) {}
+    ~MotionScratch() {
+      for (auto* state : states) {
+        space->freeState(state);
+      }
+    }
+
+    /// Make sure there are at least count states
+    void reserve(std::size_t count) {
+      while (states.size() < count) {
+        states.push_back(space->allocState());
+      }
+    }
+
+    const ob::StateSpacePtr space;
+    Vec<ob::State*> states;
+    Vec<int> order;
+    std::queue<std::pair<int, int>> pos;
+  };
+
+  /// This thread's scratch, made afresh when a motion comes from a different space than the last
+  MotionScratch& local_scratch(const ob::StateSpacePtr& space) {
+    thread_local std::unique_ptr<MotionScratch> scratch;
+    if (scratch == nullptr || scratch->space != space) {
+      scratch = std::make_unique<MotionScratch>(space);
+    }
+
+    return *scratch;
+  }
 }  // namespace
 
 unsigned int invalid_end                                 = 0;
@@ -37,35 +95,20 @@ bool UniverseMotionValidator::checkMotion(const ob::State* s1, const ob::State*
   bool result                = true;
   unsigned int nd            = space->validSegmentCount(s1, s2);
 
-  /* initialize the queue of test positions */
-  std::queue<std::pair<int, int>> pos;
   if (nd >= 2) {
+    /* lay out the test positions in the order that repeatedly subdividing the path segment in
+     * the middle would visit them, so that they can be checked as one batch */
+    auto& local = local_scratch(si_->getStateSpace());
+    auto& order = local.order;
+    auto& pos   = local.pos;
+    order.clear();
     pos.push({1, nd - 1});
-
-    /* temporary storage for the checked state */
-    auto* test = si_->allocState()->as<util::HashableStateSpace::StateType>();
-
-    /* repeatedly subdivide the path segment in the middle (and check the middle) */
     while (!pos.empty()) {
       std::pair<int, int> x = pos.front();
+      pos.pop();
 
       int mid = (x.first + x.second) / 2;
-      space->interpolate(s1, s2, static_cast<double>(mid) / static_cast<double>(nd), test);
-
-      if (!si_->isValid(test)) {
-        result = false;
-        ++invalid_interp;
-        // log->warn("Intermediate state is invalid");
-        break;
-      }
-
-      if (!successful_transition && universe_map->check_valid_transition(test, cstate2)) {
-        // TODO(Wil): We'll need to add to the action log here once precondition checking is
-        // added
-        successful_transition = true;
-      }
-
-      pos.pop();
+      order.push_back(mid);
 
       if (x.first < mid) {
         pos.push({x.first, mid - 1});
@@ -76,7 +119,29 @@ bool UniverseMotionValidator::checkMotion(const ob::State* s1, const ob::State*
       }
     }
 
-    si_->freeState(test);
+    local.reserve(order.size());
+    const auto& tests = local.states;
+    for (std::size_t i = 0; i < order.size(); ++i) {
+      space->interpolate(
+      s1, s2, static_cast<double>(order[i]) / static_cast<double>(nd), tests[i]);
+    }
+
+    std::size_t first_invalid = order.size();
+    if (!check_states(si_, tests.data(), order.size(), &first_invalid)) {
+      result = false;
+      ++invalid_interp;
+      // log->warn("Intermediate state is invalid");
+    }
+
+    // Only the states before the first invalid one would have been reached
+    for (std::size_t i = 0; i < first_invalid && !successful_transition; ++i) {
+      if (universe_map->check_valid_transition(
+          tests[i]->as<util::HashableStateSpace::StateType>(), cstate2)) {
+        // TODO(Wil): We'll need to add to the action log here once precondition checking is
+        // added
+        successful_transition = true;
+      }
+    }
   }
 
   // log->info("Result: {} Successful transition: {}", result, successful_transition);
@@ -104,33 +169,32 @@ bool UniverseMotionValidator::checkMotion(const ob::State* s1,
 
   bool successful_transition = universe_map->check_valid_transition(cstate1, cstate2);
 
-  ob::State* prev = si_->allocState();
-  si_->copyState(prev, s1);
-
   if (nd > 1) {
-    auto* test = si_->allocState()->as<util::HashableStateSpace::StateType>();
+    auto& local = local_scratch(si_->getStateSpace());
+    local.reserve(nd - 1);
+    const auto& tests = local.states;
     for (unsigned int j = 1; j < nd; ++j) {
-      space->interpolate(s1, s2, static_cast<double>(j) / static_cast<double>(nd), test);
-      if (!si_->isValid(test)) {
-        lastValid.second = static_cast<double>(j - 1) / static_cast<double>(nd);
-        if (lastValid.first != nullptr) {
-          space->interpolate(s1, s2, lastValid.second, lastValid.first);
-        }
-
-        result = false;
-        break;
+      space->interpolate(s1, s2, static_cast<double>(j) / static_cast<double>(nd), tests[j - 1]);
+    }
+
+    std::size_t first_invalid = nd - 1;
+    if (!check_states(si_, tests.data(), nd - 1, &first_invalid)) {
+      lastValid.second = static_cast<double>(first_invalid) / static_cast<double>(nd);
+      if (lastValid.first != nullptr) {
+        space->interpolate(s1, s2, lastValid.second, lastValid.first);
       }
 
-      if (!successful_transition && universe_map->check_valid_transition(test, cstate2)) {
+      result = false;
+    }
+
+    for (std::size_t i = 0; i < first_invalid && !successful_transition; ++i) {
+      if (universe_map->check_valid_transition(
+          tests[i]->as<util::HashableStateSpace::StateType>(), cstate2)) {
         // TODO(Wil): We'll need to add to the action log here once precondition checking is
         // added
         successful_transition = true;
       }
-
-      si_->copyState(prev, test);
     }
-
-    si_->freeState(test);
   }
 
   result &= successful_transition;
@@ -152,7 +216,6 @@ bool UniverseMotionValidator::checkMotion(const ob::State* s1,
     invalid_++;
   }
 
-  si_->freeState(prev);
   return result;
 }
 }  // namespace planner::motion
@@ -0,0 +1,1109 @@
+#include "native_formula.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+
+#include "fmt/format.h"
+
+// clang-format off
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
+// clang-format on
+
+#include "world_functions.hh"
+
+namespace symbolic::predicate {
+using Op = NativeFormula::Op;
+
+struct FormulaCompiler::Expr {
+  enum class Kind { NUMBER, BOOLEAN, NAME, FIELD, CALL, UNARY, BINARY };
+  Kind kind;
+  double number = 0.0;
+  /// The name, field, callee (e.g. "math.sqrt"), or operator
+  Str name;
+  Vec<std::shared_ptr<const Expr>> args;
+};
+
+struct FormulaCompiler::Function {
+  struct Assignment {
+    Vec<Str> names;
+    Vec<std::shared_ptr<const Expr>> values;
+  };
+
+  Vec<Str> params;
+  Vec<Assignment> body;
+  std::shared_ptr<const Expr> result;
+  /// Why the function can't be compiled, if it can't
+  Str unsupported;
+};
+
+namespace {
+  auto log = spdlog::stdout_color_mt("native-formula");
+
+  using Expr     = FormulaCompiler::Expr;
+  using ExprPtr  = std::shared_ptr<const Expr>;
+  using Function = FormulaCompiler::Function;
+
+  /// Thrown for anything the compiler doesn't handle, to send the formula back to Lua
+  struct Unsupported : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+
+  constexpr int MAX_INLINE_DEPTH = 64;
+
+  struct Token {
+    enum class Type { NAME, NUMBER, STRING, SYMBOL };
+    Type type;
+    Str text;
+    double number = 0.0;
+  };
+
+  /// Length of the long bracket opening at i (e.g. "[==["), or 0 if there isn't one
+  std::size_t long_bracket(const Str& source, std::size_t i) {
+    if (source[i] != '[') {
+      return 0;
+    }
+
+    auto j = i + 1;
+    while (j < source.size() && source[j] == '=') {
+      ++j;
+    }
+
+    return (j < source.size() && source[j] == '[') ? j - i + 1 : 0;
+  }
+
+  /// Skip past the long bracket of the given length opening at i
+  std::size_t skip_long_bracket(const Str& source, std::size_t i, std::size_t length) {
+    const auto close = "]" + Str(length - 2, '=') + "]";
+    const auto end   = source.find(close, i + length);
+    if (end == Str::npos) {
+      throw Unsupported("unfinished long string or comment");
+    }
+
+    return end + close.size();
+  }
+
+  Vec<Token> tokenize(const Str& source) {
+    static const char* const symbols[] = {"...", "==", "~=", "<=", ">=", "..", "::"};
+    Vec<Token> tokens;
+    std::size_t i = 0;
+    while (i < source.size()) {
+      const auto c = source[i];
+      if (std::isspace(static_cast<unsigned char>(c)) != 0) {
+        ++i;
+      } else if (source.compare(i, 2, "--") == 0) {
+        if (const auto length = long_bracket(source, i + 2); length != 0) {
+          i = skip_long_bracket(source, i + 2, length);
+        } else {
+          i = source.find('\n', i);
+          i = i == Str::npos ? source.size() : i;
+        }
+      } else if (std::isalpha(static_cast<unsigned char>(c)) != 0 || c == '_') {
+        auto j = i;
+        while (j < source.size() &&
+               (std::isalnum(static_cast<unsigned char>(source[j])) != 0 || source[j] == '_')) {
+          ++j;
+        }
+
+        tokens.push_back({Token::Type::NAME, source.substr(i, j - i)});
+        i = j;
+      } else if (std::isdigit(static_cast<unsigned char>(c)) != 0 ||
+                 (c == '.' && i + 1 < source.size() &&
+                  std::isdigit(static_cast<unsigned char>(source[i + 1])) != 0)) {
+        char* end         = nullptr;
+        const auto number = std::strtod(source.c_str() + i, &end);
+        const auto j      = static_cast<std::size_t>(end - source.c_str());
+        tokens.push_back({Token::Type::NUMBER, source.substr(i, j - i), number});
+        i = j;
+      } else if (c == '"' || c == '\'') {
+        auto j = i + 1;
+        while (j < source.size() && source[j] != c) {
+          j += source[j] == '\\' ? 2 : 1;
+        }
+
+        tokens.push_back({Token::Type::STRING, source.substr(i, j + 1 - i)});
+        i = j + 1;
+      } else if (const auto length = long_bracket(source, i); length != 0) {
+        const auto j = skip_long_bracket(source, i, length);
+        tokens.push_back({Token::Type::STRING, source.substr(i, j - i)});
+        i = j;
+      } else {
+        Str symbol(1, c);
+        for (const auto* candidate : symbols) {
+          if (source.compare(i, std::char_traits<char>::length(candidate), candidate) == 0) {
+            symbol = candidate;
+            break;
+          }
+        }
+
+        tokens.push_back({Token::Type::SYMBOL, symbol});
+        i += symbol.size();
+      }
+    }
+
+    return tokens;
+  }
+
+  bool is_keyword(const Str& name) {
+    static const Set<Str> keywords{"and",   "break", "do",   "else",   "elseif", "end",
+                                   "false", "for",   "function",    "if",     "in",     "local",
+                                   "nil",   "not",   "or",   "repeat", "return", "then",
+                                   "true",  "until", "while"};
+    return keywords.count(name) != 0;
+  }
+
+  /// The index of the "end" closing the block whose body starts at pos
+  std::size_t block_end(const Vec<Token>& tokens, std::size_t pos) {
+    int depth = 1;
+    for (; pos < tokens.size(); ++pos) {
+      if (tokens[pos].type != Token::Type::NAME) {
+        continue;
+      }
+
+      const auto& text = tokens[pos].text;
+      if (text == "function" || text == "if" || text == "do" || text == "repeat") {
+        ++depth;
+      } else if ((text == "end" || text == "until") && --depth == 0) {
+        return pos;
+      }
+    }
+
+    throw Unsupported("unterminated block");
+  }
+
+  /// Left and right binding priorities of the binary operators, as in Lua's own parser
+  std::optional<std::pair<int, int>> binary_priority(const Token& token) {
+    static const Map<Str, std::pair<int, int>> priorities{
+    {"or", {1, 1}}, {"and", {2, 2}}, {"<", {3, 3}},  {">", {3, 3}},  {"<=", {3, 3}},
+    {">=", {3, 3}}, {"~=", {3, 3}},  {"==", {3, 3}}, {"..", {5, 4}}, {"+", {6, 6}},
+    {"-", {6, 6}},  {"*", {7, 7}},   {"/", {7, 7}},  {"%", {7, 7}},  {"^", {10, 9}}};
+    if (token.type != Token::Type::NAME && token.type != Token::Type::SYMBOL) {
+      return std::nullopt;
+    }
+
+    const auto it = priorities.find(token.text);
+    return it == priorities.end() ? std::nullopt : std::make_optional(it->second);
+  }
+
+  constexpr int UNARY_PRIORITY = 8;
+
+  class Parser {
+   public:
+    Parser(const Vec<Token>& tokens, std::size_t begin, std::size_t end)
+    : tokens(tokens), pos(begin), end(end) {}
+
+    bool done() const { return pos >= end; }
+
+    bool check(const char* text) const {
+      return !done() && tokens[pos].type != Token::Type::STRING &&
+             tokens[pos].type != Token::Type::NUMBER && tokens[pos].text == text;
+    }
+
+    bool accept(const char* text) {
+      if (check(text)) {
+        ++pos;
+        return true;
+      }
+
+      return false;
+    }
+
+    void expect(const char* text) {
+      if (!accept(text)) {
+        throw Unsupported(fmt::format("expected '{}' near '{}'", text, current()));
+      }
+    }
+
+    Str name() {
+      if (done() || tokens[pos].type != Token::Type::NAME || is_keyword(tokens[pos].text)) {
+        throw Unsupported(fmt::format("expected a name near '{}'", current()));
+      }
+
+      return tokens[pos++].text;
+    }
+
+    ExprPtr expression(const int limit = 0) {
+      ExprPtr result;
+      if (check("-") || check("not") || check("#")) {
+        auto unary  = std::make_shared<Expr>();
+        unary->kind = Expr::Kind::UNARY;
+        unary->name = tokens[pos++].text;
+        unary->args.push_back(expression(UNARY_PRIORITY));
+        result = std::move(unary);
+      } else {
+        result = simple_expression();
+      }
+
+      while (!done()) {
+        const auto priority = binary_priority(tokens[pos]);
+        if (!priority || priority->first <= limit) {
+          break;
+        }
+
+        auto binary  = std::make_shared<Expr>();
+        binary->kind = Expr::Kind::BINARY;
+        binary->name = tokens[pos++].text;
+        binary->args.push_back(std::move(result));
+        binary->args.push_back(expression(priority->second));
+        result = std::move(binary);
+      }
+
+      return result;
+    }
+
+    Vec<ExprPtr> expression_list() {
+      Vec<ExprPtr> result{expression()};
+      while (accept(",")) {
+        result.push_back(expression());
+      }
+
+      return result;
+    }
+
+    Function function_body() {
+      Function result;
+      while (!done()) {
+        if (accept(";")) {
+          continue;
+        }
+
+        if (accept("return")) {
+          result.result = expression();
+          accept(";");
+          if (!done()) {
+            throw Unsupported("statements after return");
+          }
+
+          break;
+        }
+
+        Function::Assignment assignment;
+        const auto is_local = accept("local");
+        if (!is_local && (pos + 1 >= end || tokens[pos + 1].text != "=" ||
+                          tokens[pos + 1].type != Token::Type::SYMBOL)) {
+          throw Unsupported(fmt::format("unsupported statement at '{}'", current()));
+        }
+
+        do {
+          assignment.names.push_back(name());
+        } while (accept(","));
+
+        if (!is_local) {
+          // Assigning to anything but a local would change a global
+          for (const auto& target : assignment.names) {
+            const auto declared = std::any_of(result.body.cbegin(),
+                                              result.body.cend(),
+                                              [&](const auto& earlier) {
+                                                return std::find(earlier.names.cbegin(),
+                                                                 earlier.names.cend(),
+                                                                 target) != earlier.names.cend();
+                                              }) ||
+                                  std::find(result.params.cbegin(),
+                                            result.params.cend(),
+                                            target) != result.params.cend();
+            if (!declared) {
+              throw Unsupported(fmt::format("assignment to global {}", target));
+            }
+          }
+        }
+
+        expect("=");
+        assignment.values = expression_list();
+        if (assignment.values.size() != assignment.names.size()) {
+          throw Unsupported("multiple assignment with mismatched counts");
+        }
+
+        result.body.push_back(std::move(assignment));
+      }
+
+      if (!result.result) {
+        throw Unsupported("no return value");
+      }
+
+      return result;
+    }
+
+   private:
+    const Vec<Token>& tokens;
+    std::size_t pos;
+    const std::size_t end;
+
+    Str current() const { return done() ? Str("<end>") : tokens[pos].text; }
+
+    ExprPtr simple_expression() {
+      if (done()) {
+        throw Unsupported("unexpected end of expression");
+      }
+
+      const auto& token = tokens[pos];
+      auto result       = std::make_shared<Expr>();
+      if (token.type == Token::Type::NUMBER) {
+        ++pos;
+        result->kind   = Expr::Kind::NUMBER;
+        result->number = token.number;
+        return result;
+      }
+
+      if (accept("true") || accept("false")) {
+        result->kind   = Expr::Kind::BOOLEAN;
+        result->number = token.text == "true" ? 1.0 : 0.0;
+        return result;
+      }
+
+      return suffixed_expression();
+    }
+
+    ExprPtr suffixed_expression() {
+      ExprPtr result;
+      if (accept("(")) {
+        result = expression();
+        expect(")");
+      } else {
+        auto name_expr  = std::make_shared<Expr>();
+        name_expr->kind = Expr::Kind::NAME;
+        name_expr->name = name();
+        result          = std::move(name_expr);
+      }
+
+      while (!done()) {
+        if (accept(".")) {
+          auto field  = std::make_shared<Expr>();
+          field->kind = Expr::Kind::FIELD;
+          field->name = name();
+          field->args.push_back(std::move(result));
+          result = std::move(field);
+        } else if (accept("(")) {
+          auto call  = std::make_shared<Expr>();
+          call->kind = Expr::Kind::CALL;
+          call->name = callee_name(*result);
+          if (!accept(")")) {
+            call->args = expression_list();
+            expect(")");
+          }
+
+          result = std::move(call);
+        } else if (check("[") || check(":") || check("{") ||
+                   tokens[pos].type == Token::Type::STRING) {
+          throw Unsupported(fmt::format("unsupported expression at '{}'", current()));
+        } else {
+          break;
+        }
+      }
+
+      return result;
+    }
+
+    /// Only plain and library functions (e.g. math.sqrt) can be called
+    static Str callee_name(const Expr& callee) {
+      if (callee.kind == Expr::Kind::NAME) {
+        return callee.name;
+      }
+
+      if (callee.kind == Expr::Kind::FIELD && callee.args[0]->kind == Expr::Kind::NAME) {
+        return fmt::format("{}.{}", callee.args[0]->name, callee.name);
+      }
+
+      throw Unsupported("call of a computed function");
+    }
+  };
+
+  double apply(const Op op, const double a, const double b) {
+    switch (op) {
+      case Op::ADD:
+        return a + b;
+      case Op::SUB:
+        return a - b;
+      case Op::MUL:
+        return a * b;
+      case Op::DIV:
+        return a / b;
+      case Op::POW:
+        return std::pow(a, b);
+      case Op::NEG:
+        return -a;
+      case Op::SQRT:
+        return std::sqrt(a);
+      case Op::ABS:
+        return std::abs(a);
+      case Op::SIN:
+        return std::sin(a);
+      case Op::COS:
+        return std::cos(a);
+      case Op::TAN:
+        return std::tan(a);
+      case Op::ASIN:
+        return std::asin(a);
+      case Op::ACOS:
+        return std::acos(a);
+      case Op::ATAN:
+        return std::atan(a);
+      case Op::ATAN2:
+        return std::atan2(a, b);
+      case Op::EXP:
+        return std::exp(a);
+      case Op::LOG:
+        return std::log(a);
+      // NOTE: These match the argument order of Lua's math.min and math.max
+      case Op::MIN:
+        return b < a ? b : a;
+      case Op::MAX:
+        return b > a ? b : a;
+      case Op::EQ:
+        return a == b ? 1.0 : 0.0;
+      case Op::NE:
+        return a != b ? 1.0 : 0.0;
+      case Op::LT:
+        return a < b ? 1.0 : 0.0;
+      case Op::LE:
+        return a <= b ? 1.0 : 0.0;
+      case Op::AND:
+        return a != 0.0 && b != 0.0 ? 1.0 : 0.0;
+      case Op::OR:
+        return a != 0.0 || b != 0.0 ? 1.0 : 0.0;
+      case Op::NOT:
+        return a == 0.0 ? 1.0 : 0.0;
+      case Op::CONST:
+      case Op::VAR:
+        break;
+    }
+
+    throw std::logic_error("Leaf formula node applied as an operation");
+  }
+
+  /// Inlines a formula's semantics into a DAG, sharing identical subexpressions
+  class Compilation {
+   public:
+    struct Value {
+      enum class Type { NUMBER, BOOLEAN, OBJECT };
+      Type type;
+      // A node for numbers and booleans, and an index into the formula's bindings for objects
+      int index;
+    };
+
+    using Scope = Map<Str, Value>;
+
+    Compilation(const Map<Str, std::shared_ptr<const Function>>& functions,
+                const Map<Str, double>& constants,
+                const Vec<Str>& bindings)
+    : functions(functions), constants(constants), bindings(bindings) {
+      for (std::size_t i = 0; i < bindings.size(); ++i) {
+        scope.emplace(bindings[i], Value{Value::Type::OBJECT, static_cast<int>(i)});
+      }
+    }
+
+    NativeFormula finish(const Value& root) {
+      if (root.type == Value::Type::OBJECT) {
+        throw Unsupported("formula returns an object");
+      }
+
+      result.boolean = root.type == Value::Type::BOOLEAN;
+      prune(root.index);
+      return std::move(result);
+    }
+
+    Value expression(const Expr& expr, const Scope& scope) {
+      switch (expr.kind) {
+        case Expr::Kind::NUMBER:
+          return number(node(Op::CONST, -1, -1, expr.number));
+        case Expr::Kind::BOOLEAN:
+          return {Value::Type::BOOLEAN, node(Op::CONST, -1, -1, expr.number)};
+        case Expr::Kind::NAME:
+          return name(expr.name, scope);
+        case Expr::Kind::FIELD:
+          return field(expr, scope);
+        case Expr::Kind::CALL:
+          return call(expr, scope);
+        case Expr::Kind::UNARY:
+          return unary(expr.name, expression(*expr.args[0], scope));
+        case Expr::Kind::BINARY:
+          return binary(
+          expr.name, expression(*expr.args[0], scope), expression(*expr.args[1], scope));
+      }
+
+      throw Unsupported("unknown expression");
+    }
+
+    Scope scope;
+
+   private:
+    const Map<Str, std::shared_ptr<const Function>>& functions;
+    const Map<Str, double>& constants;
+    const Vec<Str>& bindings;
+    NativeFormula result;
+    std::map<std::tuple<Op, int, int, std::uint64_t>, int> interned;
+    Map<int, int> binding_slots;
+    int depth = 0;
+
+    static Value number(const int index) { return {Value::Type::NUMBER, index}; }
+
+    static void check_type(const Value& value, const Value::Type type, const Str& context) {
+      if (value.type != type) {
+        throw Unsupported(fmt::format("mixed value types in {}", context));
+      }
+    }
+
+    int node(const Op op, const int lhs = -1, const int rhs = -1, const double value = 0.0) {
+      auto& nodes = result.nodes;
+      // Fold operations on constants
+      if (op != Op::CONST && op != Op::VAR && nodes[lhs].op == Op::CONST &&
+          (rhs < 0 || nodes[rhs].op == Op::CONST)) {
+        return node(Op::CONST,
+                    -1,
+                    -1,
+                    apply(op, nodes[lhs].value, rhs < 0 ? 0.0 : nodes[rhs].value));
+      }
+
+      // NOTE: Constants are keyed by their bits, since -ffast-math makes comparisons involving NaN
+      // unreliable, and NaN keys would break the ordering of the table
+      std::uint64_t bits = 0;
+      std::memcpy(&bits, &value, sizeof(bits));
+      const auto key = std::make_tuple(op, lhs, rhs, bits);
+      if (const auto it = interned.find(key); it != interned.end()) {
+        return it->second;
+      }
+
+      nodes.push_back({op, lhs, rhs, value});
+      const auto index = static_cast<int>(nodes.size()) - 1;
+      interned.emplace(key, index);
+      return index;
+    }
+
+    Value name(const Str& name, const Scope& scope) {
+      if (const auto it = scope.find(name); it != scope.end()) {
+        return it->second;
+      }
+
+      if (const auto it = constants.find(name); it != constants.end()) {
+        return number(node(Op::CONST, -1, -1, it->second));
+      }
+
+      throw Unsupported(fmt::format("unknown variable {}", name));
+    }
+
+    Value field(const Expr& expr, const Scope& scope) {
+      const auto& object_expr = *expr.args[0];
+      if (object_expr.kind == Expr::Kind::NAME && object_expr.name == "math" &&
+          scope.count("math") == 0) {
+        if (expr.name == "huge") {
+          return number(node(Op::CONST, -1, -1, std::numeric_limits<double>::infinity()));
+        }
+
+        if (expr.name == "pi") {
+          return number(node(Op::CONST, -1, -1, M_PI));
+        }
+
+        throw Unsupported(fmt::format("unknown constant math.{}", expr.name));
+      }
+
+      const auto object = expression(object_expr, scope);
+      check_type(object, Value::Type::OBJECT, "field access");
+      for (int i = 0; i < worldfns::OBJECT_DATA_SIZE; ++i) {
+        if (expr.name == worldfns::OBJECT_FIELD_NAMES[i]) {
+          auto [slot_it, inserted] = binding_slots.emplace(object.index, result.slots.size());
+          if (inserted) {
+            result.slots.push_back(bindings[object.index]);
+          }
+
+          return number(node(Op::VAR, slot_it->second * worldfns::OBJECT_DATA_SIZE + i));
+        }
+      }
+
+      throw Unsupported(fmt::format("object field {}", expr.name));
+    }
+
+    Value call(const Expr& expr, const Scope& scope) {
+      Vec<Value> args;
+      args.reserve(expr.args.size());
+      for (const auto& arg : expr.args) {
+        args.push_back(expression(*arg, scope));
+      }
+
+      if (expr.name.compare(0, 5, "math.") == 0 && scope.count("math") == 0) {
+        return math_call(expr.name.substr(5), args);
+      }
+
+      const auto fn_it = functions.find(expr.name);
+      if (fn_it == functions.end()) {
+        throw Unsupported(fmt::format("unknown function {}", expr.name));
+      }
+
+      const auto& fn = *fn_it->second;
+      if (!fn.unsupported.empty()) {
+        throw Unsupported(fmt::format("{}: {}", expr.name, fn.unsupported));
+      }
+
+      if (args.size() < fn.params.size()) {
+        throw Unsupported(fmt::format("{} called with missing arguments", expr.name));
+      }
+
+      if (depth == MAX_INLINE_DEPTH) {
+        throw Unsupported(fmt::format("{} recurses too deeply to inline", expr.name));
+      }
+
+      ++depth;
+      Scope fn_scope;
+      for (std::size_t i = 0; i < fn.params.size(); ++i) {
+        fn_scope[fn.params[i]] = args[i];
+      }
+
+      for (const auto& assignment : fn.body) {
+        Vec<Value> values;
+        for (const auto& value : assignment.values) {
+          values.push_back(expression(*value, fn_scope));
+        }
+
+        for (std::size_t i = 0; i < values.size(); ++i) {
+          fn_scope[assignment.names[i]] = values[i];
+        }
+      }
+
+      const auto fn_result = expression(*fn.result, fn_scope);
+      --depth;
+      return fn_result;
+    }
+
+    Value math_call(const Str& fn_name, const Vec<Value>& args) {
+      static const Map<Str, Op> unary_fns{{"sqrt", Op::SQRT},
+                                          {"abs", Op::ABS},
+                                          {"sin", Op::SIN},
+                                          {"cos", Op::COS},
+                                          {"tan", Op::TAN},
+                                          {"asin", Op::ASIN},
+                                          {"acos", Op::ACOS},
+                                          {"atan", Op::ATAN},
+                                          {"exp", Op::EXP},
+                                          {"log", Op::LOG}};
+      static const Map<Str, Op> binary_fns{{"pow", Op::POW}, {"atan2", Op::ATAN2}};
+      static const Map<Str, Op> variadic_fns{{"min", Op::MIN}, {"max", Op::MAX}};
+      for (const auto& arg : args) {
+        check_type(arg, Value::Type::NUMBER, fmt::format("math.{}", fn_name));
+      }
+
+      if (const auto it = unary_fns.find(fn_name); it != unary_fns.end() && args.size() == 1) {
+        return number(node(it->second, args[0].index));
+      }
+
+      if (const auto it = binary_fns.find(fn_name); it != binary_fns.end() && args.size() == 2) {
+        return number(node(it->second, args[0].index, args[1].index));
+      }
+
+      if (const auto it = variadic_fns.find(fn_name); it != variadic_fns.end() && !args.empty()) {
+        auto result = args[0].index;
+        for (std::size_t i = 1; i < args.size(); ++i) {
+          result = node(it->second, result, args[i].index);
+        }
+
+        return number(result);
+      }
+
+      throw Unsupported(fmt::format("math.{} with {} arguments", fn_name, args.size()));
+    }
+
+    Value unary(const Str& op, const Value& arg) {
+      if (op == "-") {
+        check_type(arg, Value::Type::NUMBER, "negation");
+        return number(node(Op::NEG, arg.index));
+      }
+
+      if (op == "not") {
+        check_type(arg, Value::Type::BOOLEAN, "not");
+        return {Value::Type::BOOLEAN, node(Op::NOT, arg.index)};
+      }
+
+      throw Unsupported(fmt::format("operator {}", op));
+    }
+
+    Value binary(const Str& op, const Value& lhs, const Value& rhs) {
+      static const Map<Str, Op> arithmetic{
+      {"+", Op::ADD}, {"-", Op::SUB}, {"*", Op::MUL}, {"/", Op::DIV}, {"^", Op::POW}};
+      if (const auto it = arithmetic.find(op); it != arithmetic.end()) {
+        check_type(lhs, Value::Type::NUMBER, op);
+        check_type(rhs, Value::Type::NUMBER, op);
+        return number(node(it->second, lhs.index, rhs.index));
+      }
+
+      // Greater-than comparisons are less-than comparisons with their operands swapped
+      static const Map<Str, std::pair<Op, bool>> ordering{{"<", {Op::LT, false}},
+                                                          {"<=", {Op::LE, false}},
+                                                          {">", {Op::LT, true}},
+                                                          {">=", {Op::LE, true}}};
+      if (const auto it = ordering.find(op); it != ordering.end()) {
+        check_type(lhs, Value::Type::NUMBER, op);
+        check_type(rhs, Value::Type::NUMBER, op);
+        const auto [compare, swap] = it->second;
+        return {Value::Type::BOOLEAN,
+                swap ? node(compare, rhs.index, lhs.index) : node(compare, lhs.index, rhs.index)};
+      }
+
+      if (op == "==" || op == "~=") {
+        if (lhs.type == Value::Type::OBJECT || lhs.type != rhs.type) {
+          throw Unsupported(fmt::format("{} between objects or mixed types", op));
+        }
+
+        return {Value::Type::BOOLEAN, node(op == "==" ? Op::EQ : Op::NE, lhs.index, rhs.index)};
+      }
+
+      if (op == "and" || op == "or") {
+        // NOTE: Lua treats every number as true, so only boolean logic compiles
+        check_type(lhs, Value::Type::BOOLEAN, op);
+        check_type(rhs, Value::Type::BOOLEAN, op);
+        return {Value::Type::BOOLEAN, node(op == "and" ? Op::AND : Op::OR, lhs.index, rhs.index)};
+      }
+
+      throw Unsupported(fmt::format("operator {}", op));
+    }
+
+    /// Drop the nodes the root doesn't use, e.g. from unused locals
+    void prune(const int root) {
+      auto& nodes = result.nodes;
+      Vec<bool> used(root + 1, false);
+      used[root] = true;
+      for (int i = root; i >= 0; --i) {
+        const auto& node = nodes[i];
+        if (!used[i] || node.op == Op::CONST || node.op == Op::VAR) {
+          continue;
+        }
+
+        used[node.lhs] = true;
+        if (node.rhs >= 0) {
+          used[node.rhs] = true;
+        }
+      }
+
+      Vec<int> remap(root + 1, -1);
+      Vec<NativeFormula::Node> pruned;
+      for (int i = 0; i <= root; ++i) {
+        if (!used[i]) {
+          continue;
+        }
+
+        auto node = nodes[i];
+        if (node.op != Op::CONST && node.op != Op::VAR) {
+          node.lhs = remap[node.lhs];
+          node.rhs = node.rhs >= 0 ? remap[node.rhs] : -1;
+        }
+
+        remap[i] = pruned.size();
+        pruned.push_back(node);
+      }
+
+      nodes = std::move(pruned);
+    }
+  };
+}  // namespace
+
+double NativeFormula::evaluate(const double* const vars, Vec<double>& values) const {
+  values.resize(nodes.size());
+  for (std::size_t i = 0; i < nodes.size(); ++i) {
+    const auto& node = nodes[i];
+    switch (node.op) {
+      case Op::CONST:
+        values[i] = node.value;
+        break;
+      case Op::VAR:
+        values[i] = vars[node.lhs];
+        break;
+      default:
+        values[i] = apply(node.op, values[node.lhs], node.rhs < 0 ? 0.0 : values[node.rhs]);
+    }
+  }
+
+  return values.back();
+}
+
+double NativeFormula::gradient(const double* const vars,
+                               Vec<double>& values,
+                               Vec<double>& adjoints,
+                               double* const var_grad) const {
+  const auto result = evaluate(vars, values);
+  adjoints.assign(nodes.size(), 0.0);
+  adjoints.back() = 1.0;
+  for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; --i) {
+    const auto adjoint = adjoints[i];
+    const auto& node   = nodes[i];
+    if (adjoint == 0.0 || node.op == Op::CONST) {
+      continue;
+    }
+
+    if (node.op == Op::VAR) {
+      var_grad[node.lhs] += adjoint;
+      continue;
+    }
+
+    const auto a     = values[node.lhs];
+    const auto b     = node.rhs < 0 ? 0.0 : values[node.rhs];
+    const auto value = values[i];
+    auto& lhs_adj    = adjoints[node.lhs];
+    // Unary nodes never touch this
+    auto& rhs_adj = adjoints[node.rhs < 0 ? node.lhs : node.rhs];
+    switch (node.op) {
+      case Op::ADD:
+        lhs_adj += adjoint;
+        rhs_adj += adjoint;
+        break;
+      case Op::SUB:
+        lhs_adj += adjoint;
+        rhs_adj -= adjoint;
+        break;
+      case Op::MUL:
+        lhs_adj += adjoint * b;
+        rhs_adj += adjoint * a;
+        break;
+      case Op::DIV:
+        lhs_adj += adjoint / b;
+        rhs_adj -= adjoint * a / (b * b);
+        break;
+      case Op::POW:
+        if (b != 0.0) {
+          lhs_adj += adjoint * b * std::pow(a, b - 1.0);
+        }
+
+        if (a > 0.0) {
+          rhs_adj += adjoint * value * std::log(a);
+        }
+
+        break;
+      case Op::NEG:
+        lhs_adj -= adjoint;
+        break;
+      case Op::SQRT:
+        lhs_adj += adjoint * 0.5 / value;
+        break;
+      case Op::ABS:
+        lhs_adj += a < 0.0 ? -adjoint : adjoint;
+        break;
+      case Op::SIN:
+        lhs_adj += adjoint * std::cos(a);
+        break;
+      case Op::COS:
+        lhs_adj -= adjoint * std::sin(a);
+        break;
+      case Op::TAN:
+        lhs_adj += adjoint * (1.0 + value * value);
+        break;
+      case Op::ASIN:
+        lhs_adj += adjoint / std::sqrt(1.0 - a * a);
+        break;
+      case Op::ACOS:
+        lhs_adj -= adjoint / std::sqrt(1.0 - a * a);
+        break;
+      case Op::ATAN:
+        lhs_adj += adjoint / (1.0 + a * a);
+        break;
+      case Op::ATAN2:
+        lhs_adj += adjoint * b / (a * a + b * b);
+        rhs_adj -= adjoint * a / (a * a + b * b);
+        break;
+      case Op::EXP:
+        lhs_adj += adjoint * value;
+        break;
+      case Op::LOG:
+        lhs_adj += adjoint / a;
+        break;
+      // NOTE: The derivative follows whichever argument was chosen. sci.diff smooths min and max
+      // instead, which only differs measurably near ties, so ties split the derivative evenly like
+      // the smooth version's
+      case Op::MIN:
+      case Op::MAX:
+        if (a == b) {
+          lhs_adj += 0.5 * adjoint;
+          rhs_adj += 0.5 * adjoint;
+        } else {
+          ((node.op == Op::MIN ? b < a : b > a) ? rhs_adj : lhs_adj) += adjoint;
+        }
+
+        break;
+      default:
+        // Comparisons and logic are piecewise constant
+        break;
+    }
+  }
+
+  return result;
+}
+
+void FormulaCompiler::load_file(const Str& filename) {
+  std::ifstream file(filename);
+  if (!file) {
+    log->error("Couldn't read {} to compile formulas", filename);
+    throw std::runtime_error(fmt::format("Failed to read {}", filename));
+  }
+
+  std::stringstream source;
+  source << file.rdbuf();
+  Vec<Token> tokens;
+  try {
+    tokens = tokenize(source.str());
+  } catch (const Unsupported& e) {
+    log->warn("Couldn't tokenize {}: {}. Its functions won't be compiled", filename, e.what());
+    return;
+  }
+
+  const auto is_symbol = [&](const std::size_t pos, const char* text) {
+    return pos < tokens.size() && tokens[pos].type == Token::Type::SYMBOL &&
+           tokens[pos].text == text;
+  };
+
+  // Only definitions made unconditionally at the top level are known for certain. Blocks are
+  // counted from their opening keyword, so loop variables count as inside the loop
+  int block_depth   = 0;
+  int bracket_depth = 0;
+  bool loop_header  = false;
+  const auto forget = [&](const Str& name) {
+    functions.erase(name);
+    constants.erase(name);
+  };
+
+  std::size_t pos = 0;
+  while (pos < tokens.size()) {
+    const auto& token = tokens[pos];
+    if (token.type == Token::Type::SYMBOL) {
+      if (token.text == "(" || token.text == "{" || token.text == "[") {
+        ++bracket_depth;
+      } else if (token.text == ")" || token.text == "}" || token.text == "]") {
+        --bracket_depth;
+      }
+    }
+
+    if (token.type != Token::Type::NAME) {
+      ++pos;
+      continue;
+    }
+
+    if (token.text == "if" || token.text == "repeat" || token.text == "for" ||
+        token.text == "while") {
+      ++block_depth;
+      loop_header = token.text == "for" || token.text == "while";
+      ++pos;
+      continue;
+    }
+
+    if (token.text == "do") {
+      if (!loop_header) {
+        ++block_depth;
+      }
+
+      loop_header = false;
+      ++pos;
+      continue;
+    }
+
+    if (token.text == "end" || token.text == "until") {
+      --block_depth;
+      ++pos;
+      continue;
+    }
+
+    if (token.text == "function" ||
+        (token.text == "local" && pos + 1 < tokens.size() && tokens[pos + 1].text == "function")) {
+      pos += token.text == "local" ? 2 : 1;
+      Str fn_name;
+      auto fn = std::make_shared<Function>();
+      while (pos < tokens.size() && (tokens[pos].type == Token::Type::NAME ||
+                                     is_symbol(pos, ".") || is_symbol(pos, ":"))) {
+        fn_name += tokens[pos++].text;
+      }
+
+      if (!is_symbol(pos, "(")) {
+        ++pos;
+        continue;
+      }
+
+      // NOTE: Anonymous functions are skipped, and methods are recorded but can never be called
+      ++pos;
+      while (pos < tokens.size() && !is_symbol(pos, ")")) {
+        if (tokens[pos].type == Token::Type::NAME) {
+          fn->params.push_back(tokens[pos].text);
+        } else if (is_symbol(pos, "...")) {
+          fn->unsupported = "varargs";
+        }
+
+        ++pos;
+      }
+
+      std::size_t body_end = 0;
+      try {
+        body_end = block_end(tokens, pos + 1);
+      } catch (const Unsupported&) {
+        log->warn("Couldn't find the end of {} in {}", fn_name, filename);
+        return;
+      }
+
+      if (fn->unsupported.empty()) {
+        try {
+          Parser parser(tokens, pos + 1, body_end);
+          auto body  = parser.function_body();
+          fn->body   = std::move(body.body);
+          fn->result = std::move(body.result);
+        } catch (const Unsupported& e) {
+          fn->unsupported = e.what();
+        }
+      }
+
+      if (!fn_name.empty()) {
+        forget(fn_name);
+        if (block_depth == 0) {
+          functions[fn_name] = std::move(fn);
+        }
+      }
+
+      pos = body_end + 1;
+    } else if (is_symbol(pos + 1, "=") && !is_keyword(token.text) && bracket_depth == 0 &&
+               !(pos > 0 && (is_symbol(pos - 1, ".") || is_symbol(pos - 1, ":")))) {
+      // Globals set to literal numbers are constants; anything else shadows what we knew. Table
+      // fields are skipped above, and locals, multiple assignments, and assignments in blocks
+      // leave the global unknown
+      forget(token.text);
+      for (auto target = pos; target >= 2 && is_symbol(target - 1, ","); target -= 2) {
+        forget(tokens[target - 2].text);
+      }
+
+      const auto certain = block_depth == 0 && !(pos > 0 && (is_symbol(pos - 1, ",") ||
+                                                             tokens[pos - 1].text == "local"));
+      if (!certain) {
+        pos += 2;
+        continue;
+      }
+
+      const auto negative = is_symbol(pos + 2, "-");
+      const auto value    = pos + 2 + (negative ? 1 : 0);
+      if (value < tokens.size() && tokens[value].type == Token::Type::NUMBER &&
+          (value + 1 == tokens.size() || !binary_priority(tokens[value + 1]))) {
+        constants[token.text] = negative ? -tokens[value].number : tokens[value].number;
+      }
+
+      pos += 2;
+    } else {
+      ++pos;
+    }
+  }
+}
+
+std::optional<NativeFormula> FormulaCompiler::compile(const spec::Formula& formula,
+                                                      Str& reason) const {
+  try {
+    const auto tokens = tokenize(formula.body);
+    Parser parser(tokens, 0, tokens.size());
+    const auto body = parser.expression();
+    if (!parser.done()) {
+      throw Unsupported("trailing tokens in formula body");
+    }
+
+    Compilation compilation(functions, constants, formula.bindings);
+    return compilation.finish(compilation.expression(*body, compilation.scope));
+  } catch (const Unsupported& e) {
+    reason = e.what();
+    return std::nullopt;
+  }
+}
+}  // namespace symbolic::predicate
@@ -0,0 +1,98 @@
+#pragma once
+#ifndef NATIVE_FORMULA_HH
+#define NATIVE_FORMULA_HH
+#include "common.hh"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+#include "formula.hh"
+
+namespace symbolic::predicate {
+namespace spec = input::specification;
+
+/// A formula compiled to an expression DAG over the pose fields of the objects it binds. Nodes
+/// are stored in topological order with the root last, so evaluation is one forward sweep and the
+/// gradient one reverse sweep
+struct NativeFormula {
+  enum class Op : std::uint8_t {
+    CONST,
+    VAR,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    POW,
+    NEG,
+    SQRT,
+    ABS,
+    SIN,
+    COS,
+    TAN,
+    ASIN,
+    ACOS,
+    ATAN,
+    ATAN2,
+    EXP,
+    LOG,
+    MIN,
+    MAX,
+    EQ,
+    NE,
+    LT,
+    LE,
+    AND,
+    OR,
+    NOT
+  };
+
+  /// lhs and rhs are child node indices (-1 if unused), except for VAR nodes, where lhs indexes
+  /// the variables. Booleans are represented as 0 or 1
+  struct Node {
+    Op op;
+    int lhs;
+    int rhs;
+    double value;
+  };
+
+  Vec<Node> nodes;
+
+  /// The bound object name for each slot. Variable i is field (i % OBJECT_DATA_SIZE) of the
+  /// object in slot (i / OBJECT_DATA_SIZE), with fields in OBJECT_FIELD_NAMES order
+  Vec<Str> slots;
+
+  /// Whether the formula's value is a boolean, rather than a number
+  bool boolean = false;
+
+  double evaluate(const double* vars, Vec<double>& values) const;
+
+  /// Evaluate the formula and add its derivative with respect to each variable to var_grad
+  double gradient(const double* vars,
+                  Vec<double>& values,
+                  Vec<double>& adjoints,
+                  double* var_grad) const;
+};
+
+/// Compiles formulas against the subset of Lua used by semantics files: functions made of local
+/// assignments and a return, over numbers, booleans, object pose fields, arithmetic, comparisons,
+/// logic, math library functions, and calls to other such functions. Anything else (metadata
+/// fields, control flow, tables, strings...) is left to Lua
+class FormulaCompiler {
+ public:
+  /// Read the function definitions and numeric constants from a prelude or semantics file. Later
+  /// definitions replace earlier ones, as they do in Lua
+  void load_file(const Str& filename);
+
+  /// Compile a formula, or return nullopt with the reason it needs Lua
+  std::optional<NativeFormula> compile(const spec::Formula& formula, Str& reason) const;
+
+  struct Expr;
+  struct Function;
+
+ private:
+  Map<Str, std::shared_ptr<const Function>> functions;
+  Map<Str, double> constants;
+};
+}  // namespace symbolic::predicate
+#endif
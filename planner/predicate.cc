@@ -1,5 +1,7 @@
 #include "predicate.hh"
 
+#include <algorithm>
+#include <cmath>
 #include <stdexcept>
 
 #include "fmt/format.h"
@@ -10,6 +12,20 @@
 #include "world_functions.hh"
 
 constexpr char TRACEBACK_NAME[] = "err_func";
+constexpr char STATE_VIEW_DEF[] = "return require('ffi').cast('double*', ...)";
+// Wraps a gradient function to take its point from one buffer and put its gradient in another,
+// reusing the same vectors every call
+constexpr char GRADIENT_CALL_DEF[] = R"LUA(
+local gradient, n, point_ptr, grad_ptr = ...
+local ffi = require('ffi')
+local point_buf, grad_buf = ffi.cast('double*', point_ptr), ffi.cast('double*', grad_ptr)
+local point, grad = alg.vec(n), alg.vec(n)
+return function()
+  for i = 1, n do point[i] = point_buf[i - 1] end
+  local value = gradient(point, grad)
+  for i = 1, n do grad_buf[i - 1] = grad[i] end
+  return value
+end)LUA";
 static int traceback(lua_State* L) {
   if (!lua_isstring(L, 1)) /* 'message' not a string? */
     return 1;              /* keep it intact */
@@ -45,7 +61,23 @@ static int wrap_exceptions(lua_State* L, lua_CFunction f) {
 namespace symbolic {
 namespace predicate {
   namespace cspace = planner::cspace;
+  bool USE_NATIVE_FORMULAS   = false;
+  bool CHECK_NATIVE_FORMULAS = false;
   namespace {
+    // How far a compiled formula may stray from its Lua version, relative to the Lua value's size.
+    // NOTE: Gradients get more room, since sci.diff smooths min and max
+    constexpr double VALUE_TOLERANCE    = 1e-9;
+    constexpr double GRADIENT_TOLERANCE = 1e-6;
+
+    inline bool agrees(const double native_value, const double lua_value, const double tolerance) {
+      // Infinities only agree with themselves, and NaNs with NaNs
+      if (native_value == lua_value || (std::isnan(native_value) && std::isnan(lua_value))) {
+        return true;
+      }
+
+      return std::abs(native_value - lua_value) <= tolerance * std::max(1.0, std::abs(lua_value));
+    }
+
     inline void load_c_fns(lua_State* L) {
       /// Add the C functions defined in the world functions module to the Lua environment being
       /// constructed
@@ -57,15 +89,78 @@ namespace predicate {
       // luaJIT_setmode(L, -1, LUAJIT_MODE_WRAPCFUNC | LUAJIT_MODE_ON);
       // lua_pop(L, 1);
     }
+
+    /// Share the state buffer with Lua as an FFI double* view, which generate_objects recognizes
+    /// and reads the buffer behind directly, rather than copying the state through a table.
+    /// Leaves an error message on the stack on failure
+    bool make_state_view(lua_State* L, double* const buffer) {
+      lua_pushlightuserdata(L, buffer);
+      lua_setfield(L, LUA_REGISTRYINDEX, worldfns::STATE_BUFFER_KEY);
+      if (luaL_loadstring(L, STATE_VIEW_DEF) != 0) {
+        return false;
+      }
+
+      lua_pushlightuserdata(L, buffer);
+      if (lua_pcall(L, 1, 1, 0) != 0) {
+        return false;
+      }
+
+      lua_setfield(L, LUA_REGISTRYINDEX, worldfns::STATE_VIEW_KEY);
+      return true;
+    }
+
+    /// Fill the variables of a compiled formula from the poses of its bound objects. Returns false
+    /// if an object has no pose, in which case the formula should go to Lua instead
+    template <typename PoseMap, typename GetPose>
+    bool load_native_vars(const NativeFormula& formula,
+                          const Map<Str, Str>& bindings,
+                          const PoseMap& poses,
+                          GetPose&& get_pose,
+                          Vec<double>& vars) {
+      vars.resize(formula.slots.size() * worldfns::OBJECT_DATA_SIZE);
+      for (std::size_t slot = 0; slot < formula.slots.size(); ++slot) {
+        const auto& slot_name = formula.slots[slot];
+        // NOTE: As in generate_objects, names starting with _ are bound by the current action
+        const auto binding_it = bindings.find(slot_name);
+        if (slot_name[0] == '_' && binding_it == bindings.end()) {
+          return false;
+        }
+
+        const auto pose_it = poses.find(slot_name[0] == '_' ? binding_it->second : slot_name);
+        if (pose_it == poses.end()) {
+          return false;
+        }
+
+        const Transform3r& pose = get_pose(pose_it->second);
+        const Eigen::Quaterniond rotation(pose.linear());
+        auto* const slot_vars = vars.data() + slot * worldfns::OBJECT_DATA_SIZE;
+        slot_vars[0]          = pose.translation().x();
+        slot_vars[1]          = pose.translation().y();
+        slot_vars[2]          = pose.translation().z();
+        slot_vars[3]          = rotation.x();
+        slot_vars[4]          = rotation.y();
+        slot_vars[5]          = rotation.z();
+        slot_vars[6]          = rotation.w();
+      }
+
+      return true;
+    }
   }  // namespace
 
   Vec<double> generate_state_vector(const ob::StateSpace* const space,
                                     const ob::State* const state,
                                     const bool base_movable) {
-    // The state vector has the form [robot base pose (if it exists), continuous joints, other
-    // joints]
     Vec<double> result(cspace::num_dims);
+    generate_state_vector(space, state, base_movable, result.data());
+    return result;
+  }
 
+  void generate_state_vector(const ob::StateSpace* const space,
+                             const ob::State* const state,
+                             const bool base_movable,
+                             double* const result) {
+    // The state vector has the form [robot base pose (if it exists), continuous joints, other
+    // joints]
     // Separate out the state spaces for dimension and index information
     auto full_space  = space->as<ob::CompoundStateSpace>();
     auto robot_space = full_space->getSubspace(cspace::ROBOT_SPACE)->as<ob::CompoundStateSpace>();
@@ -103,8 +198,6 @@ namespace predicate {
     for (int i = 0; i < cspace::joint_bounds.size(); ++i) {
       result[offset + i] = joint_state->values[i];
     }
-
-    return result;
   }
 
   LuaEnvData::LuaEnvData(const Str& name, const Str& prelude_filename) : name(name) {
@@ -112,6 +205,16 @@ namespace predicate {
     L   = luaL_newstate();
     luaL_openlibs(L);
     load_c_fns(L);
+    state_buffer.assign(cspace::num_dims, 0.0);
+    if (!make_state_view(L, state_buffer.data())) {
+      auto err_msg = lua_tostring(L, -1);
+      log->error("Making the FFI state view failed: {}", err_msg);
+      throw std::runtime_error("Failed to make the FFI state view!");
+    }
+    if (USE_NATIVE_FORMULAS) {
+      compiler = std::make_unique<FormulaCompiler>();
+    }
+
     if (!prelude_filename.empty()) {
       log->debug("Loading prelude from {}", prelude_filename);
       if (luaL_dofile(L, prelude_filename.c_str()) != 0) {
@@ -119,6 +222,10 @@ namespace predicate {
         log->error("Loading prelude from {} failed: {}", prelude_filename, err_msg);
         throw std::runtime_error("Failed to load Lua prelude!");
       }
+
+      if (compiler) {
+        compiler->load_file(prelude_filename);
+      }
     }
   }
 
@@ -135,13 +242,9 @@ namespace predicate {
     // Get the function ref
     lua_getglobal(L, fn_name.c_str());
 
-    // Load state vector
-    const auto state_vec = generate_state_vector(space, state, base_movable);
-    lua_createtable(L, state_vec.size(), 0);
-    for (int i = 0; i < state_vec.size(); ++i) {
-      lua_pushnumber(L, state_vec[i]);
-      lua_rawseti(L, -2, i + 1);
-    }
+    // Load the state vector into the buffer behind the state view, and pass the view
+    generate_state_vector(space, state, base_movable, state_buffer.data());
+    lua_getfield(L, LUA_REGISTRYINDEX, worldfns::STATE_VIEW_KEY);
 
     auto call_result = lua_pcall(L, 1, 1, err_func_idx);
     if (call_result != 0) {
@@ -162,6 +265,46 @@ namespace predicate {
     return true;
   }
 
+  const NativeFormula* LuaEnvData::native_formula(const Str& fn_name) const {
+    const auto formula_it = native_formulas.find(fn_name);
+    return formula_it == native_formulas.end() ? nullptr : &formula_it->second;
+  }
+
+  std::optional<double> LuaEnvData::call_native(const NativeFormula& formula,
+                                                const ob::StateSpace* const space,
+                                                const ob::State* const state,
+                                                const bool base_movable) const {
+    // Constant formulas don't need the world
+    if (!formula.slots.empty()) {
+      const auto* uni_data = static_cast<const planner::sampler::Universe*>(universe);
+      if (uni_data == nullptr) {
+        return std::nullopt;
+      }
+
+      generate_state_vector(space, state, base_movable, state_buffer.data());
+      worldfns::pose_nodes(state_buffer.data(), uni_data, native_poses);
+      if (!load_native_vars(
+          formula, bindings, native_poses, [](const auto& pose) -> const auto& { return pose; },
+          native_vars)) {
+        return std::nullopt;
+      }
+    }
+
+    return formula.evaluate(native_vars.data(), native_values);
+  }
+
+  void LuaEnvData::check_native(const Str& fn_name,
+                                const double native_value,
+                                const double lua_value) const {
+    if (!agrees(native_value, lua_value, VALUE_TOLERANCE)) {
+      log->warn("Compiled {} gave {}, but Lua gave {}; using Lua for it from now on",
+                fn_name,
+                native_value,
+                lua_value);
+      native_formulas.erase(fn_name);
+    }
+  }
+
   bool LuaEnvData::load_predicates(const Str& predicates_filename) const {
     log->debug("Loading predicates from {}", predicates_filename);
     if (luaL_dofile(L, predicates_filename.c_str()) != 0) {
@@ -171,6 +314,10 @@ namespace predicate {
       fmt::format("Failed to load predicates from {}: {}", predicates_filename, err_msg));
     }
 
+    if (compiler) {
+      compiler->load_file(predicates_filename);
+    }
+
     return true;
   }
 
@@ -183,8 +330,18 @@ namespace predicate {
       fmt::format("Failed to load formula {}: {}", formula->name, err_msg));
     }
 
-    lua_getglobal(L, formula->normal_fn_name.c_str());
-    formula->normal_fn[name] = luaL_ref(L, LUA_REGISTRYINDEX);
+    // A gradient made from an earlier definition would be stale
+    invalidate_gradient(formula);
+
+    // NOTE: The Lua version stays loaded as the fallback for the compiled version
+    if (compiler) {
+      Str reason;
+      if (auto native = compiler->compile(*formula, reason)) {
+        native_formulas.insert_or_assign(formula->normal_fn_name, std::move(*native));
+      } else {
+        log->debug("Formula {} is evaluated in Lua: {}", formula->name, reason);
+      }
+    }
 
     return true;
   }
@@ -193,8 +350,13 @@ namespace predicate {
     // NOTE: This is only designed to work inside the automatic differentiation context; it will
     // fail elsewhere
 
-    if (fplus::map_contains(formula->gradient_fn, name)) {
-      return true;
+    // Gradients are cached per environment, so repeated solves for a formula reuse its closure
+    if (const auto call_it = gradient_calls.find(formula); call_it != gradient_calls.end()) {
+      if (call_it->second.point.size() == static_cast<std::size_t>(num_dims)) {
+        return true;
+      }
+
+      invalidate_gradient(formula);
     }
 
     log->debug("Creating gradient for: {}", formula->name);
@@ -208,102 +370,190 @@ namespace predicate {
     }
 
     lua_getglobal(L, formula->grad_fn_name.c_str());
-    formula->gradient_fn[name] = luaL_ref(L, LUA_REGISTRYINDEX);
+    auto& call    = gradient_calls[formula];
+    call.gradient = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    // Wrap the gradient with buffers for its input and output, so calls don't allocate
+    call.point.assign(num_dims, 0.0);
+    call.grad.assign(num_dims, 0.0);
+    const auto loaded = luaL_loadstring(L, GRADIENT_CALL_DEF) == 0;
+    if (loaded) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, call.gradient);
+      lua_pushinteger(L, num_dims);
+      lua_pushlightuserdata(L, call.point.data());
+      lua_pushlightuserdata(L, call.grad.data());
+    }
+
+    if (!loaded || lua_pcall(L, 4, 1, 0) != 0) {
+      const Str err_msg = lua_tostring(L, -1);
+      lua_pop(L, 1);
+      invalidate_gradient(formula);
+      log->error("Wrapping gradient for {} failed: {}", formula->name, err_msg);
+      throw std::runtime_error(
+      fmt::format("Failed to wrap gradient for {}: {}", formula->name, err_msg));
+    }
+
+    call.fn = luaL_ref(L, LUA_REGISTRYINDEX);
     log->debug("Succeeded creating gradient for {}", formula->name);
     return true;
   }
 
+  void LuaEnvData::unload_formula(const spec::Formula* formula) const {
+    lua_pushnil(L);
+    lua_setglobal(L, formula->normal_fn_name.c_str());
+    lua_pushnil(L);
+    lua_setglobal(L, formula->grad_fn_name.c_str());
+    native_formulas.erase(formula->normal_fn_name);
+    invalidate_gradient(formula);
+  }
+
+  void LuaEnvData::invalidate_gradient(const spec::Formula* formula) const {
+    const auto call_it = gradient_calls.find(formula);
+    if (call_it == gradient_calls.end()) {
+      return;
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, call_it->second.fn);
+    luaL_unref(L, LUA_REGISTRYINDEX, call_it->second.gradient);
+    gradient_calls.erase(call_it);
+  }
+
+  void LuaEnvData::invalidate_gradients() const {
+    while (!gradient_calls.empty()) {
+      invalidate_gradient(gradient_calls.begin()->first);
+    }
+  }
+
   std::optional<std::pair<arma::vec, double>>
   LuaEnvData::call_gradient(const spec::Formula* formula, const arma::vec& point) const {
-    if (!fplus::map_contains(formula->gradient_fn, name)) {
+    const auto call_it = gradient_calls.find(formula);
+    if (call_it == gradient_calls.end()) {
       log->error("Called gradient for {} before it was initialized!", formula->name);
       return std::nullopt;
     }
 
+    std::optional<std::pair<arma::vec, double>> native_result;
+    if (const auto* native = native_formula(formula->normal_fn_name);
+        native != nullptr && !native->boolean) {
+      native_result = call_native_gradient(*native, point);
+    }
+
+    if (native_result && !CHECK_NATIVE_FORMULAS) {
+      return native_result;
+    }
+
+    auto& call = call_it->second;
+    if (point.n_elem != call.point.size()) {
+      log->error("Gradient for {} expects {} dimensions, but got {}",
+                 formula->name,
+                 call.point.size(),
+                 point.n_elem);
+      return std::nullopt;
+    }
+
     const auto start_top = lua_gettop(L);
 
     // Push traceback
     lua_getglobal(L, TRACEBACK_NAME);
     int err_func_idx = lua_gettop(L);
 
-    // Push alg
-    lua_getglobal(L, "alg");
-
-    // Retrieve the gradient ref - use at() to maintain constness
-    lua_rawgeti(L, LUA_REGISTRYINDEX, formula->gradient_fn.at(name));
-
-    // Push tovec
-    lua_getfield(L, -2, "tovec");
-
-    // Make an array
-    lua_createtable(L, point.n_elem, 0);
-
-    // Load the array with point's data
-    for (int i = 0; i < point.n_elem; ++i) {
-      lua_pushnumber(L, point[i]);
-      lua_rawseti(L, -2, i + 1);
+    // The wrapper reads the point from its buffer and writes the gradient to its other buffer
+    std::copy(point.begin(), point.end(), call.point.begin());
+    lua_rawgeti(L, LUA_REGISTRYINDEX, call.fn);
+    if (lua_pcall(L, 0, 1, err_func_idx) != 0) {
+      const Str err_msg = lua_tostring(L, -1);
+      log->error("Error calling {} gradient: {}", formula->name, err_msg);
+      lua_pop(L, 2);
+      throw std::runtime_error(
+      fmt::format("Failed to call gradient for {}: {}", formula->name, err_msg));
     }
 
-    // Use alg.tovec
-    if (lua_pcall(L, 1, 1, err_func_idx) != 0) {
-      auto err_msg = lua_tostring(L, -1);
-      log->error("Error calling alg.tovec: {}", err_msg);
-      int top_idx = lua_gettop(L);
-      lua_pop(L, top_idx - err_func_idx + 1);
-      throw std::runtime_error(fmt::format("Failed to call alg.tovec: {}", err_msg));
+    const double value = lua_tonumber(L, -1);
+    lua_pop(L, 2);
+    const auto end_top = lua_gettop(L);
+    if (end_top != start_top) {
+      log->error("Top grew from {} to {}", start_top, end_top);
     }
 
-    // Make a vec for the gradient result
-    lua_getfield(L, -3, "vec");
-    lua_pushinteger(L, point.n_elem);
+    arma::vec grad(call.grad);
+    if (native_result) {
+      const auto& [native_grad, native_value] = *native_result;
+      arma::uword dim = 0;
+      while (dim < grad.n_elem && agrees(native_grad[dim], grad[dim], GRADIENT_TOLERANCE)) {
+        ++dim;
+      }
 
-    if (lua_pcall(L, 1, 1, err_func_idx) != 0) {
-      auto err_msg = lua_tostring(L, -1);
-      log->error("Error calling alg.vec: {}", err_msg);
-      int top_idx = lua_gettop(L);
-      lua_pop(L, top_idx - err_func_idx + 1);
-      throw std::runtime_error(fmt::format("Failed to call alg.vec: {}", err_msg));
+      if (dim < grad.n_elem) {
+        log->warn("Compiled {} gave {} for dimension {} of its gradient, but Lua gave {}; using "
+                  "Lua for it from now on",
+                  formula->name,
+                  native_grad[dim],
+                  dim,
+                  grad[dim]);
+        native_formulas.erase(formula->normal_fn_name);
+      } else {
+        check_native(formula->normal_fn_name, native_value, value);
+      }
     }
 
-    // Store the grad vec somewhere we can get to it later
-    auto grad_vec_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-
-    // Put the grad vec back on the stack
-    lua_rawgeti(L, LUA_REGISTRYINDEX, grad_vec_ref);
+    return std::optional{std::pair{std::move(grad), value}};
+  }
 
-    // Call the gradient ref with the point vec and the grad vec
-    if (lua_pcall(L, 2, 1, err_func_idx) != 0) {
-      auto err_msg = lua_tostring(L, -1);
-      log->error("Error calling {} gradient: {}", formula->name, err_msg);
-      int top_idx = lua_gettop(L);
-      lua_pop(L, top_idx - err_func_idx + 1);
-      throw std::runtime_error(
-      fmt::format("Failed to call gradient for {}: {}", formula->name, err_msg));
+  std::optional<std::pair<arma::vec, double>>
+  LuaEnvData::call_native_gradient(const NativeFormula& formula, const arma::vec& point) const {
+    arma::vec grad(point.n_elem, arma::fill::zeros);
+    if (formula.slots.empty()) {
+      return std::optional{std::pair{std::move(grad), formula.evaluate(nullptr, native_values)}};
     }
 
-    // Get the value out
-    const double value = lua_tonumber(L, -1);
-    lua_pop(L, 1);
+    const auto* uni_data = static_cast<const planner::sampler::Universe*>(universe);
+    if (uni_data == nullptr) {
+      return std::nullopt;
+    }
 
-    // Copy the values out of the grad vec into the result
-    arma::vec grad(point.n_elem);
-    lua_rawgeti(L, LUA_REGISTRYINDEX, grad_vec_ref);
-    const auto grad_vec_idx = lua_gettop(L);
-    for (arma::uword i = 0; i < point.n_elem; ++i) {
-      // We have to use metamethods to access the elements, else we get a segfault
-      lua_pushinteger(L, i + 1);
-      lua_gettable(L, grad_vec_idx);
-      grad[i] = lua_tonumber(L, -1);
-      // TODO(Wil): If this is slow, we could batch pops better
-      lua_pop(L, 1);
+    // Only the robot's dimensions move anything, and they come first
+    const auto robot_dims = worldfns::robot_dims();
+    const Vec<double> robot_values(point.begin(), point.begin() + robot_dims);
+    const auto& jacobians = worldfns::pose_jacobians(robot_values, uni_data);
+    if (!load_native_vars(
+        formula,
+        bindings,
+        jacobians.poses,
+        [](const auto& pose_jacobian) -> const auto& { return pose_jacobian.first; },
+        native_vars)) {
+      return std::nullopt;
     }
 
-    // Pop cruft from the stack: alg, value, and the grad vec
-    int top_idx = lua_gettop(L);
-    lua_pop(L, top_idx - err_func_idx + 1);
-    const auto end_top = lua_gettop(L);
-    if (end_top != start_top) {
-      log->error("Top grew from {} to {}", start_top, end_top);
+    native_var_grad.assign(native_vars.size(), 0.0);
+    const auto value =
+    formula.gradient(native_vars.data(), native_values, native_adjoints, native_var_grad.data());
+
+    // Chain the derivatives with respect to the objects' pose fields through the pose Jacobians
+    for (std::size_t slot = 0; slot < formula.slots.size(); ++slot) {
+      const auto& slot_name = formula.slots[slot];
+      const auto& [pose, jacobian] =
+      jacobians.poses.at(slot_name[0] == '_' ? bindings.at(slot_name) : slot_name);
+      const auto* const slot_grad = native_var_grad.data() + slot * worldfns::OBJECT_DATA_SIZE;
+      const Eigen::Map<const Eigen::Vector3d> position_grad(slot_grad);
+      const Eigen::Map<const Eigen::Vector4d> rotation_grad(slot_grad + 3);
+      const Eigen::Quaterniond rotation(pose.linear());
+      for (int dim = 0; dim < robot_dims; ++dim) {
+        // Recover the angular velocity w from dR = [w]x R, and then dq = 0.5 (0, w) q
+        Eigen::Matrix3d rotation_tangent;
+        for (int col = 0; col < 3; ++col) {
+          rotation_tangent.col(col) = jacobian.col(dim).segment<3>(3 * col);
+        }
+
+        const Eigen::Matrix3d skew = rotation_tangent * pose.linear().transpose();
+        const Eigen::Vector3d angular(0.5 * (skew(2, 1) - skew(1, 2)),
+                                      0.5 * (skew(0, 2) - skew(2, 0)),
+                                      0.5 * (skew(1, 0) - skew(0, 1)));
+        Eigen::Vector4d rotation_deriv;
+        rotation_deriv.head<3>() = 0.5 * (rotation.w() * angular + angular.cross(rotation.vec()));
+        rotation_deriv[3]        = -0.5 * angular.dot(rotation.vec());
+        grad[dim] += position_grad.dot(jacobian.col(dim).segment<3>(9)) +
+                     rotation_grad.dot(rotation_deriv);
+      }
     }
 
     return std::optional{std::pair{std::move(grad), value}};
@@ -313,6 +563,7 @@ namespace predicate {
     for (const auto& [bind_name, real_name] : bindings) {
       lua_pushstring(L, real_name.c_str());
       lua_setglobal(L, (Str("binding") + bind_name).c_str());
+      this->bindings[bind_name] = real_name;
     }
   }
 
@@ -321,6 +572,7 @@ namespace predicate {
     lua_pushstring(L, "universe");
     lua_pushlightuserdata(L, universe);
     lua_settable(L, LUA_REGISTRYINDEX);
+    this->universe = universe;
   }
 
   void LuaEnvData::cleanup() const { lua_gc(L, LUA_GCCOLLECT, 0); }
@@ -23,6 +23,7 @@
 #include <ompl/base/State.h>
 #include <ompl/base/StateSpace.h>
 
+#include "native_formula.hh"
 #include "specification.hh"
 
 namespace symbolic::predicate {
@@ -30,17 +31,41 @@ constexpr char GRADIENT_PRELUDE_PATH[] = "lua/autodiff_prelude.lua";
 constexpr char UNSAT_PRELUDE_PATH[]    = "lua/unsat_prelude.lua";
 constexpr char BOOL_PRELUDE_PATH[]     = "lua/normal_prelude.lua";
 
+/// Whether to compile formulas to native code where possible, instead of always calling Lua.
+/// Must be set before any environments are made
+extern bool USE_NATIVE_FORMULAS;
+
+/// Whether to also run the Lua version of every compiled formula call, values and gradients both,
+/// and go back to Lua for good for any formula whose versions disagree. Slow; meant for checking a
+/// domain's semantics file before trusting the compiled formulas with it
+extern bool CHECK_NATIVE_FORMULAS;
+
 namespace ob = ompl::base;
 std::vector<double> generate_state_vector(const ob::StateSpace* const space,
                                           const ob::State* const state,
                                           const bool base_movable);
 
+/// Write the state vector into result, which must have space for cspace::num_dims entries
+void generate_state_vector(const ob::StateSpace* const space,
+                           const ob::State* const state,
+                           const bool base_movable,
+                           double* const result);
+
 namespace spec = input::specification;
 struct LuaEnvData {
   explicit LuaEnvData(const Str& name, const Str& prelude_filename = Str());
   bool load_predicates(const Str& predicates_filename) const;
   bool load_formula(spec::Formula* formula) const;
   bool load_gradient(spec::Formula* formula, const int num_dims) const;
+
+  /// Undo load_formula and any load_gradient for a formula, so that the environment can be lent
+  /// out again without it
+  void unload_formula(const spec::Formula* formula) const;
+
+  /// Drop a formula's cached gradient, so the next load_gradient rebuilds it. Reloading the
+  /// formula does this automatically
+  void invalidate_gradient(const spec::Formula* formula) const;
+  void invalidate_gradients() const;
   std::optional<std::pair<arma::vec, double>>
   call_gradient(const spec::Formula* formula, const arma::vec& point) const;
   void set_bindings(const std::unordered_map<Str, Str>& bindings) const;
@@ -55,6 +80,49 @@ struct LuaEnvData {
                 const ob::StateSpace* const space,
                 const ob::State* const state,
                 const bool base_movable) const;
+
+  /// The compiled form of a formula, if it has one
+  const NativeFormula* native_formula(const Str& fn_name) const;
+
+  /// Evaluate a compiled formula, or return nullopt if it has to fall back to Lua
+  std::optional<double> call_native(const NativeFormula& formula,
+                                    const ob::StateSpace* const space,
+                                    const ob::State* const state,
+                                    const bool base_movable) const;
+
+  /// Differentiate a compiled formula, or return nullopt if it has to fall back to Lua
+  std::optional<std::pair<arma::vec, double>>
+  call_native_gradient(const NativeFormula& formula, const arma::vec& point) const;
+
+  /// Compare a compiled formula's value with its Lua version's, dropping the compiled formula if
+  /// they disagree
+  void check_native(const Str& fn_name, const double native_value, const double lua_value) const;
+
+ private:
+  /// A gradient wrapped to read its point from and write its result to buffers shared with Lua
+  struct GradientCall {
+    spec::LuaRef gradient = LUA_NOREF;
+    spec::LuaRef fn       = LUA_NOREF;
+    Vec<double> point;
+    Vec<double> grad;
+  };
+
+  // Compiled gradients, by formula
+  mutable Map<const spec::Formula*, GradientCall> gradient_calls;
+  std::unique_ptr<FormulaCompiler> compiler;
+  mutable Map<Str, NativeFormula> native_formulas;
+  // Copies of the state given to Lua, for the compiled formulas
+  mutable Map<Str, Str> bindings;
+  mutable const void* universe = nullptr;
+  // Formulas read the state through an FFI view over this buffer, which must never reallocate.
+  // It's sized when the environment is made, so the configuration space must exist by then
+  mutable Vec<double> state_buffer;
+  // Scratch space for the compiled formulas
+  mutable Map<Str, Transform3r> native_poses;
+  mutable Vec<double> native_vars;
+  mutable Vec<double> native_values;
+  mutable Vec<double> native_adjoints;
+  mutable Vec<double> native_var_grad;
 };
 
 template <typename CallType> struct LuaEnv : public LuaEnvData {
@@ -70,9 +138,25 @@ template <> struct LuaEnv<bool> : public LuaEnvData {
                   const ob::StateSpace* const space,
                   const ob::State* const state,
                   const bool base_movable) const {
+    std::optional<bool> native_result;
+    if (const auto* formula = native_formula(fn_name)) {
+      if (const auto value = call_native(*formula, space, state, base_movable)) {
+        // Lua treats every number as true
+        native_result = !formula->boolean || *value != 0.0;
+      }
+    }
+
+    if (native_result && !CHECK_NATIVE_FORMULAS) {
+      return *native_result;
+    }
+
     if (call_lua(fn_name, space, state, base_movable)) {
       auto result = lua_toboolean(L, -1);
       lua_pop(L, 1);
+      if (native_result) {
+        check_native(fn_name, *native_result, result);
+      }
+
       return result;
     }
 
@@ -87,9 +171,24 @@ template <> struct LuaEnv<double> : public LuaEnvData {
                     const ob::StateSpace* const space,
                     const ob::State* const state,
                     const bool base_movable) const {
+    std::optional<double> native_result;
+    // NOTE: Boolean formulas only read as numbers through Lua's own conversion, so they skip the
+    // compiled version here
+    if (const auto* formula = native_formula(fn_name); formula != nullptr && !formula->boolean) {
+      native_result = call_native(*formula, space, state, base_movable);
+    }
+
+    if (native_result && !CHECK_NATIVE_FORMULAS) {
+      return *native_result;
+    }
+
     if (call_lua(fn_name, space, state, base_movable)) {
       auto result = lua_tonumber(L, -1);
       lua_pop(L, 1);
+      if (native_result) {
+        check_native(fn_name, *native_result, result);
+      }
+
       return result;
     }
 
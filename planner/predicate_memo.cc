@@ -0,0 +1,102 @@
+#include "predicate_memo.hh"
+
+#include <boost/container_hash/hash.hpp>
+
+namespace planner::util {
+std::size_t MEMO_CAPACITY = 0;
+
+std::size_t PredicateMemo::KeyHash::operator()(const Key& key) const {
+  size_t hash_val = 0;
+  boost::hash_combine(hash_val, key.formula);
+  boost::hash_combine(hash_val, key.bindings);
+  boost::hash_combine(hash_val, key.state_hash);
+  boost::hash_combine(hash_val, key.universe);
+  return hash_val;
+}
+
+PredicateMemo::PredicateMemo(const ob::StateSpace* const space, const std::size_t capacity)
+: space(space), shard_capacity((capacity + NUM_SHARDS - 1) / NUM_SHARDS) {}
+
+PredicateMemo::~PredicateMemo() {
+  for (auto& shard : shards) {
+    for (auto& entry : shard.entries) {
+      space->freeState(entry.state);
+    }
+  }
+}
+
+std::optional<bool> PredicateMemo::find(const Key& key,
+                                        const HashableStateSpace::StateType* const state) {
+  if (shard_capacity == 0) {
+    return std::nullopt;
+  }
+
+  auto& shard = this->shard(key);
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto index_it = shard.index.find(key);
+    if (index_it != shard.index.end()) {
+      const auto& entry = shard.entries[index_it->second];
+      if (space->equalStates(entry.state, state)) {
+        ++hits;
+        return entry.result;
+      }
+    }
+  }
+
+  ++misses;
+  return std::nullopt;
+}
+
+void PredicateMemo::insert(const Key& key,
+                           const HashableStateSpace::StateType* const state,
+                           const bool result) {
+  if (shard_capacity == 0) {
+    return;
+  }
+
+  auto& shard = this->shard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  // A colliding state replaces the one under its key
+  const auto index_it = shard.index.find(key);
+  if (index_it != shard.index.end()) {
+    auto& entry = shard.entries[index_it->second];
+    space->copyState(entry.state, state);
+    entry.result = result;
+    return;
+  }
+
+  if (shard.entries.size() < shard_capacity) {
+    shard.index.emplace(key, shard.entries.size());
+    shard.entries.push_back({key, space->cloneState(state), result});
+    return;
+  }
+
+  // Reuse the oldest entry's state rather than allocating a new one
+  auto& entry = shard.entries[shard.next];
+  shard.index.erase(entry.key);
+  space->copyState(entry.state, state);
+  entry.key    = key;
+  entry.result = result;
+  shard.index.emplace(key, shard.next);
+  shard.next = (shard.next + 1) % shard_capacity;
+}
+
+void PredicateMemo::clear() {
+  for (auto& shard : shards) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    for (auto& entry : shard.entries) {
+      space->freeState(entry.state);
+    }
+
+    shard.entries.clear();
+    shard.index.clear();
+    shard.next = 0;
+  }
+
+  hits   = 0;
+  misses = 0;
+}
+
+PredicateMemo::Counters PredicateMemo::counters() const { return {hits, misses}; }
+}  // namespace planner::util
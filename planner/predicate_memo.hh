@@ -0,0 +1,92 @@
+#pragma once
+#ifndef PREDICATE_MEMO_HH
+#define PREDICATE_MEMO_HH
+
+#include "common.hh"
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <optional>
+
+#include <ompl/base/State.h>
+#include <ompl/base/StateSpace.h>
+
+#include <tsl/robin_map.h>
+
+#include "hashable_statespace.hh"
+#include "specification.hh"
+
+namespace planner::util {
+namespace spec = input::specification;
+namespace ob   = ompl::base;
+
+/// How many predicate results each memo table keeps. Zero turns memoization off
+extern std::size_t MEMO_CAPACITY;
+
+/// Remembers the results of formulas at exact states. A formula's result only depends on its
+/// bindings, the universe, and the state, so repeated checks of a state can skip Lua entirely
+class PredicateMemo {
+ public:
+  struct Key {
+    const spec::Formula* formula;
+    const void* bindings;
+    std::size_t state_hash;
+    const void* universe;
+    bool operator==(const Key& other) const {
+      return formula == other.formula && bindings == other.bindings &&
+             state_hash == other.state_hash && universe == other.universe;
+    }
+  };
+
+  struct Counters {
+    std::size_t hits   = 0;
+    std::size_t misses = 0;
+  };
+
+  PredicateMemo(const ob::StateSpace* const space, const std::size_t capacity);
+  ~PredicateMemo();
+
+  /// The remembered result for a state, if there is one. States are compared exactly, so
+  /// colliding hashes are never confused
+  std::optional<bool> find(const Key& key, const HashableStateSpace::StateType* const state);
+  void insert(const Key& key, const HashableStateSpace::StateType* const state, const bool result);
+
+  /// Forget everything. Needed whenever the universes or actions that keys point to go away
+  void clear();
+  Counters counters() const;
+
+ private:
+  struct KeyHash {
+    std::size_t operator()(const Key& key) const;
+  };
+
+  struct Entry {
+    Key key;
+    ob::State* state;
+    bool result;
+  };
+
+  // Each shard is a fixed-size ring of entries, replacing the oldest when full, with an index
+  struct Shard {
+    std::mutex mutex;
+    tsl::robin_map<Key, std::size_t, KeyHash> index;
+    Vec<Entry> entries;
+    std::size_t next = 0;
+  };
+
+  static constexpr std::size_t NUM_SHARDS = 16;
+  // NOTE: Shards are picked with the high bits of a remixed hash, since the indices use the low
+  // bits of the plain one
+  Shard& shard(const Key& key) {
+    return shards[(KeyHash()(key) * 0x9E3779B97F4A7C15ULL) >> 60U];
+  }
+
+  const ob::StateSpace* const space;
+  const std::size_t shard_capacity;
+  std::array<Shard, NUM_SHARDS> shards;
+  std::atomic<std::size_t> hits{0};
+  std::atomic<std::size_t> misses{0};
+};
+}  // namespace planner::util
+#endif /* end of include guard */
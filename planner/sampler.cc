@@ -113,23 +113,9 @@ TampSampler::TampSampler(const ob::StateSpace* si,
 , domain(domain)
 , robot(robot) {
   log = spdlog::stdout_color_mt(name);
-  // Make the Lua Environments
-  correctness_env =
-  std::make_unique<symbolic::predicate::LuaEnv<bool>>(name + "-test",
-                                                      symbolic::predicate::BOOL_PRELUDE_PATH);
-  gradient_env = std::make_unique<symbolic::predicate::LuaEnv<double>>(
-  name + "-grad", symbolic::predicate::GRADIENT_PRELUDE_PATH);
-
-  // Add formulae and predicates to the environments
-  correctness_env->load_predicates(domain->predicates_file);
-  gradient_env->load_predicates(domain->predicates_file);
-  for (const auto& action : domain->actions) {
-    for (auto& [formula, _] : action->precondition) {
-      correctness_env->load_formula(&formula);
-      gradient_env->load_formula(&formula);
-      gradient_env->load_gradient(&formula, cspace::num_dims);
-    }
-  }
+  // Borrow Lua environments with the domain's formulae and predicates already loaded
+  correctness_env = symbolic::predicate::correctness_pool->acquire();
+  gradient_env    = symbolic::predicate::gradient_pool->acquire();
 
   robot_config_sampler = space_->allocSubspaceStateSampler(robot_space);
 }
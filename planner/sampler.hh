@@ -19,6 +19,7 @@
 #include <ompl/util/RandomNumbers.h>
 
 #include "cspace.hh"
+#include "env_pool.hh"
 #include "robot.hh"
 #include "heuristic.hh"
 #include "predicate.hh"
@@ -53,6 +54,7 @@ class TampSampler : public ob::StateSampler {
   TampSampler(const ob::StateSpace* si,
               const spec::Domain* const domain,
               const structures::robot::Robot* const robot);
+  ~TampSampler() override { spdlog::drop(name); }
   void sampleUniform(ob::State* state) override;
   void sampleUniformNear(ob::State* state, const ob::State* near, double distance) override;
   void sampleGaussian(ob::State* state, const ob::State* mean, double stdDev) override;
@@ -108,8 +110,8 @@ class TampSampler : public ob::StateSampler {
   // Needed for gradient descent
   const structures::robot::Robot* const robot;
 
-  std::unique_ptr<symbolic::predicate::LuaEnv<bool>> correctness_env;
-  std::unique_ptr<symbolic::predicate::LuaEnv<double>> gradient_env;
+  symbolic::predicate::EnvHandle<symbolic::predicate::LuaEnv<bool>> correctness_env;
+  symbolic::predicate::EnvHandle<symbolic::predicate::LuaEnv<double>> gradient_env;
 };
 
 ob::StateSamplerPtr allocTampSampler(const ob::StateSpace* space,
@@ -0,0 +1,441 @@
+#include "sdf.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
+
+#include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
+
+#include <fmt/format.h>
+// clang-format off
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
+// clang-format on
+
+#include <bullet/BulletCollision/NarrowPhaseCollision/btGjkEpa2.h>
+
+namespace planner::collisions {
+namespace {
+  auto log = spdlog::stdout_color_mt("sdf");
+
+  // Free space kept around the obstacles' bounding box, so that the grid's border is never inside
+  // an obstacle and queries just outside the grid still see the obstacles' surfaces
+  constexpr double SDF_PADDING = 0.25;
+  constexpr float INF          = std::numeric_limits<float>::infinity();
+  // Stands in for infinity in the distance transform, which needs to do arithmetic with it
+  constexpr double FAR = 1e20;
+
+  /// Hash a mesh's vertex and index data, since meshes with the same bounds can still differ
+  void hash_mesh(std::size_t& hash_val, const btStridingMeshInterface* mesh) {
+    for (int part = 0; part < mesh->getNumSubParts(); ++part) {
+      const unsigned char* vertices = nullptr;
+      int num_vertices              = 0;
+      PHY_ScalarType vertex_type    = PHY_FLOAT;
+      int vertex_stride             = 0;
+      const unsigned char* indices  = nullptr;
+      int index_stride              = 0;
+      int num_faces                 = 0;
+      PHY_ScalarType index_type     = PHY_INTEGER;
+      mesh->getLockedReadOnlyVertexIndexBase(&vertices,
+                                             num_vertices,
+                                             vertex_type,
+                                             vertex_stride,
+                                             &indices,
+                                             index_stride,
+                                             num_faces,
+                                             index_type,
+                                             part);
+      const std::size_t vertex_size =
+      3 * (vertex_type == PHY_DOUBLE ? sizeof(double) : sizeof(float));
+      const std::size_t index_size =
+      3 * (index_type == PHY_SHORT ? sizeof(short) : index_type == PHY_UCHAR ? 1 : sizeof(int));
+      for (int i = 0; i < num_vertices; ++i) {
+        const auto* vertex = vertices + static_cast<std::size_t>(i) * vertex_stride;
+        boost::hash_range(hash_val, vertex, vertex + vertex_size);
+      }
+
+      for (int i = 0; i < num_faces; ++i) {
+        const auto* face = indices + static_cast<std::size_t>(i) * index_stride;
+        boost::hash_range(hash_val, face, face + index_size);
+      }
+
+      mesh->unLockReadOnlyVertexBase(part);
+    }
+
+    const auto& scaling = mesh->getScaling();
+    for (int i = 0; i < 3; ++i) {
+      boost::hash_combine(hash_val, scaling[i]);
+    }
+  }
+
+  void hash_shape(std::size_t& hash_val, const btCollisionShape* shape, const btTransform& tf) {
+    boost::hash_combine(hash_val, shape->getShapeType());
+    btVector3 aabb_min;
+    btVector3 aabb_max;
+    shape->getAabb(tf, aabb_min, aabb_max);
+    const auto rotation = tf.getRotation();
+    for (int i = 0; i < 3; ++i) {
+      boost::hash_combine(hash_val, aabb_min[i]);
+      boost::hash_combine(hash_val, aabb_max[i]);
+    }
+
+    for (int i = 0; i < 4; ++i) {
+      boost::hash_combine(hash_val, rotation[i]);
+    }
+
+    if (shape->isCompound()) {
+      const auto* compound = static_cast<const btCompoundShape*>(shape);
+      for (int i = 0; i < compound->getNumChildShapes(); ++i) {
+        hash_shape(hash_val, compound->getChildShape(i), tf * compound->getChildTransform(i));
+      }
+    } else if (shape->getShapeType() == CONVEX_HULL_SHAPE_PROXYTYPE) {
+      const auto* hull = static_cast<const btConvexHullShape*>(shape);
+      for (int i = 0; i < hull->getNumPoints(); ++i) {
+        const auto& point = hull->getUnscaledPoints()[i];
+        for (int j = 0; j < 3; ++j) {
+          boost::hash_combine(hash_val, point[j]);
+        }
+      }
+    } else if (shape->getShapeType() == TRIANGLE_MESH_SHAPE_PROXYTYPE) {
+      hash_mesh(hash_val, static_cast<const btTriangleMeshShape*>(shape)->getMeshInterface());
+    }
+  }
+
+  /// Identifies a set of obstacles, regardless of their order
+  std::size_t hash_obstacles(const Vec<SpherePrefilter::PlacedShape>& obstacles,
+                             double resolution) {
+    std::size_t result = 0;
+    for (const auto& [shape, pose] : obstacles) {
+      std::size_t hash_val = 0;
+      hash_shape(hash_val, shape, pose);
+      result += hash_val;
+    }
+
+    boost::hash_combine(result, resolution);
+    return result;
+  }
+
+  /// Marks the voxels touched by a mesh's triangles. Points are sampled at half the voxel size,
+  /// so the marked voxels always form a surface that a flood fill can't leak through
+  struct TriangleRasterizer : public btTriangleCallback {
+    TriangleRasterizer(const btTransform& tf,
+                       double step_size,
+                       std::function<void(const btVector3&)> mark)
+    : step_size(step_size), tf(tf), mark(std::move(mark)) {}
+
+    void processTriangle(btVector3* triangle, int /* part */, int /* index */) override {
+      const auto a         = tf(triangle[0]);
+      const auto b         = tf(triangle[1]);
+      const auto c         = tf(triangle[2]);
+      const auto longest   = std::max({(b - a).length(), (c - a).length(), (c - b).length()});
+      const auto steps     = std::max(1, static_cast<int>(std::ceil(longest / step_size)));
+      const auto inv_steps = 1.0 / steps;
+      for (int i = 0; i <= steps; ++i) {
+        for (int j = 0; i + j <= steps; ++j) {
+          mark(a + (b - a) * (i * inv_steps) + (c - a) * (j * inv_steps));
+        }
+      }
+    }
+
+    const double step_size;
+    const btTransform& tf;
+    std::function<void(const btVector3&)> mark;
+  };
+
+  /// Felzenszwalb and Huttenlocher's 1D squared distance transform of the n values starting at f
+  /// and stride apart, written back in place
+  void edt_1d(float* f,
+              const int n,
+              const int stride,
+              Vec<double>& values,
+              Vec<int>& hull,
+              Vec<double>& bounds) {
+    values.resize(n);
+    hull.resize(n);
+    bounds.resize(n + 1);
+    for (int i = 0; i < n; ++i) {
+      values[i] = f[i * stride];
+    }
+
+    // Where the parabolas rooted at p and q cross
+    const auto intersect = [&](const int q, const int p) {
+      return ((values[q] + q * q) - (values[p] + p * p)) / (2.0 * (q - p));
+    };
+
+    int k     = 0;
+    hull[0]   = 0;
+    bounds[0] = -FAR;
+    bounds[1] = FAR;
+    for (int q = 1; q < n; ++q) {
+      auto s = intersect(q, hull[k]);
+      while (s <= bounds[k]) {
+        --k;
+        s = intersect(q, hull[k]);
+      }
+
+      ++k;
+      hull[k]       = q;
+      bounds[k]     = s;
+      bounds[k + 1] = FAR;
+    }
+
+    k = 0;
+    for (int q = 0; q < n; ++q) {
+      while (bounds[k + 1] < q) {
+        ++k;
+      }
+
+      const auto p  = hull[k];
+      f[q * stride] = static_cast<float>((q - p) * (q - p) + values[p]);
+    }
+  }
+
+  /// Squared distance (in voxels) from every voxel to the nearest voxel where features is true
+  Vec<float> squared_edt(const Vec<char>& features, const int dims[3], const bool feature_value) {
+    Vec<float> result(features.size());
+    std::transform(features.begin(), features.end(), result.begin(), [&](const auto feature) {
+      return static_cast<bool>(feature) == feature_value ? 0.0f : static_cast<float>(FAR);
+    });
+
+    Vec<double> values;
+    Vec<int> hull;
+    Vec<double> bounds;
+    const int strides[3] = {1, dims[0], dims[0] * dims[1]};
+    for (int axis = 0; axis < 3; ++axis) {
+      const auto u = (axis + 1) % 3;
+      const auto v = (axis + 2) % 3;
+      for (int i = 0; i < dims[u]; ++i) {
+        for (int j = 0; j < dims[v]; ++j) {
+          edt_1d(&result[i * strides[u] + j * strides[v]],
+                 dims[axis],
+                 strides[axis],
+                 values,
+                 hull,
+                 bounds);
+        }
+      }
+    }
+
+    return result;
+  }
+}  // namespace
+
+ObstacleSDF::ObstacleSDF(const Vec<SpherePrefilter::PlacedShape>& obstacles,
+                         double resolution,
+                         const std::optional<Str>& cache_dir)
+// NOTE: Marking voxels, measuring between voxel centers, and snapping queries to the nearest voxel
+// can each be off by half a voxel diagonal
+: resolution(resolution), error_bound(1.5 * std::sqrt(3.0) * resolution), dims{0, 0, 0} {
+  if (obstacles.empty()) {
+    return;
+  }
+
+  Str cache_path;
+  if (cache_dir) {
+    boost::filesystem::create_directories(*cache_dir);
+    cache_path = (boost::filesystem::path(*cache_dir) /
+                  fmt::format("{:016x}.sdf", hash_obstacles(obstacles, resolution)))
+                 .string();
+    if (boost::filesystem::exists(cache_path) && load(cache_path)) {
+      log->info("Loaded obstacle SDF from {}", cache_path);
+      return;
+    }
+  }
+
+  build(obstacles);
+  if (cache_dir) {
+    save(cache_path);
+  }
+}
+
+double ObstacleSDF::distance(const btVector3& point) const {
+  if (distances.empty()) {
+    return std::numeric_limits<double>::infinity();
+  }
+
+  const auto local = (point - origin) / resolution;
+  int voxel[3];
+  double outside = 0.0;
+  for (int i = 0; i < 3; ++i) {
+    voxel[i]       = static_cast<int>(std::lround(local[i]));
+    const auto gap = voxel[i] < 0 ? -voxel[i] : std::max(0, voxel[i] - (dims[i] - 1));
+    voxel[i]       = std::clamp(voxel[i], 0, dims[i] - 1);
+    outside += static_cast<double>(gap) * gap;
+  }
+
+  // The nearest obstacle is inside the grid, so for a point past it the distance is at least the
+  // hypotenuse of the gap to the border and the border voxel's distance. That only holds for a
+  // border voxel outside every obstacle, which the padding should ensure
+  const double border = distances[index(voxel[0], voxel[1], voxel[2])];
+  if (outside == 0.0 || border < 0.0) {
+    return border;
+  }
+
+  return std::sqrt(border * border + outside * resolution * resolution);
+}
+
+void ObstacleSDF::build(const Vec<SpherePrefilter::PlacedShape>& obstacles) {
+  btVector3 scene_min(INF, INF, INF);
+  btVector3 scene_max(-INF, -INF, -INF);
+  for (const auto& [shape, pose] : obstacles) {
+    btVector3 aabb_min;
+    btVector3 aabb_max;
+    shape->getAabb(pose, aabb_min, aabb_max);
+    scene_min.setMin(aabb_min);
+    scene_max.setMax(aabb_max);
+  }
+
+  const btVector3 padding(SDF_PADDING, SDF_PADDING, SDF_PADDING);
+  origin            = scene_min - padding;
+  const auto extent = scene_max + padding - origin;
+  for (int i = 0; i < 3; ++i) {
+    dims[i] = static_cast<int>(std::ceil(extent[i] / resolution)) + 1;
+  }
+
+  const auto num_voxels = static_cast<std::size_t>(dims[0]) * dims[1] * dims[2];
+  log->info("Building {}x{}x{} obstacle SDF...", dims[0], dims[1], dims[2]);
+  Vec<char> occupied(num_voxels, 0);
+  const auto to_voxel = [&](const btVector3& point, int voxel[3]) {
+    const auto local = (point - origin) / resolution;
+    for (int i = 0; i < 3; ++i) {
+      voxel[i] = std::clamp(static_cast<int>(std::lround(local[i])), 0, dims[i] - 1);
+    }
+  };
+
+  const auto mark = [&](const btVector3& point) {
+    int voxel[3];
+    to_voxel(point, voxel);
+    occupied[index(voxel[0], voxel[1], voxel[2])] = 1;
+  };
+
+  // Convex shapes are filled directly, marking every voxel they touch so that thin shapes don't
+  // fall between voxel centers. Meshes only get their surfaces marked, and are filled in by the
+  // flood fill below
+  const auto half_diagonal = 0.5 * std::sqrt(3.0) * resolution;
+  const auto mark_shape = [&](const auto& f, const btCollisionShape* shape, const btTransform& tf)
+  -> void {
+    if (shape->isCompound()) {
+      const auto* compound = static_cast<const btCompoundShape*>(shape);
+      for (int i = 0; i < compound->getNumChildShapes(); ++i) {
+        f(f, compound->getChildShape(i), tf * compound->getChildTransform(i));
+      }
+    } else if (shape->isConvex()) {
+      const auto* convex = static_cast<const btConvexShape*>(shape);
+      btVector3 aabb_min;
+      btVector3 aabb_max;
+      shape->getAabb(tf, aabb_min, aabb_max);
+      int low[3];
+      int high[3];
+      to_voxel(aabb_min, low);
+      to_voxel(aabb_max, high);
+      btGjkEpaSolver2::sResults results;
+      for (int z = low[2]; z <= high[2]; ++z) {
+        for (int y = low[1]; y <= high[1]; ++y) {
+          for (int x = low[0]; x <= high[0]; ++x) {
+            const auto center = origin + btVector3(x, y, z) * resolution;
+            if (btGjkEpaSolver2::SignedDistance(center, 0.0, convex, tf, results) <=
+                half_diagonal) {
+              occupied[index(x, y, z)] = 1;
+            }
+          }
+        }
+      }
+    } else if (shape->isConcave()) {
+      TriangleRasterizer rasterizer(tf, 0.5 * resolution, mark);
+      const btVector3 big(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+      static_cast<const btConcaveShape*>(shape)->processAllTriangles(&rasterizer, -big, big);
+    } else {
+      log->warn("Unsupported shape type {} in obstacle SDF", shape->getShapeType());
+    }
+  };
+
+  for (const auto& [shape, pose] : obstacles) {
+    mark_shape(mark_shape, shape, pose);
+  }
+
+  // Flood fill from the (always free) border to find everything outside of the obstacles
+  Vec<char> outside(num_voxels, 0);
+  std::deque<std::size_t> frontier;
+  const auto visit = [&](int x, int y, int z) {
+    const auto idx = index(x, y, z);
+    if (!occupied[idx] && !outside[idx]) {
+      outside[idx] = 1;
+      frontier.push_back(idx);
+    }
+  };
+
+  for (int z = 0; z < dims[2]; ++z) {
+    for (int y = 0; y < dims[1]; ++y) {
+      for (int x = 0; x < dims[0]; ++x) {
+        if (x == 0 || y == 0 || z == 0 || x == dims[0] - 1 || y == dims[1] - 1 ||
+            z == dims[2] - 1) {
+          visit(x, y, z);
+        }
+      }
+    }
+  }
+
+  while (!frontier.empty()) {
+    const auto idx = frontier.front();
+    frontier.pop_front();
+    const int x = idx % dims[0];
+    const int y = (idx / dims[0]) % dims[1];
+    const int z = idx / (static_cast<std::size_t>(dims[0]) * dims[1]);
+    if (x > 0) visit(x - 1, y, z);
+    if (x < dims[0] - 1) visit(x + 1, y, z);
+    if (y > 0) visit(x, y - 1, z);
+    if (y < dims[1] - 1) visit(x, y + 1, z);
+    if (z > 0) visit(x, y, z - 1);
+    if (z < dims[2] - 1) visit(x, y, z + 1);
+  }
+
+  const auto to_outside = squared_edt(outside, dims, true);
+  const auto to_inside  = squared_edt(outside, dims, false);
+  distances.resize(num_voxels);
+  for (std::size_t i = 0; i < num_voxels; ++i) {
+    distances[i] = (std::sqrt(to_inside[i]) - std::sqrt(to_outside[i])) * resolution;
+  }
+}
+
+bool ObstacleSDF::load(const Str& cache_path) {
+  std::ifstream cache_file(cache_path, std::ios::binary);
+  double cached_resolution;
+  double cached_origin[3];
+  cache_file.read(reinterpret_cast<char*>(&cached_resolution), sizeof(cached_resolution));
+  cache_file.read(reinterpret_cast<char*>(cached_origin), sizeof(cached_origin));
+  cache_file.read(reinterpret_cast<char*>(dims), sizeof(dims));
+  if (!cache_file || cached_resolution != resolution || dims[0] <= 0 || dims[1] <= 0 ||
+      dims[2] <= 0) {
+    log->warn("Ignoring bad SDF cache file {}", cache_path);
+    return false;
+  }
+
+  origin = btVector3(cached_origin[0], cached_origin[1], cached_origin[2]);
+  distances.resize(static_cast<std::size_t>(dims[0]) * dims[1] * dims[2]);
+  cache_file.read(reinterpret_cast<char*>(distances.data()), distances.size() * sizeof(float));
+  if (!cache_file) {
+    log->warn("Ignoring truncated SDF cache file {}", cache_path);
+    distances.clear();
+    return false;
+  }
+
+  return true;
+}
+
+void ObstacleSDF::save(const Str& cache_path) const {
+  std::ofstream cache_file(cache_path, std::ios::binary);
+  const double cached_origin[3] = {origin.x(), origin.y(), origin.z()};
+  cache_file.write(reinterpret_cast<const char*>(&resolution), sizeof(resolution));
+  cache_file.write(reinterpret_cast<const char*>(cached_origin), sizeof(cached_origin));
+  cache_file.write(reinterpret_cast<const char*>(dims), sizeof(dims));
+  cache_file.write(reinterpret_cast<const char*>(distances.data()),
+                   distances.size() * sizeof(float));
+  if (!cache_file) {
+    log->warn("Could not write SDF cache file {}", cache_path);
+  }
+}
+}  // namespace planner::collisions
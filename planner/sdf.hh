@@ -0,0 +1,41 @@
+#pragma once
+#ifndef SDF_HH
+#define SDF_HH
+#include "common.hh"
+
+#include <optional>
+
+#include <bullet/btBulletCollisionCommon.h>
+
+#include "sphere_prefilter.hh"
+
+namespace planner::collisions {
+/// Voxelized signed distance field of the obstacles, which never move. Distances are positive
+/// outside of obstacles and negative inside them, and are exact to within error()
+class ObstacleSDF {
+ public:
+  /// Voxelize the obstacles at the given resolution, or load the field from cache_dir if it was
+  /// built for the same obstacles before. Built fields are saved to cache_dir if it's given
+  ObstacleSDF(const Vec<SpherePrefilter::PlacedShape>& obstacles,
+              double resolution,
+              const std::optional<Str>& cache_dir);
+
+  /// Approximate signed distance from point to the nearest obstacle surface
+  double distance(const btVector3& point) const;
+  /// Bound on how far distance can be from the true signed distance
+  double error() const { return error_bound; }
+
+ private:
+  void build(const Vec<SpherePrefilter::PlacedShape>& obstacles);
+  bool load(const Str& cache_path);
+  void save(const Str& cache_path) const;
+  std::size_t index(int x, int y, int z) const { return (z * dims[1] + y) * dims[0] + x; }
+
+  double resolution;
+  double error_bound;
+  btVector3 origin;
+  int dims[3];
+  Vec<float> distances;
+};
+}  // namespace planner::collisions
+#endif
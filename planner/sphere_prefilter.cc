@@ -0,0 +1,239 @@
+#include "sphere_prefilter.hh"
+
+#include <algorithm>
+
+#include "collision.hh"
+
+namespace planner::collisions {
+namespace {
+  // Stand-in inner radius for shapes we don't know an inscribed sphere for. It is negative enough
+  // that no pair involving one of these shapes can ever be proven to collide
+  constexpr double NO_INNER_RADIUS = -1e9;
+  // Stand-in radius for held objects, which are left out of the check entirely
+  constexpr double HELD_RADIUS = -1e9;
+
+  /// True if any sphere (xs, ys, zs) overlaps the sphere at (x, y, z) by more than the matching
+  /// entry of reach minus the distance between their centers. Written in terms of whole-array
+  /// expressions so that Eigen vectorizes it
+  template <typename Derived>
+  inline bool any_overlap(const Eigen::ArrayXd& xs,
+                          const Eigen::ArrayXd& ys,
+                          const Eigen::ArrayXd& zs,
+                          const double x,
+                          const double y,
+                          const double z,
+                          const Eigen::ArrayBase<Derived>& reach) {
+    if (xs.size() == 0) {
+      return false;
+    }
+
+    return (reach.max(0.0).square() - ((xs - x).square() + (ys - y).square() + (zs - z).square()))
+           .maxCoeff() > 0.0;
+  }
+}  // namespace
+
+ShapeSpheres make_shape_spheres(const btCollisionShape* shape) {
+  btVector3 center;
+  btScalar radius;
+  shape->getBoundingSphere(center, radius);
+  ShapeSpheres result{center, radius, center, NO_INNER_RADIUS};
+  switch (shape->getShapeType()) {
+    case SPHERE_SHAPE_PROXYTYPE:
+      result.center       = btVector3(0.0, 0.0, 0.0);
+      result.inner_center = result.center;
+      result.radius       = static_cast<const btSphereShape*>(shape)->getRadius();
+      result.inner_radius = result.radius;
+      break;
+
+    case BOX_SHAPE_PROXYTYPE: {
+      const auto& extents = static_cast<const btBoxShape*>(shape)->getHalfExtentsWithoutMargin();
+      result.inner_center = btVector3(0.0, 0.0, 0.0);
+      result.inner_radius = std::min({extents.x(), extents.y(), extents.z()});
+      break;
+    }
+
+    case CYLINDER_SHAPE_PROXYTYPE: {
+      // NOTE: The smallest half-extent of a cylinder is either its radius or its half-height,
+      // regardless of which axis it's aligned with
+      const auto& extents =
+      static_cast<const btCylinderShape*>(shape)->getHalfExtentsWithoutMargin();
+      result.inner_center = btVector3(0.0, 0.0, 0.0);
+      result.inner_radius = std::min({extents.x(), extents.y(), extents.z()});
+      break;
+    }
+
+    case COMPOUND_SHAPE_PROXYTYPE: {
+      // Single-child compounds are common (e.g. one convex hull) and easy to see through
+      const auto* compound = static_cast<const btCompoundShape*>(shape);
+      if (compound->getNumChildShapes() == 1) {
+        const auto child    = make_shape_spheres(compound->getChildShape(0));
+        result.inner_center = compound->getChildTransform(0)(child.inner_center);
+        result.inner_radius = child.inner_radius;
+      }
+
+      break;
+    }
+
+    default:
+      break;
+  }
+
+  return result;
+}
+
+SpherePrefilter::SpherePrefilter(const Vec<const btCollisionShape*>& link_shapes,
+                                 const Vec<PlacedShape>& obstacles,
+                                 const Vec<PlacedShape>& objects,
+                                 const std::function<bool(std::size_t, std::size_t)>& checks_pair)
+: link_radii(link_shapes.size())
+, link_inner_radii(link_shapes.size())
+, link_pair_mask(Eigen::ArrayXXd::Zero(link_shapes.size(), link_shapes.size())) {
+  link_centers.reserve(link_shapes.size());
+  link_inner_centers.reserve(link_shapes.size());
+  for (std::size_t i = 0; i < link_shapes.size(); ++i) {
+    const auto spheres = make_shape_spheres(link_shapes[i]);
+    link_centers.push_back(spheres.center);
+    link_inner_centers.push_back(spheres.inner_center);
+    link_radii(i)       = spheres.radius;
+    link_inner_radii(i) = spheres.inner_radius;
+    for (std::size_t j = 0; j < i; ++j) {
+      if (checks_pair(i, j)) {
+        link_pair_mask(i, j) = 1.0;
+        link_pair_mask(j, i) = 1.0;
+      }
+    }
+  }
+
+  const auto num_world = static_cast<Eigen::Index>(obstacles.size());
+  world_x.resize(num_world);
+  world_y.resize(num_world);
+  world_z.resize(num_world);
+  world_radii.resize(num_world);
+  world_inner_x.resize(num_world);
+  world_inner_y.resize(num_world);
+  world_inner_z.resize(num_world);
+  world_inner_radii.resize(num_world);
+  for (Eigen::Index i = 0; i < num_world; ++i) {
+    const auto& [shape, pose] = obstacles[i];
+    const auto spheres        = make_shape_spheres(shape);
+    const auto center         = pose(spheres.center);
+    const auto inner          = pose(spheres.inner_center);
+    world_x(i)                = center.x();
+    world_y(i)                = center.y();
+    world_z(i)                = center.z();
+    world_radii(i)            = spheres.radius;
+    world_inner_x(i)          = inner.x();
+    world_inner_y(i)          = inner.y();
+    world_inner_z(i)          = inner.z();
+    world_inner_radii(i)      = spheres.inner_radius;
+  }
+
+  object_radii.resize(objects.size());
+  for (std::size_t i = 0; i < objects.size(); ++i) {
+    const auto& [shape, pose] = objects[i];
+    const auto spheres        = make_shape_spheres(shape);
+    object_centers.push_back(spheres.center);
+    object_radii(i) = spheres.radius;
+    initial_object_poses.push_back(pose);
+  }
+}
+
+SpherePrefilter::Scratch SpherePrefilter::make_scratch() const {
+  Scratch result(link_radii.size(), object_radii.size());
+  for (std::size_t i = 0; i < initial_object_poses.size(); ++i) {
+    place_object(i, &initial_object_poses[i], result);
+  }
+
+  return result;
+}
+
+void SpherePrefilter::place_object(const std::size_t object,
+                                   const btTransform* pose,
+                                   Scratch& scratch) const {
+  const auto held = pose == nullptr;
+  if (held != static_cast<bool>(scratch.object_held[object])) {
+    scratch.object_held[object] = held;
+    scratch.num_held += held ? 1 : -1;
+  }
+
+  if (held) {
+    scratch.object_radii(object) = HELD_RADIUS;
+    return;
+  }
+
+  const auto center            = (*pose)(object_centers[object]);
+  scratch.object_x(object)     = center.x();
+  scratch.object_y(object)     = center.y();
+  scratch.object_z(object)     = center.z();
+  scratch.object_radii(object) = object_radii(object);
+}
+
+SpherePrefilter::Result SpherePrefilter::check(const btTransform* link_tfs,
+                                               Scratch& scratch) const {
+  const auto num_links = link_radii.size();
+  for (Eigen::Index i = 0; i < num_links; ++i) {
+    const auto center = link_tfs[i](link_centers[i]);
+    const auto inner  = link_tfs[i](link_inner_centers[i]);
+    scratch.x(i)       = center.x();
+    scratch.y(i)       = center.y();
+    scratch.z(i)       = center.z();
+    scratch.inner_x(i) = inner.x();
+    scratch.inner_y(i) = inner.y();
+    scratch.inner_z(i) = inner.z();
+  }
+
+  // Separating two spheres separates everything inside them, so shapes can only penetrate as
+  // deeply as their bounding spheres overlap. Conversely, shapes penetrate at least as deeply as
+  // their inscribed spheres overlap
+  bool maybe_colliding = false;
+  for (Eigen::Index i = 0; i < num_links; ++i) {
+    const auto x       = scratch.x(i);
+    const auto y       = scratch.y(i);
+    const auto z       = scratch.z(i);
+    const auto inner_x = scratch.inner_x(i);
+    const auto inner_y = scratch.inner_y(i);
+    const auto inner_z = scratch.inner_z(i);
+    if (any_overlap(world_inner_x,
+                    world_inner_y,
+                    world_inner_z,
+                    inner_x,
+                    inner_y,
+                    inner_z,
+                    world_inner_radii + link_inner_radii(i) - PENETRATION_EPSILON)) {
+      return Result::WORLD_COLLISION;
+    }
+
+    if (any_overlap(scratch.inner_x,
+                    scratch.inner_y,
+                    scratch.inner_z,
+                    inner_x,
+                    inner_y,
+                    inner_z,
+                    (link_inner_radii + link_inner_radii(i) - PENETRATION_EPSILON) *
+                    link_pair_mask.col(i))) {
+      return Result::SELF_COLLISION;
+    }
+
+    maybe_colliding =
+    maybe_colliding ||
+    any_overlap(
+    world_x, world_y, world_z, x, y, z, world_radii + link_radii(i) - PENETRATION_EPSILON) ||
+    any_overlap(scratch.object_x,
+                scratch.object_y,
+                scratch.object_z,
+                x,
+                y,
+                z,
+                scratch.object_radii + link_radii(i) - PENETRATION_EPSILON) ||
+    any_overlap(scratch.x,
+                scratch.y,
+                scratch.z,
+                x,
+                y,
+                z,
+                (link_radii + link_radii(i) - PENETRATION_EPSILON) * link_pair_mask.col(i));
+  }
+
+  return maybe_colliding || scratch.num_held > 0 ? Result::UNKNOWN : Result::FREE;
+}
+}  // namespace planner::collisions
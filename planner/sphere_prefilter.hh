@@ -0,0 +1,94 @@
+#pragma once
+#ifndef SPHERE_PREFILTER_HH
+#define SPHERE_PREFILTER_HH
+#include "common.hh"
+
+#include <functional>
+#include <utility>
+
+#include <Eigen/Core>
+
+#include <bullet/btBulletCollisionCommon.h>
+
+namespace planner::collisions {
+/// A sphere containing a collision shape, and (for primitive shapes) a sphere contained in it, both
+/// in the shape's frame
+struct ShapeSpheres {
+  btVector3 center;
+  double radius;
+  btVector3 inner_center;
+  // Negative if we don't know a sphere inside the shape
+  double inner_radius;
+};
+
+ShapeSpheres make_shape_spheres(const btCollisionShape* shape);
+
+/// Conservative sphere approximation of the robot links and the world, used to settle states which
+/// are clearly free or clearly colliding without running Bullet's narrowphase
+class SpherePrefilter {
+ public:
+  enum class Result { FREE, SELF_COLLISION, WORLD_COLLISION, UNKNOWN };
+  using PlacedShape = std::pair<const btCollisionShape*, btTransform>;
+
+  /// Working memory for a check, and the current placement of the objects. Each thread needs its
+  /// own, from make_scratch
+  struct Scratch {
+    Scratch(Eigen::Index num_links, Eigen::Index num_objects)
+    : x(num_links), y(num_links), z(num_links), inner_x(num_links), inner_y(num_links),
+      inner_z(num_links), object_x(num_objects), object_y(num_objects), object_z(num_objects),
+      object_radii(num_objects), object_held(num_objects, 0) {}
+    Eigen::ArrayXd x;
+    Eigen::ArrayXd y;
+    Eigen::ArrayXd z;
+    Eigen::ArrayXd inner_x;
+    Eigen::ArrayXd inner_y;
+    Eigen::ArrayXd inner_z;
+    Eigen::ArrayXd object_x;
+    Eigen::ArrayXd object_y;
+    Eigen::ArrayXd object_z;
+    Eigen::ArrayXd object_radii;
+    Vec<char> object_held;
+    int num_held = 0;
+  };
+
+  /// link_shapes must be in the same order as the link transforms given to check, and objects in
+  /// the order they're given to place_object. Only obstacles are used to prove collisions, because
+  /// objects may be held (and so filtered out by Bullet). checks_pair tells us if Bullet would
+  /// ever test a pair of links against each other
+  SpherePrefilter(const Vec<const btCollisionShape*>& link_shapes,
+                  const Vec<PlacedShape>& obstacles,
+                  const Vec<PlacedShape>& objects,
+                  const std::function<bool(std::size_t, std::size_t)>& checks_pair);
+
+  Result check(const btTransform* link_tfs, Scratch& scratch) const;
+  Eigen::Index num_links() const { return link_radii.size(); }
+  /// Scratch space with every object at the pose it was constructed with
+  Scratch make_scratch() const;
+  /// Move an object's sphere, or drop it (if pose is nullptr) because the robot is holding it. A
+  /// held object moves with the robot, so no state can be proven free while one is held
+  void place_object(std::size_t object, const btTransform* pose, Scratch& scratch) const;
+
+ private:
+  Vec<btVector3> link_centers;
+  Vec<btVector3> link_inner_centers;
+  Eigen::ArrayXd link_radii;
+  Eigen::ArrayXd link_inner_radii;
+  // 1 where a pair of links is checked, 0 otherwise
+  Eigen::ArrayXXd link_pair_mask;
+
+  Eigen::ArrayXd world_x;
+  Eigen::ArrayXd world_y;
+  Eigen::ArrayXd world_z;
+  Eigen::ArrayXd world_radii;
+  Eigen::ArrayXd world_inner_x;
+  Eigen::ArrayXd world_inner_y;
+  Eigen::ArrayXd world_inner_z;
+  Eigen::ArrayXd world_inner_radii;
+
+  // In the objects' own frames
+  Vec<btVector3> object_centers;
+  Eigen::ArrayXd object_radii;
+  Vec<btTransform> initial_object_poses;
+};
+}  // namespace planner::collisions
+#endif
@@ -6,12 +6,34 @@ namespace planner::util {
 
 double GOAL_WEIGHT;
 bool UniverseMap::check_precondition(const HashableStateSpace::StateType* const state,
-                                     symbolic::heuristic::PrioritizedAction* action) const {
-  predicate_env->set_bindings(action->bindings);
+                                     symbolic::heuristic::PrioritizedAction* action,
+                                     Universe* uni_data) const {
+  const auto state_hash             = hash_value(*state);
+  bool env_ready                    = false;
   const auto& precondition_branches = action->action->precondition;
   return std::any_of(
   precondition_branches.begin(), precondition_branches.end(), [&](const auto& branch) {
-    return (*predicate_env)(branch.first.normal_fn_name, space_, state, base_movable);
+    const PredicateMemo::Key key{&branch.first, &action->bindings, state_hash, uni_data};
+    if (const auto result = precondition_memo->find(key, state)) {
+      return *result;
+    }
+
+    // Only pay for setting up the environment once something actually has to run in it
+    if (!env_ready) {
+      // The memo compares object poses too, so the formula must see the state's own, not
+      // whatever the universe's graph was last posed with
+      Map<Str, Transform3r> pose_map;
+      pose_map.reserve(objects_space->getSubspaceCount());
+      state_to_pose_map(state->as<ob::CompoundState>(objects_space_idx), objects_space, pose_map);
+      uni_data->sg->pose_objects(pose_map);
+      predicate_env->set_universe(uni_data);
+      predicate_env->set_bindings(action->bindings);
+      env_ready = true;
+    }
+
+    const bool result = (*predicate_env)(branch.first.normal_fn_name, space_, state, base_movable);
+    precondition_memo->insert(key, state, result);
+    return result;
   });
 }
 
@@ -54,9 +76,8 @@ bool UniverseMap::check_valid_transition(const HashableStateSpace::StateType* co
       return true;
     }
 
-    predicate_env->set_universe(uni_data);
     for (const auto& action : transition_states->actions) {
-      if (check_precondition(s1, action)) {
+      if (check_precondition(s1, action, uni_data)) {
         auto s1_copy           = space_->cloneState(s1);
         (*action_log)[s1_copy] = action;
         add_transition({u1, c1}, {u2, c2}, s1_copy->as<HashableStateSpace::StateType>(), action);
@@ -175,18 +196,13 @@ UniverseMap::UniverseMap(const spec::Initial& init_atoms,
 , num_discrete_dims(domain->num_symbolic_dims)
 , eqclass_space_idx(eqclass_space_idx)
 , discrete_space_idx(discrete_space_idx)
+, objects_space_idx(objects_space_idx)
 , base_movable(robot_base_movable)
+, objects_space(objects_space)
 , space_(space) {
-  // Create predicate testing environment
-  predicate_env =
-  std::make_unique<symbolic::predicate::LuaEnv<double>>("universe_map-predicate",
-                                                        symbolic::predicate::BOOL_PRELUDE_PATH);
-  predicate_env->load_predicates(domain->predicates_file);
-  for (const auto& action : domain->actions) {
-    for (auto& [formula, _] : action->precondition) {
-      predicate_env->load_formula(&formula);
-    }
-  }
+  // Borrow a predicate testing environment
+  predicate_env     = symbolic::predicate::precondition_pool->acquire();
+  precondition_memo = std::make_unique<PredicateMemo>(space_, MEMO_CAPACITY);
 
   UniverseSig init_universe(num_eqclass_dims, 0);
   ConfigSig init_config(num_discrete_dims, 0);
@@ -270,6 +286,8 @@ void UniverseMap::clear(const spec::Initial& init_atoms,
                         ob::CompoundStateSpace* objects_space,
                         unsigned int objects_space_idx) {
   graph.clear();
+  // Memoized results point to the universes and actions being thrown away
+  precondition_memo->clear();
   UniverseSig init_universe(num_eqclass_dims, 0);
   ConfigSig init_config(num_discrete_dims, 0);
   for (const auto& dim : init_atoms) {
@@ -14,9 +14,11 @@
 #include <tsl/robin_map.h>
 #include <tsl/robin_set.h>
 
+#include "env_pool.hh"
 #include "hash_helpers.hh"
 #include "hashable_statespace.hh"
 #include "predicate.hh"
+#include "predicate_memo.hh"
 #include "signatures.hh"
 #include "specification.hh"
 
@@ -96,7 +98,8 @@ struct UniverseMap {
   bool check_valid_transition(const HashableStateSpace::StateType* const s1,
                               const HashableStateSpace::StateType* const s2);
   bool check_precondition(const HashableStateSpace::StateType* const state,
-                          symbolic::heuristic::PrioritizedAction* action) const;
+                          symbolic::heuristic::PrioritizedAction* action,
+                          Universe* uni_data) const;
   void added_state(HashableStateSpace::StateType* state);
   ActionDistribution::ValueData* const sample();
   std::pair<Universe*, Config*>
@@ -117,10 +120,13 @@ struct UniverseMap {
   const unsigned int num_discrete_dims;
   const unsigned int eqclass_space_idx;
   const unsigned int discrete_space_idx;
+  const unsigned int objects_space_idx;
   const bool base_movable;
+  const ob::CompoundStateSpace* const objects_space;
   const ob::StateSpace* const space_;
   ompl::RNG rng;
-  std::unique_ptr<symbolic::predicate::LuaEnv<double>> predicate_env;
+  symbolic::predicate::EnvHandle<symbolic::predicate::LuaEnv<double>> predicate_env;
+  std::unique_ptr<PredicateMemo> precondition_memo;
   std::unique_ptr<symbolic::heuristic::FFLikeHeuristic> heuristic;
 };
 }  // namespace planner::util
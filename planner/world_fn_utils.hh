@@ -21,11 +21,11 @@ int generate_gradient_objects(lua_State* L,
 
 int generate_correctness_objects(lua_State* L,
                                  int num_objects,
-                                 int state_idx,
+                                 const double* state,
                                  const sampler::Universe* uni_data);
 
 void collect_obj_names(lua_State* L, Vec<Str>* obj_order, int num_objects);
-template <typename T> Transform3<T> make_base_pose(const Vec<T>& state) {
+template <typename T> Transform3<T> make_base_pose(const T* const state) {
   Transform3<T> base_tf(*(robot->base_pose));
   if (robot->base_movable) {
     base_tf.translation().x() = state[0];
@@ -43,7 +43,7 @@ template <typename T> Transform3<T> make_base_pose(const Vec<T>& state) {
 }
 
 template <typename T>
-void fill_joint_arrays(const Vec<T>& state, T* cont_vals, T* joint_vals, int offset) {
+void fill_joint_arrays(const T* const state, T* cont_vals, T* joint_vals, int offset) {
   for (size_t i = 0; i < cspace::cont_joint_idxs.size(); ++i) {
     cont_vals[i] = state[offset + i];
   }
@@ -1,6 +1,7 @@
 #include "world_functions.hh"
 #include "common.hh"
 
+#include <algorithm>
 #include <stdexcept>
 #include <variant>
 #include <vector>
@@ -238,18 +239,39 @@ namespace worldfns {
     // State vector is: [Robot_parts... Object1... Object2... ... ObjectN...]
     int num_objects         = lua_objlen(L, -1);
     constexpr int state_idx = 1;
+
+    // Correctness calls pass the environment's FFI view of its state buffer, so we read the
+    // buffer directly
+    lua_getfield(L, LUA_REGISTRYINDEX, STATE_VIEW_KEY);
+    const auto is_view = lua_rawequal(L, state_idx, -1) != 0;
+    lua_pop(L, 1);
+    if (is_view) {
+      lua_getfield(L, LUA_REGISTRYINDEX, STATE_BUFFER_KEY);
+      const auto* const state = static_cast<const double*>(lua_touserdata(L, -1));
+      lua_pop(L, 1);
+      return generate_correctness_objects(L, num_objects, state, uni_data);
+    }
+
     // NOTE: The autograd library uses a custom cdata datatype, so we have these variants
     const auto is_gradient = lua_type(L, state_idx) != LUA_TTABLE;
     if (is_gradient) {
       return generate_gradient_objects(L, num_objects, state_idx, uni_data);
     }
 
-    return generate_correctness_objects(L, num_objects, state_idx, uni_data);
+    // Plain tables still work, for calls from Lua
+    Vec<double> state(state_size);
+    for (int i = 1; i <= state_size; ++i) {
+      lua_rawgeti(L, state_idx, i);
+      state[i - 1] = lua_tonumber(L, -1);
+    }
+
+    lua_pop(L, state_size);
+    return generate_correctness_objects(L, num_objects, state.data(), uni_data);
   }
 
   int generate_correctness_objects(lua_State* L,
                                    const int num_objects,
-                                   const int state_idx,
+                                   const double* const state,
                                    const sampler::Universe* const uni_data) {
     Map<Str, Transform3r> obj_poses;
     Vec<Str> obj_order;
@@ -260,17 +282,6 @@ namespace worldfns {
     //   obj_poses.emplace(name, nullptr);
     // }
 
-    // Read off state vec
-    Vec<double> state(state_size);
-    for (int i = 1; i <= state_size; ++i) {
-      lua_rawgeti(L, state_idx, i);
-      state[i - 1] = lua_tonumber(L, -1);
-    }
-
-    lua_pop(L, state_size);
-
-    // log->warn("State vec for {} is: {}", is_gradient ? "gradient" : "correctness", state);
-
     // Pose the objects
     double cont_vals[cspace::cont_joint_idxs.size()];
     double joint_vals[cspace::joint_bounds.size()];
@@ -281,6 +292,93 @@ namespace worldfns {
     return num_objects;
   }
 
+  int robot_dims() {
+    return (robot->base_movable ? 4 : 0) + cspace::cont_joint_idxs.size() +
+           cspace::joint_bounds.size();
+  }
+
+  void pose_nodes(const double* const state,
+                  const sampler::Universe* const uni_data,
+                  Map<Str, Transform3r>& poses) {
+    double cont_vals[cspace::cont_joint_idxs.size()];
+    double joint_vals[cspace::joint_bounds.size()];
+    const auto base_tf = make_base_pose(state);
+    fill_joint_arrays(state, cont_vals, joint_vals, robot->base_movable ? 4 : 0);
+    const auto poser =
+    [&](const auto* const node, const auto robot_ancestor, const auto& tf, const auto& coll_tf) {
+      poses[node->name] = tf;
+    };
+
+    uni_data->sg->update_transforms<double>(cont_vals, joint_vals, base_tf, poser);
+  }
+
+  /// The autodiff library builds a gradient by evaluating the formula once per state dimension at
+  /// the same point, seeding a different dimension each time. FK only depends on the point, so we
+  /// compute every frame's Jacobian once per point, and chain each evaluation's seed through them
+  const PoseJacobians&
+  pose_jacobians(const Vec<double>& robot_values, const sampler::Universe* const uni_data) {
+    thread_local PoseJacobians cache;
+    const auto& sg            = uni_data->sg;
+    const auto topology       = sg->topology();
+    // The objects off the robot are wherever this thread last posed them
+    const auto object_version = sg->object_version();
+    if (cache.uni_data == uni_data && cache.topology == topology &&
+        cache.object_version == object_version && cache.robot_values == robot_values) {
+      return cache;
+    }
+
+    cache.uni_data       = uni_data;
+    cache.topology       = topology;
+    cache.object_version = object_version;
+    cache.robot_values   = robot_values;
+    cache.poses.clear();
+
+    const int num_dims = robot_values.size();
+    double cont_vals[cspace::cont_joint_idxs.size()];
+    double joint_vals[cspace::joint_bounds.size()];
+    const auto base_tf = make_base_pose(robot_values.data());
+    fill_joint_arrays(robot_values.data(), cont_vals, joint_vals, robot->base_movable ? 4 : 0);
+
+    // Nothing off the robot moves with it
+    const auto poser =
+    [&](const auto* const node, const auto robot_ancestor, const auto& tf, const auto& coll_tf) {
+      if (!robot_ancestor) {
+        auto& [value, jacobian] = cache.poses[node->name];
+        value                   = tf;
+        jacobian.setZero(Eigen::NoChange, num_dims);
+      }
+    };
+
+    sg->update_transforms<double>(cont_vals, joint_vals, base_tf, poser);
+
+    auto& frames = cache.frames;
+    sg->jacobians(cont_vals,
+                  joint_vals,
+                  base_tf,
+                  robot->base_movable,
+                  cspace::cont_joint_idxs.size(),
+                  cspace::joint_bounds.size(),
+                  frames);
+    for (std::size_t entry = 0; entry < frames.poses.size(); ++entry) {
+      const auto& frame_pose  = frames.poses[entry];
+      const auto& frame_jac   = frames.jacobians[entry];
+      auto& [value, jacobian] = cache.poses[sg->fk_node(*frames.plan, entry).name];
+      value                   = frame_pose;
+      jacobian.resize(Eigen::NoChange, num_dims);
+      // Rotating at angular velocity w moves each axis of the frame at w x axis
+      for (int dim = 0; dim < num_dims; ++dim) {
+        const Vector3r angular = frame_jac.col(dim).tail<3>();
+        for (int col = 0; col < 3; ++col) {
+          jacobian.col(dim).segment<3>(3 * col) = angular.cross(frame_pose.linear().col(col));
+        }
+
+        jacobian.col(dim).segment<3>(9) = frame_jac.col(dim).head<3>();
+      }
+    }
+
+    return cache;
+  }
+
   int generate_gradient_objects(lua_State* L,
                                 const int num_objects,
                                 const int state_idx,
@@ -292,30 +390,44 @@ namespace worldfns {
     collect_obj_names(L, &obj_order, num_objects);
 
     // Read off state vec
-    Vec<addn::DN> state(state_size);
+    Vec<double> values(state_size);
+    Eigen::VectorXd seed(state_size);
     for (int i = 1; i <= state_size; ++i) {
       lua_pushinteger(L, i);
       lua_gettable(L, state_idx);
       const auto table_idx = lua_gettop(L);
       lua_pushstring(L, "_v");
       lua_gettable(L, table_idx);
-      const auto v = lua_tonumber(L, -1);
+      values[i - 1] = lua_tonumber(L, -1);
       lua_pushstring(L, "_a");
       lua_gettable(L, table_idx);
-      const auto a = lua_tonumber(L, -1);
-      state[i - 1] = addn::DN{v, a};
+      seed[i - 1] = lua_tonumber(L, -1);
     }
 
     lua_pop(L, 3 * state_size);
 
-    // Pose the objects
-    addn::DN cont_vals[cspace::cont_joint_idxs.size()];
-    addn::DN joint_vals[cspace::joint_bounds.size()];
-    Transform3<addn::DN> base_tf = make_base_pose(state);
-    fill_joint_arrays(state, cont_vals, joint_vals, robot->base_movable ? 4 : 0);
-    pose_objects(cont_vals, joint_vals, obj_poses, base_tf, uni_data);
-    make_objects(L, obj_order, obj_poses, uni_data->sg);
+    // Pose the objects. Only the robot's dimensions move anything, and they come first
+    const auto num_robot_dims = robot_dims();
+    values.resize(num_robot_dims);
+    const auto robot_seed = seed.head(num_robot_dims);
+    const auto& jacobians = pose_jacobians(values, uni_data);
+    for (const auto& obj_name : obj_order) {
+      const auto& pose_it = jacobians.poses.find(obj_name);
+      if (pose_it == jacobians.poses.end()) {
+        continue;
+      }
+
+      const auto& [value, jacobian] = pose_it->second;
+      const Eigen::Matrix<double, 12, 1> tangent = jacobian * robot_seed;
+      auto& pose = obj_poses.emplace(obj_name, Transform3<addn::DN>::Identity()).first->second;
+      for (int row = 0; row < 3; ++row) {
+        for (int col = 0; col < 4; ++col) {
+          pose.matrix()(row, col) = addn::DN{value.matrix()(row, col), tangent[3 * col + row]};
+        }
+      }
+    }
 
+    make_objects(L, obj_order, obj_poses, uni_data->sg);
     return num_objects;
   }
 
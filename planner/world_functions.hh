@@ -1,6 +1,7 @@
 #pragma once
 #ifndef WORLD_FUNCTIONS_HH
 #define WORLD_FUNCTIONS_HH
+#include "common.hh"
 
 #include <cstring>
 #include <memory>
@@ -60,6 +61,43 @@ extern ObjectSet* obstacles;
 extern Robot* robot;
 
 constexpr char OBJECT_FN_NAME[] = "generate_objects";
+/// Registry keys for each environment's state buffer, and the FFI view of it passed to formulas
+constexpr char STATE_BUFFER_KEY[] = "state_buffer";
+constexpr char STATE_VIEW_KEY[]   = "state_view";
+
+/// Lua: generate_objects(state, names) returns the named objects' poses in state, along with the
+/// metadata of the objects and obstacles among them.
+/// NOTE: This stays a Lua C function rather than an ffi.C symbol. Its results are nested tables
+/// (grasps, stable poses, support surfaces) which an FFI function can't build, its gradient
+/// variant is handed the autodiff library's dual numbers, and ffi.C would need the binary to
+/// export its symbols. The cost the FFI route was after is copying the state through a table,
+/// which the FFI view of each environment's state buffer already avoids: this reads that buffer
+/// directly
 int generate_objects(lua_State* L);
+
+/// The number of entries at the front of the state vector which describe the robot
+int robot_dims();
+
+/// Pose every node of the universe's scene graph at the robot configuration in state. Existing
+/// entries of poses are overwritten in place
+void pose_nodes(const double* state,
+                const sampler::Universe* uni_data,
+                Map<Str, Transform3r>& poses);
+
+/// Poses of the scene graph's nodes at one robot configuration and object pose version, with
+/// their derivatives with respect to each of the robot's state dimensions
+struct PoseJacobians {
+  const sampler::Universe* uni_data = nullptr;
+  std::size_t topology              = 0;
+  std::size_t object_version        = 0;
+  Vec<double> robot_values;
+  // Jacobian rows are the entries of the pose's top 3x4 block, in column-major order
+  Map<Str, std::pair<Transform3r, Eigen::Matrix<double, 12, Eigen::Dynamic>>> poses;
+  structures::scenegraph::FKJacobians frames;
+};
+
+/// The Jacobians of every node's pose at robot_values, cached per thread for the last point
+const PoseJacobians& pose_jacobians(const Vec<double>& robot_values,
+                                    const sampler::Universe* uni_data);
 }  // namespace symbolic::worldfns
 #endif
@@ -14,6 +14,10 @@
 
 #include "scenegraph.hh"
 
+namespace octomap {
+class OcTree;
+}
+
 namespace structures::object {
 struct DiscreteGrasp {
   DiscreteGrasp(const Transform3r& frame) : frame(frame) {}
@@ -62,6 +66,8 @@ struct Object {
   Vec<Grasp> grasps;
   std::optional<StableFace> stable_face;
   Vec<StablePose> stable_poses;
+  // Set for obstacles loaded from an octree, so backends which support octrees can use it directly
+  std::shared_ptr<const octomap::OcTree> octree;
 
   void get_bounding_sphere(double& x, double& y, double& z, double& radius) {
     btVector3 center;
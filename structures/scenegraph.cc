@@ -7,6 +7,34 @@ namespace structures::scenegraph {
 // namespace {
 //   auto log = spdlog::stdout_color_mt("scenegraph");
 // }
+namespace {
+  /// result = parent * local, for every row. Each line is a whole-column expression, so Eigen
+  /// vectorizes it across configurations
+  template <typename Parent, typename Local, typename Result>
+  inline void compose(const Parent& parent, const Local& local, Result&& result) {
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        result.col(3 * i + j) = parent.col(3 * i) * local.col(j) +
+                                parent.col(3 * i + 1) * local.col(3 + j) +
+                                parent.col(3 * i + 2) * local.col(6 + j);
+      }
+
+      result.col(9 + i) = parent.col(3 * i) * local.col(9) + parent.col(3 * i + 1) * local.col(10) +
+                          parent.col(3 * i + 2) * local.col(11) + parent.col(9 + i);
+    }
+  }
+
+  /// Fill every row of local with the same transform
+  inline void set_local(const Transform3r& tf, Eigen::ArrayXXd& local) {
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        local.col(3 * i + j).setConstant(tf.linear()(i, j));
+      }
+
+      local.col(9 + i).setConstant(tf.translation()(i));
+    }
+  }
+}  // namespace
 
 void Node::add_child(Node& child) {
   children.push_back(child.self_idx);
@@ -52,13 +80,37 @@ void Node::remove_child(const Node& child) {
 //   return result;
 // }
 
+Graph::Graph(const Graph& other)
+: trees(other.trees)
+, nodes(other.nodes)
+, idx_index(other.idx_index)
+, topology_id(other.topology_id) {
+  {
+    std::lock_guard<std::mutex> lock(other.plan_mutex);
+    cached_plan = other.cached_plan;
+  }
+}
+
+Node& Graph::mutable_node(const int idx) {
+  auto& node = nodes[idx];
+  if (node.use_count() > 1) {
+    node = std::make_shared<Node>(*node);
+  }
+
+  return *node;
+}
+
 Node& Graph::add_node(int parent_idx, Node node) {
-  auto& new_node    = nodes.emplace_back(node);
+  auto& new_node    = *nodes.emplace_back(std::make_shared<Node>(std::move(node)));
   new_node.self_idx = nodes.size() - 1;
-  idx_index.emplace(new_node.name, new_node.self_idx);
+  if (idx_index.use_count() > 1) {
+    idx_index = std::make_shared<NameIndex>(*idx_index);
+  }
+
+  idx_index->emplace(new_node.name, new_node.self_idx);
+  topology_id = ++next_topology_id;
   if (parent_idx >= 0) {
-    auto& parent = nodes[parent_idx];
-    parent.add_child(new_node);
+    mutable_node(parent_idx).add_child(new_node);
   } else {
     trees.push_back(new_node.self_idx);
   }
@@ -68,8 +120,8 @@ Node& Graph::add_node(int parent_idx, Node node) {
 
 Node& Graph::extract(const Str& name) {
   // NOTE: We assume that name is *always* in the graph for a slight optimization
-  const auto idx = idx_index.at(name);
-  auto& node     = nodes[idx];
+  const auto idx = idx_index->at(name);
+  auto& node     = mutable_node(idx);
   auto tree_it   = std::find(trees.begin(), trees.end(), node.self_idx);
   if (tree_it != trees.end()) {
     trees.erase(tree_it);
@@ -77,24 +129,233 @@ Node& Graph::extract(const Str& name) {
 
   // nodes.erase(node_it);
   if (node.parent >= 0) {
-    auto& parent = nodes[node.parent];
-    parent.remove_child(node);
+    mutable_node(node.parent).remove_child(node);
     node.parent = -1;
   }
 
+  topology_id = ++next_topology_id;
   return node;
 }
 
-Node& Graph::find(const Str& name) {
-  const auto idx = idx_index.at(name);
-  return nodes[idx];
+bool Graph::attached_to_robot(const Str& name) const {
+  auto idx = idx_index->at(name);
+  while (nodes[idx]->parent >= 0) {
+    idx = nodes[idx]->parent;
+  }
+
+  return nodes[idx]->is_base;
+}
+
+std::shared_ptr<const FKPlan> Graph::fk_plan() const {
+  std::lock_guard<std::mutex> lock(plan_mutex);
+  if (cached_plan == nullptr || cached_plan->topology != topology_id) {
+    cached_plan = build_fk_plan();
+  }
+
+  return cached_plan;
+}
+
+std::shared_ptr<const FKPlan> Graph::build_fk_plan() const {
+  auto result = std::make_shared<FKPlan>();
+
+  // Breadth-first, so every entry's parent is already in the plan when the entry is added
+  for (const auto tree_idx : trees) {
+    if (!nodes[tree_idx]->is_base) {
+      continue;
+    }
+
+    result->node_idxs.push_back(tree_idx);
+    result->parents.push_back(-1);
+    for (std::size_t i = 0; i < result->node_idxs.size(); ++i) {
+      for (const auto child_idx : nodes[result->node_idxs[i]]->children) {
+        result->node_idxs.push_back(child_idx);
+        result->parents.push_back(static_cast<int>(i));
+      }
+    }
+  }
+
+  for (const auto node_idx : result->node_idxs) {
+    const auto& node = *nodes[node_idx];
+    result->types.push_back(node.type);
+    result->joint_idxs.push_back(node.idx ? *node.idx : -1);
+    result->axes.push_back(node.axis);
+    result->transforms.push_back(node.transform);
+    result->collision_transforms.push_back(node.collision_transform);
+  }
+
+  result->topology = topology_id;
+  return result;
+}
+
+void Graph::update_transforms_batch(const Eigen::ArrayXXd& cont_vals,
+                                    const Eigen::ArrayXXd& joint_vals,
+                                    const Vec<Transform3r>& base_tfs,
+                                    FKBatch& batch) const {
+  batch.plan       = fk_plan();
+  const auto& plan = *batch.plan;
+
+  constexpr auto POSE_COLS = FKBatch::POSE_COLS;
+  const auto num_configs   = static_cast<Eigen::Index>(base_tfs.size());
+  const auto num_entries   = static_cast<Eigen::Index>(plan.node_idxs.size());
+  batch.poses.resize(num_configs, num_entries * POSE_COLS);
+  batch.collision_poses.resize(num_configs, num_entries * POSE_COLS);
+  batch.local.resize(num_configs, POSE_COLS);
+
+  // The base's parent is the per-configuration base transform
+  Eigen::ArrayXXd base(num_configs, POSE_COLS);
+  for (Eigen::Index k = 0; k < num_configs; ++k) {
+    const auto& base_tf = base_tfs[k];
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        base(k, 3 * i + j) = base_tf.linear()(i, j);
+      }
+
+      base(k, 9 + i) = base_tf.translation()(i);
+    }
+  }
+
+  Eigen::ArrayXd cos_vals(num_configs);
+  Eigen::ArrayXd sin_vals(num_configs);
+  for (Eigen::Index e = 0; e < num_entries; ++e) {
+    const auto type       = plan.types[e];
+    const auto joint_idx  = plan.joint_idxs[e];
+    const auto& axis      = plan.axes[e];
+    const auto& transform = plan.transforms[e];
+    const auto& rotation  = transform.linear();
+    auto& local           = batch.local;
+    switch (type) {
+      case Node::Type::FIXED:
+        set_local(transform, local);
+        break;
+
+      case Node::Type::PRISMATIC: {
+        // transform * Translation(q * axis): the rotation is fixed, and the translation moves along
+        // the rotated axis
+        set_local(transform, local);
+        if (joint_idx >= 0) {
+          const Vector3r direction = rotation * axis;
+          for (int i = 0; i < 3; ++i) {
+            local.col(9 + i) += direction(i) * joint_vals.col(joint_idx);
+          }
+        }
+
+        break;
+      }
+
+      case Node::Type::REVOLUTE:
+      case Node::Type::CONTINUOUS: {
+        // By Rodrigues' formula, transform * AngleAxis(q, axis) has rotation
+        // P + cos(q) Q + sin(q) S, where P, Q, and S are the same for every configuration
+        const Eigen::Matrix3d outer = axis * axis.transpose();
+        Eigen::Matrix3d skew;
+        skew << 0.0, -axis.z(), axis.y(), axis.z(), 0.0, -axis.x(), -axis.y(), axis.x(), 0.0;
+        const Eigen::Matrix3d p = rotation * outer;
+        const Eigen::Matrix3d q = rotation * (Eigen::Matrix3d::Identity() - outer);
+        const Eigen::Matrix3d s = rotation * skew;
+        if (joint_idx >= 0) {
+          const auto& angles = type == Node::Type::CONTINUOUS ? cont_vals.col(joint_idx)
+                                                              : joint_vals.col(joint_idx);
+          cos_vals = angles.cos();
+          sin_vals = angles.sin();
+        } else {
+          cos_vals.setOnes();
+          sin_vals.setZero();
+        }
+
+        for (int i = 0; i < 3; ++i) {
+          for (int j = 0; j < 3; ++j) {
+            local.col(3 * i + j) = p(i, j) + q(i, j) * cos_vals + s(i, j) * sin_vals;
+          }
+
+          local.col(9 + i).setConstant(transform.translation()(i));
+        }
+
+        break;
+      }
+
+      default:
+        throw std::runtime_error(
+        "Invalid joint type in FK! How did this get through construction??");
+    }
+
+    auto pose         = batch.poses.middleCols<POSE_COLS>(e * POSE_COLS);
+    const auto parent = plan.parents[e];
+    if (parent < 0) {
+      compose(base, local, pose);
+    } else {
+      compose(batch.poses.middleCols<POSE_COLS>(parent * POSE_COLS), local, pose);
+    }
+
+    set_local(plan.collision_transforms[e], local);
+    compose(pose, local, batch.collision_poses.middleCols<POSE_COLS>(e * POSE_COLS));
+  }
 }
 
-void Graph::pose_objects(const Map<Str, Transform3r>& poses) {
-  for (auto& tree_idx : trees) {
-    auto& tree = nodes[tree_idx];
-    if (tree.is_object) {
-      tree.transform = poses.at(tree.name);
+void Graph::jacobians(const double* const cont_vals,
+                      const double* const joint_vals,
+                      const Transform3r& base_tf,
+                      const bool base_movable,
+                      const std::size_t num_cont,
+                      const std::size_t num_joints,
+                      FKJacobians& result) const {
+  result.plan            = fk_plan();
+  const auto& plan       = *result.plan;
+  const auto num_entries = plan.node_idxs.size();
+  const int base_cols    = base_movable ? 4 : 0;
+  const int num_cols     = base_cols + num_cont + num_joints;
+  result.poses.resize(num_entries);
+  result.jacobians.resize(num_entries);
+
+  // The base's own motion, as if from a frame at the base's origin
+  Eigen::Matrix<double, 6, Eigen::Dynamic> base_jacobian = Eigen::MatrixXd::Zero(6, num_cols);
+  if (base_movable) {
+    base_jacobian.topLeftCorner<3, 3>().setIdentity();
+    base_jacobian(5, 3) = 1.0;
+  }
+
+  Transform3r coll_tf;
+  for (std::size_t e = 0; e < num_entries; ++e) {
+    const auto parent    = plan.parents[e];
+    const auto type      = plan.types[e];
+    const auto joint_idx = plan.joint_idxs[e];
+    double joint_val     = 0.0;
+    if (joint_idx >= 0) {
+      joint_val = type == Node::Type::CONTINUOUS ? cont_vals[joint_idx] : joint_vals[joint_idx];
+    }
+
+    const auto& parent_tf = parent < 0 ? base_tf : result.poses[parent];
+    auto& pose            = result.poses[e];
+    FKPlan::fk<double>(type,
+                       plan.axes[e],
+                       plan.transforms[e],
+                       plan.collision_transforms[e],
+                       parent_tf,
+                       joint_val,
+                       pose,
+                       coll_tf);
+
+    // Moving the reference point from the parent's origin to this frame's origin adds
+    // angular x offset to every column's linear velocity
+    auto& jacobian      = result.jacobians[e];
+    jacobian            = parent < 0 ? base_jacobian : result.jacobians[parent];
+    const Vector3r step = pose.translation() - parent_tf.translation();
+    for (int col = 0; col < num_cols; ++col) {
+      jacobian.col(col).head<3>() += jacobian.col(col).tail<3>().cross(step);
+    }
+
+    if (joint_idx < 0 || type == Node::Type::FIXED) {
+      continue;
+    }
+
+    // Joint motion leaves the joint axis (and, for rotations, the frame origin) where it is, so
+    // this joint's column can be read off the pose after it
+    const auto type_offset    = type == Node::Type::CONTINUOUS ? 0 : num_cont;
+    const auto col            = base_cols + type_offset + joint_idx;
+    const Vector3r world_axis = pose.linear() * plan.axes[e];
+    if (type == Node::Type::PRISMATIC) {
+      jacobian.col(col).head<3>() += world_axis;
+    } else {
+      jacobian.col(col).tail<3>() += world_axis;
     }
   }
 }
@@ -102,14 +363,14 @@ void Graph::pose_objects(const Map<Str, Transform3r>& poses) {
 Map<Str, Node*> Graph::make_robot_nodes_map(const Map<Str, Str>& name_puns) {
   Map<Str, Node*> result;
   const auto robot_walker = [&](const auto& f, const auto node_idx) -> void {
-    const auto& node = nodes[node_idx];
-    result.emplace(node.name, &nodes[node_idx]);
-    auto pun_it = name_puns.find(node.name);
+    auto* node = &mutable_node(node_idx);
+    result.emplace(node->name, node);
+    auto pun_it = name_puns.find(node->name);
     if (pun_it != name_puns.end()) {
-      result.emplace(pun_it->second, &nodes[node_idx]);
+      result.emplace(pun_it->second, node);
     }
 
-    for (const auto child_idx : node.children) {
+    for (const auto child_idx : node->children) {
       f(f, child_idx);
     }
   };
@@ -117,7 +378,7 @@ Map<Str, Node*> Graph::make_robot_nodes_map(const Map<Str, Str>& name_puns) {
   // Find the base node
   int base_idx = -1;
   for (const auto tree_idx : trees) {
-    if (nodes[tree_idx].is_base) {
+    if (nodes[tree_idx]->is_base) {
       base_idx = tree_idx;
       break;
     }
@@ -4,10 +4,13 @@
 
 #include "common.hh"
 
+#include <atomic>
 #include <functional>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <stdexcept>
 #include <string>
 #include <utility>
 
@@ -26,15 +29,6 @@
 // clang-format on
 
 namespace structures::scenegraph {
-namespace {
-  template <typename T> struct FKCache {
-    T last_joint_val;
-    Transform3<T> last_result;
-    Transform3r last_coll_result;
-    bool first_time = true;
-  };
-}  // namespace
-
 struct Node {
   // We only support these joint types right now
   enum Type { REVOLUTE, PRISMATIC, FIXED, CONTINUOUS };
@@ -50,9 +44,7 @@ struct Node {
   , geom(std::move(geom))
   , type(type)
   , collision_transform(collision_transform)
-  , axis(axis)
-  , dn_cache({0.0, Transform3<addn::DN>::Identity(), collision_transform})
-  , real_cache({0.0, Transform3r::Identity(), collision_transform}) {}
+  , axis(axis) {}
 
   Node(const Node& other) = default;
 
@@ -100,134 +92,239 @@ struct Node {
  private:
   void add_child(Node& child);
   void remove_child(const Node& child);
-  // Store the last values used in pose_tree, to enable avoiding redundant computation
-  FKCache<addn::DN> dn_cache;
-  FKCache<double> real_cache;
 
-  template <typename T> FKCache<T>& select_cache();
-  template <> FKCache<double>& select_cache<double>() { return real_cache; }
+  friend struct Graph;
+};
 
-  template <> FKCache<addn::DN>& select_cache<addn::DN>() { return dn_cache; }
+/// The results of the last FK pass for every entry of an FKPlan, so that entries whose joint and
+/// parent haven't changed can skip recomputing
+template <typename T> struct FKCache {
+  void reset(std::size_t size) {
+    last_joint_val.assign(size, T(0.0));
+    last_result.assign(size, Transform3<T>::Identity());
+    last_coll_result.assign(size, Transform3r::Identity());
+    first_time.assign(size, 1);
+  }
+
+  void clear() {
+    last_joint_val.clear();
+    last_result.clear();
+    last_coll_result.clear();
+    first_time.clear();
+  }
 
+  Vec<T> last_joint_val;
+  Vec<Transform3<T>> last_result;
+  Vec<Transform3r> last_coll_result;
+  Vec<char> first_time;
+};
+
+/// The robot's tree flattened for FK: its nodes in topological order (parents before children),
+/// with everything FK needs from each node in parallel arrays. FK is then a single loop over the
+/// entries instead of a recursion through the node vector
+struct FKPlan {
   template <typename T>
-  void fk(const Transform3<T>& tf,
-          const T joint_val,
-          Transform3<T>& result,
-          Transform3r& coll_result) const {
+  static void fk(const Node::Type type,
+                 const Vector3r& axis,
+                 const Transform3r& transform,
+                 const Transform3r& collision_transform,
+                 const Transform3<T>& parent_tf,
+                 const T joint_val,
+                 Transform3<T>& result,
+                 Transform3r& coll_result) {
     switch (type) {
-      case Type::FIXED:
+      case Node::Type::FIXED:
         // For a fixed joint, the joint_val will always be 0 anyway, so we ignore it
-        fix_fk(tf, result, coll_result);
+        result = parent_tf * transform.template cast<T>();
         break;
 
-      case Type::PRISMATIC:
-        pris_fk(tf, joint_val, result, coll_result);
+      case Node::Type::PRISMATIC:
+        result = parent_tf * transform.template cast<T>() *
+                 Eigen::Translation<T, 3>(joint_val * axis.template cast<T>());
         break;
 
-      case Type::REVOLUTE:
-        rev_fk(tf, joint_val, result, coll_result);
-        break;
-
-      case Type::CONTINUOUS:
-        // This case is the same as Revolute for us because joint limits are handled in the state
-        // space construction
-        rev_fk(tf, joint_val, result, coll_result);
+      // Continuous joints are the same as revolute joints for us, because joint limits are
+      // handled in the state space construction
+      case Node::Type::REVOLUTE:
+      case Node::Type::CONTINUOUS:
+        result = parent_tf * transform.template cast<T>() *
+                 Eigen::Quaternion<T>(Eigen::AngleAxis<T>(joint_val, axis.template cast<T>()));
         break;
 
       default:
         throw std::runtime_error(
         "Invalid joint type in FK! How did this get through construction??");
     }
-  }
 
-  template <typename T>
-  void rev_fk(const Transform3<T>& tf,
-              const T joint_val,
-              Transform3<T>& result,
-              Transform3r& coll_result) const {
-    // axis is guaranteed to be meaningful here
-    Eigen::Quaternion<T> pose(Eigen::AngleAxis<T>(joint_val, axis.template cast<T>()));
-    result      = tf * transform.template cast<T>() * pose;
     coll_result = result.template cast<double>() * collision_transform;
   }
 
-  template <typename T>
-  void pris_fk(const Transform3<T>& tf,
-               const T joint_val,
-               Transform3<T>& result,
-               Transform3r& coll_result) const {
-    // axis is guaranteed to be meaningful here
-    auto pose   = Eigen::Translation<T, 3>(joint_val * axis.template cast<T>());
-    result      = tf * transform.template cast<T>() * pose;
-    coll_result = result.template cast<double>() * collision_transform;
+  // The topology the plan was built for
+  std::size_t topology = 0;
+  Vec<int> node_idxs;
+  // Plan index of each entry's parent, or -1 for the base
+  Vec<int> parents;
+  Vec<Node::Type> types;
+  // Index into the continuous or regular joint values (depending on type), or -1 for none
+  Vec<int> joint_idxs;
+  Vec<Vector3r> axes;
+  Vec<Transform3r> transforms;
+  Vec<Transform3r> collision_transforms;
+};
+
+/// One caller's FK state: the poses of the objects it's checking, the caches from its last pass,
+/// and the plan they belong to. Graphs are only read during FK, so callers with their own
+/// workspaces (e.g. one per collision world) can pose the same graph concurrently, and don't evict
+/// each other's caches
+struct FKWorkspace {
+  template <typename T> FKCache<T>& select_cache();
+  template <> FKCache<double>& select_cache<double>() { return real_cache; }
+  template <> FKCache<addn::DN>& select_cache<addn::DN>() { return dn_cache; }
+  template <typename T> Transform3<T>& get_last_base_tf();
+  template <> Transform3r& get_last_base_tf() { return real_last_base_tf; }
+  template <> Transform3<addn::DN>& get_last_base_tf() { return dn_last_base_tf; }
+
+  /// Switch to a plan, dropping the caches if it isn't the one they were filled for. Each cache is
+  /// only rebuilt when FK next runs with its scalar type, so unused types cost nothing
+  void use_plan(std::shared_ptr<const FKPlan> new_plan) {
+    if (new_plan == plan) {
+      return;
+    }
+
+    plan = std::move(new_plan);
+    updated.assign(plan->node_idxs.size(), 0);
+    real_cache.clear();
+    dn_cache.clear();
   }
 
-  template <typename T>
-  void fix_fk(const Transform3<T>& tf, Transform3<T>& result, Transform3r& coll_result) const {
-    result      = tf * transform.template cast<T>();
-    coll_result = result.template cast<double>() * collision_transform;
+  /// Place the objects at the roots of trees for this workspace's FK passes. Objects without a
+  /// pose stay where their node puts them
+  void pose_objects(const Map<Str, Transform3r>& poses) {
+    object_poses = poses;
+    object_poses_changed();
   }
 
-  template <typename T>
-  void
-  pose_tree(const T* const cont_vals,
-            const T* const joint_vals,
-            const Transform3<T>& parent_tf,
-            const bool new_parent,
-            const bool robot_ancestor,
-            const std::function<void(
-            const Node* const, const bool, const Transform3<T>&, const Transform3r&)>& updater,
-            Vec<Node>& nodes) {
-    T joint_val = 0.0;
-    if (idx) {
-      if (type == CONTINUOUS) {
-        joint_val = cont_vals[*idx];
-      } else {
-        joint_val = joint_vals[*idx];
+  /// Give the object poses a new version. Callers which fill object_poses directly must call this
+  void object_poses_changed() { object_version = ++next_object_version; }
+
+  Map<Str, Transform3r> object_poses;
+  // Identifies the current object_poses among every workspace's, so that anything derived from
+  // them can be cached
+  std::size_t object_version = 0;
+  std::shared_ptr<const FKPlan> plan;
+  // Scratch space for the pass: whether each entry's pose changed
+  Vec<char> updated;
+  FKCache<addn::DN> dn_cache;
+  FKCache<double> real_cache;
+  Transform3r real_last_base_tf        = Transform3r::Identity();
+  Transform3<addn::DN> dn_last_base_tf = Transform3<addn::DN>::Identity();
+
+ private:
+  inline static std::atomic<std::size_t> next_object_version{0};
+};
+
+/// Poses from Graph::update_transforms_batch, with one row per configuration so that each column
+/// is a contiguous run of SIMD lanes. Every FK plan entry has a block of POSE_COLS columns in poses
+/// and collision_poses: its rotation (row-major), then its translation
+struct FKBatch {
+  static constexpr Eigen::Index POSE_COLS = 12;
+
+  Transform3r pose(std::size_t entry, Eigen::Index config) const {
+    return unpack(poses, entry, config);
+  }
+
+  Transform3r collision_pose(std::size_t entry, Eigen::Index config) const {
+    return unpack(collision_poses, entry, config);
+  }
+
+  // The plan whose entries the pose blocks follow
+  std::shared_ptr<const FKPlan> plan;
+  Eigen::ArrayXXd poses;
+  Eigen::ArrayXXd collision_poses;
+  // Scratch space for the local transform of the entry being posed
+  Eigen::ArrayXXd local;
+
+ private:
+  static Transform3r
+  unpack(const Eigen::ArrayXXd& block_poses, std::size_t entry, Eigen::Index config) {
+    const auto* col    = &block_poses(config, entry * POSE_COLS);
+    const auto rows    = block_poses.rows();
+    Transform3r result = Transform3r::Identity();
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        result.linear()(i, j) = col[(3 * i + j) * rows];
       }
-    }
 
-    FKCache<T>& cache       = select_cache<T>();
-    const auto new_pose     = cache.last_joint_val != joint_val;
-    const auto needs_update = cache.first_time || new_parent || new_pose;
-    if (needs_update) {
-      fk(parent_tf, joint_val, cache.last_result, cache.last_coll_result);
-      cache.last_joint_val = joint_val;
-      cache.first_time     = false;
+      result.translation()(i) = col[(9 + i) * rows];
     }
 
-    updater(this, robot_ancestor || is_base, cache.last_result, cache.last_coll_result);
-    for (const auto child_idx : children) {
-      auto& child = nodes[child_idx];
-      child.pose_tree(cont_vals,
-                      joint_vals,
-                      cache.last_result,
-                      needs_update,
-                      robot_ancestor || is_base,
-                      updater,
-                      nodes);
-    }
+    return result;
   }
+};
 
-  friend struct Graph;
+/// Geometric Jacobians of the robot's frames at one configuration, indexed like the entries of
+/// plan. Rows 0-2 are the linear velocity of the frame's origin and rows 3-5 its angular velocity,
+/// per unit change of each state dimension. Columns follow the robot's state layout: the base's x,
+/// y, z, and yaw (if it moves), then the continuous joints, then the other joints
+struct FKJacobians {
+  std::shared_ptr<const FKPlan> plan;
+  Vec<Transform3r> poses;
+  Vec<Eigen::Matrix<double, 6, Eigen::Dynamic>> jacobians;
 };
 
+/// The scene as a forest of nodes. Copies are copy-on-write: a copy shares every node (and the name
+/// index) with the graph it came from, and a graph only clones a node when it is about to change
+/// it, so graphs which differ by a few kinematic links share almost all of their nodes
 struct Graph {
+  Graph() = default;
+  Graph(const Graph& other);
+
+  /// Detach a node from its parent (or from the roots), returning it for changes. The node stays in
+  /// the graph, so it should be put back with add_tree or reparent_child
   Node& extract(const Str& name);
   Node& add_node(int parent_idx, Node node);
-  void add_tree(int idx) { trees.push_back(idx); }
-  void reparent_child(Node& parent, Node& child) { parent.add_child(child); }
+  void add_tree(int idx) {
+    trees.push_back(idx);
+    topology_id = ++next_topology_id;
+  }
+
+  void reparent_child(const Node& parent, Node& child) {
+    mutable_node(parent.self_idx).add_child(child);
+    topology_id = ++next_topology_id;
+  }
+
+  /// Identifies the graph's parent/child structure: copies share it, and it changes whenever nodes
+  /// are added or relinked, so it can key caches of anything derived from the structure
+  std::size_t topology() const { return topology_id; }
   Map<Str, Node*> make_robot_nodes_map(const Map<Str, Str>& name_puns);
 
-  Node& find(const Str& name);
-  template <typename T>
-  void update_transforms(
-  const T* const cont_vals,
-  const T* const joint_vals,
-  const Transform3<T>& base_tf,
-  const std::function<
-  void(const Node* const, const bool, const Transform3<T>&, const Transform3r&)>& updater) {
-    auto& old_base_tf = get_last_base_tf<T>();
+  const Node& find(const Str& name) const { return *nodes[idx_index->at(name)]; }
+  bool contains(const Str& name) const { return idx_index->find(name) != idx_index->end(); }
+  /// True if the named node hangs off the robot (e.g. a held object) rather than off the world
+  bool attached_to_robot(const Str& name) const;
+  /// Run FK, calling updater with every node, whether it's part of the robot, its pose, and the
+  /// pose of its collision geometry. This uses the calling thread's default workspace
+  template <typename T, typename F>
+  void update_transforms(const T* const cont_vals,
+                         const T* const joint_vals,
+                         const Transform3<T>& base_tf,
+                         F&& updater) const {
+    update_transforms<T>(cont_vals, joint_vals, base_tf, default_workspace(), updater);
+  }
+
+  /// Run FK as above, with the caches in the caller's own workspace
+  template <typename T, typename F>
+  void update_transforms(const T* const cont_vals,
+                         const T* const joint_vals,
+                         const Transform3<T>& base_tf,
+                         FKWorkspace& workspace,
+                         F&& updater) const {
+    // Workspaces keep the plan they last used, so only a changed topology needs the lock
+    if (workspace.plan == nullptr || workspace.plan->topology != topology_id) {
+      workspace.use_plan(fk_plan());
+    }
+
+    auto& old_base_tf = workspace.get_last_base_tf<T>();
     // NOTE: For many floating point values, this will be wrong! But that's ok, because it will
     // always be wrong in the direction of assuming identical parents are not identical, and
     // that's a conservative approximation for a cache
@@ -235,27 +332,125 @@ struct Graph {
     old_base_tf.matrix().cwiseEqual(base_tf.matrix()).count() < old_base_tf.matrix().size();
     old_base_tf = base_tf;
     for (const auto tree_idx : trees) {
-      auto& tree = nodes[tree_idx];
+      const auto& tree = *nodes[tree_idx];
       if (tree.is_base) {
-        tree.pose_tree<T>(cont_vals, joint_vals, base_tf, base_tf_is_new, false, updater, nodes);
+        pose_robot_tree<T>(cont_vals, joint_vals, base_tf, base_tf_is_new, workspace, updater);
       } else {
         // NOTE: This is a hack and is wrong if we have objects on other objects, e.g. a tray
-        updater(&tree, false, tree.transform.template cast<T>(), tree.collision_transform);
+        const auto pose_it = tree.is_object ? workspace.object_poses.find(tree.name) :
+                                              workspace.object_poses.end();
+        const auto& pose =
+        pose_it != workspace.object_poses.end() ? pose_it->second : tree.transform;
+        updater(&tree, false, pose.template cast<T>(), tree.collision_transform);
       }
     }
   }
 
-  void pose_objects(const Map<Str, Transform3r>& poses);
+  /// Run FK for the robot's tree in many configurations at once. Row k of cont_vals and joint_vals
+  /// and base_tfs[k] make up configuration k. Poses are written to batch, in the order given by
+  /// fk_node
+  void update_transforms_batch(const Eigen::ArrayXXd& cont_vals,
+                               const Eigen::ArrayXXd& joint_vals,
+                               const Vec<Transform3r>& base_tfs,
+                               FKBatch& batch) const;
+  /// Run FK for the robot's tree in one configuration, along with the Jacobian of each of its
+  /// frames. The base yaw column is a rotation about the world Z axis through the base's origin
+  void jacobians(const double* cont_vals,
+                 const double* joint_vals,
+                 const Transform3r& base_tf,
+                 bool base_movable,
+                 std::size_t num_cont,
+                 std::size_t num_joints,
+                 FKJacobians& result) const;
+  /// The FK plan for the graph's current topology, built on first use
+  std::shared_ptr<const FKPlan> fk_plan() const;
+  /// The node for each FK plan entry, e.g. for the pose blocks from update_transforms_batch
+  const Node& fk_node(const FKPlan& plan, std::size_t entry) const {
+    return *nodes[plan.node_idxs[entry]];
+  }
+
+  /// Place the objects at the roots of trees for the calling thread's default workspace. The
+  /// graph itself isn't changed; see FKWorkspace::pose_objects
+  void pose_objects(const Map<Str, Transform3r>& poses) const {
+    default_workspace().pose_objects(poses);
+  }
+
+  /// The version of the object poses in the calling thread's default workspace
+  std::size_t object_version() const { return default_workspace().object_version; }
 
  private:
   Vec<int> trees;
-  Vec<Node> nodes;
-  tsl::robin_map<Str, int> idx_index;
-  template <typename T> Transform3<T>& get_last_base_tf();
-  template <> Transform3r& get_last_base_tf() { return real_last_base_tf; }
-  template <> Transform3<addn::DN>& get_last_base_tf() { return dn_last_base_tf; }
-  Transform3r real_last_base_tf        = Transform3r::Identity();
-  Transform3<addn::DN> dn_last_base_tf = Transform3<addn::DN>::Identity();
+  // NOTE: Nodes are shared between copies of the graph, so they must only be changed through
+  // mutable_node. Object poses live in FK workspaces rather than here, so FK never writes them
+  Vec<std::shared_ptr<Node>> nodes;
+  using NameIndex = tsl::robin_map<Str, int>;
+  std::shared_ptr<NameIndex> idx_index = std::make_shared<NameIndex>();
+  inline static std::atomic<std::size_t> next_topology_id{0};
+  std::size_t topology_id = ++next_topology_id;
+  // Plans are immutable once built, so copies (which start with the same topology) share them
+  mutable std::shared_ptr<const FKPlan> cached_plan;
+  mutable std::mutex plan_mutex;
+
+  /// Flatten the tree under the robot base into a plan
+  std::shared_ptr<const FKPlan> build_fk_plan() const;
+  static FKWorkspace& default_workspace() {
+    thread_local FKWorkspace workspace;
+    return workspace;
+  }
+
+  /// The node at idx, cloned first if any other graph shares it
+  Node& mutable_node(int idx);
+
+  template <typename T, typename F>
+  void pose_robot_tree(const T* const cont_vals,
+                       const T* const joint_vals,
+                       const Transform3<T>& base_tf,
+                       const bool base_tf_is_new,
+                       FKWorkspace& workspace,
+                       F& updater) const {
+    const auto& plan       = *workspace.plan;
+    auto& cache            = workspace.select_cache<T>();
+    const auto num_entries = plan.node_idxs.size();
+    if (cache.first_time.size() != num_entries) {
+      cache.reset(num_entries);
+    }
+
+    const auto* parents    = plan.parents.data();
+    const auto* types      = plan.types.data();
+    const auto* joint_idxs = plan.joint_idxs.data();
+    auto* updated          = workspace.updated.data();
+    auto* last_joint_val   = cache.last_joint_val.data();
+    auto* last_result      = cache.last_result.data();
+    auto* last_coll_result = cache.last_coll_result.data();
+    auto* first_time       = cache.first_time.data();
+    for (std::size_t i = 0; i < num_entries; ++i) {
+      const auto parent    = parents[i];
+      const auto type      = types[i];
+      const auto joint_idx = joint_idxs[i];
+      T joint_val          = 0.0;
+      if (joint_idx >= 0) {
+        joint_val = type == Node::Type::CONTINUOUS ? cont_vals[joint_idx] : joint_vals[joint_idx];
+      }
+
+      const auto new_parent   = parent < 0 ? base_tf_is_new : static_cast<bool>(updated[parent]);
+      const auto needs_update = first_time[i] || new_parent || last_joint_val[i] != joint_val;
+      if (needs_update) {
+        FKPlan::fk<T>(type,
+                      plan.axes[i],
+                      plan.transforms[i],
+                      plan.collision_transforms[i],
+                      parent < 0 ? base_tf : last_result[parent],
+                      joint_val,
+                      last_result[i],
+                      last_coll_result[i]);
+        last_joint_val[i] = joint_val;
+        first_time[i]     = 0;
+      }
+
+      updated[i] = needs_update;
+      updater(nodes[plan.node_idxs[i]].get(), true, last_result[i], last_coll_result[i]);
+    }
+  }
 };
 
 }  // namespace structures::scenegraph